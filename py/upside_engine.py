@@ -51,6 +51,19 @@ calc.get_output.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p, ct.c_char_p]
 calc.get_value_by_name.restype  = ct.c_int
 calc.get_value_by_name.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p, ct.c_char_p, ct.c_char_p]
 
+calc.construct_deriv_engine_pool.restype  = ct.c_void_p
+calc.construct_deriv_engine_pool.argtypes = [ct.c_int, ct.c_int, ct.c_char_p, ct.c_bool]
+
+calc.free_deriv_engine_pool.restype  = None
+calc.free_deriv_engine_pool.argtypes = [ct.c_void_p]
+
+calc.set_param_pool.restype  = ct.c_int
+calc.set_param_pool.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p, ct.c_char_p]
+
+calc.evaluate_batch.restype  = ct.c_int
+calc.evaluate_batch.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p, ct.c_void_p, ct.c_void_p,
+                                ct.c_int, ct.c_void_p, ct.c_char_p]
+
 calc.get_clamped_value_and_deriv.restype  = ct.c_int
 calc.get_clamped_value_and_deriv.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p, ct.c_int, ct.c_void_p]
 
@@ -241,6 +254,58 @@ class Upside(object):
     def __del__(self):
         calc.free_deriv_engine(self.engine)
 
+class UpsidePool(object):
+    '''Evaluate batches of configurations in parallel with a pool of engines
+
+    n_engine of 0 uses one engine for each OpenMP thread'''
+    def __init__(self, config_file_path, n_engine=0, quiet=True):
+        self.config_file_path = str(config_file_path)
+        with tb.open_file(self.config_file_path) as t:
+            self.n_atom = t.root.input.pos.shape[0]
+        self.pool = calc.construct_deriv_engine_pool(int(n_engine), self.n_atom, self.config_file_path, bool(quiet))
+        if self.pool is None: raise RuntimeError('Unable to initialize upside engine pool for %s'%(config_file_path,))
+
+    def __repr__(self):
+        return 'UpsidePool(%r, %r)'%(self.n_atom, self.config_file_path)
+
+    def evaluate(self, pos, deriv=True, param_deriv_node=None, param_shape=None):
+        '''Returns energies of shape (n_batch,), and optionally derivatives of shape
+        (n_batch,n_atom,3) and parameter derivatives of shape (n_batch,)+param_shape
+        for the node param_deriv_node'''
+        pos = np.require(pos, dtype='f4', requirements='C')
+        assert len(pos.shape)==3 and pos.shape[1:] == (self.n_atom,3)
+        n_batch = pos.shape[0]
+
+        energy = np.zeros(n_batch, dtype='f4')
+        d = np.zeros(pos.shape, dtype='f4') if deriv else None
+        if param_deriv_node is not None:
+            pd = np.zeros((n_batch,)+tuple(param_shape), dtype='f4')
+            n_param = int(np.prod(param_shape))
+        else:
+            pd = None
+            n_param = 0
+
+        retcode = calc.evaluate_batch(n_batch, energy.ctypes.data,
+                None if d is None else d.ctypes.data,
+                self.pool, pos.ctypes.data, n_param,
+                None if pd is None else pd.ctypes.data,
+                param_deriv_node)
+        if retcode: raise RuntimeError('Unable to evaluate batch')
+
+        ret = [energy]
+        if deriv: ret.append(d)
+        if pd is not None: ret.append(pd)
+        return ret[0] if len(ret)==1 else tuple(ret)
+
+    def set_param(self, param, node_name):
+        param_size = param.shape
+        param = np.require(param.ravel(), dtype='f4', requirements='C')  # flatten and make contiguous
+        retcode = calc.set_param_pool(int(param.shape[0]), param.ctypes.data, self.pool, node_name)
+        if retcode: raise RuntimeError('Unable to set param with size %s for node %s'%(param_size,node_name))
+
+    def __del__(self):
+        calc.free_deriv_engine_pool(self.pool)
+
 def get_rotamer_graph(engine):
     n_node, n_edge = engine.get_value_by_name((2,),         'rotamer', 'graph_nodes_edges_sizes').astype('i')
     node_prob      = engine.get_value_by_name((n_node,3),   'rotamer', 'graph_node_prob')
@@ -88,6 +88,7 @@ struct alignas(16) Int4
         Int4 operator==(const Int4 &o) const {return Int4(_mm_cmpeq_epi32(vec,o.vec));}
         Int4 operator&(const Int4 &o) const {return Int4(_mm_and_si128(vec,o.vec));}
         Int4 operator|(const Int4 &o) const {return Int4(_mm_or_si128(vec,o.vec));}
+        Int4 operator^(const Int4 &o) const {return Int4(_mm_xor_si128(vec,o.vec));}
         Int4 operator!=(const Int4 &o) const {
             __m128i all_zero = _mm_setzero_si128();
             __m128i all_one  = _mm_cmpeq_epi32(all_zero, all_zero);
@@ -113,6 +114,7 @@ struct alignas(16) Int4
         int movemask() {return _mm_movemask_ps(_mm_castsi128_ps(vec));}
 
         friend Float4;
+        friend struct Int8;
         // Float4 Int4::cast_float() const {
         //     // bit-equivalent cast to float
         //     return Float4(_mm_castps_si128(vec));
@@ -162,6 +164,12 @@ struct alignas(16) Float4
             vec = _mm_load_ps(data);
         }
 
+        // move the entries selected by mask to the front, as for Int4::left_pack
+        Float4 left_pack(int mask) const {
+            return Float4(_mm_castsi128_ps(_mm_shuffle_epi8(_mm_castps_si128(vec),
+                            ((__m128i*)left_pack_control_vector)[mask])));
+        }
+
         template <int i>
         Float4 broadcast() const {
             return Float4(_mm_shuffle_ps(vec,vec, _MM_SHUFFLE(i,i,i,i)));
@@ -307,6 +315,7 @@ struct alignas(16) Float4
         float w() const { float val; _MM_EXTRACT_FLOAT(val, vec, 3); return val;}
 
         friend Int4;
+        friend struct Float8;
         friend void transpose4(Float4&, Float4&, Float4&, Float4&);
         template <int i3, int i2, int i1, int i0> friend Float4 shuffle(Float4 m1, Float4 m2);
 
@@ -322,7 +331,86 @@ struct alignas(16) Float4
         friend inline Float4 horizontal_add(const Float4& x1, const Float4& x2);
 };
 
-/*
+#if defined(__AVX2__) && defined(__BMI2__)
+// 8-wide versions of Int4 and Float4 with the same interface.  Code that is generic over the
+// lane width should use SimdLanes<W> below rather than these types directly.
+#define UPSIDE_HAVE_FLOAT8
+
+struct Int8;
+struct Float8;
+
+struct alignas(32) Int8
+{
+    protected:
+        __m256i vec;
+        Int8(__m256i vec_):
+            vec(vec_)
+        {};
+
+    public:
+        Int8(): vec(_mm256_setzero_si256()) {}
+
+        // constructor from aligned storage
+        explicit Int8(const int32_t* vec_, Alignment align = Alignment::aligned):
+            vec(align==Alignment::aligned ? _mm256_load_si256((__m256i*)vec_) : _mm256_loadu_si256((__m256i*)vec_)) {}
+
+        // broadcast constructor
+        explicit Int8(const int val):
+            vec(_mm256_set1_epi32(val)) {}
+
+        // gather constructor from offsets
+        Int8(const int32_t* base, const Int8& offsets):
+            vec(_mm256_i32gather_epi32(base, offsets.vec, 4)) {}
+
+        // concatenation of two Int4's
+        Int8(const Int4& lo, const Int4& hi);
+
+        Int8 left_pack(int mask) const {
+            // Build the permutation from the mask with pdep/pext rather than a 256-entry table
+            uint64_t expanded_mask = _pdep_u64(mask, 0x0101010101010101ull) * 0xffu;
+            uint64_t indices = _pext_u64(0x0706050403020100ull, expanded_mask);
+            return Int8(_mm256_permutevar8x32_epi32(vec, _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(indices))));
+        }
+
+        Int8 left_pack_inplace(int mask) {
+            return *this = left_pack(mask);
+        }
+
+        Int8 operator+(const Int8 &o) const {return Int8(_mm256_add_epi32  (vec, o.vec));}
+        Int8 operator-(const Int8 &o) const {return Int8(_mm256_sub_epi32  (vec, o.vec));}
+        Int8 operator-()              const {return _mm256_sub_epi32(_mm256_setzero_si256(), vec);}
+        Int8 operator*(const Int8 &o) const {return Int8(_mm256_mullo_epi32(vec, o.vec));}
+        Int8 operator<(const Int8 &o) const {return Int8(_mm256_cmpgt_epi32(o.vec,vec));}
+        Int8 operator==(const Int8 &o) const {return Int8(_mm256_cmpeq_epi32(vec,o.vec));}
+        Int8 operator&(const Int8 &o) const {return Int8(_mm256_and_si256(vec,o.vec));}
+        Int8 operator|(const Int8 &o) const {return Int8(_mm256_or_si256(vec,o.vec));}
+        Int8 operator^(const Int8 &o) const {return Int8(_mm256_xor_si256(vec,o.vec));}
+        Int8 operator!=(const Int8 &o) const {
+            __m256i all_one = _mm256_set1_epi32(-1);
+            return Int8(_mm256_xor_si256(all_one, _mm256_cmpeq_epi32(vec,o.vec)));
+        }
+
+        Int8 operator|=(const Int8 &o) {return vec = _mm256_or_si256(vec,o.vec);}
+
+        bool any () const {return !_mm256_testz_si256(vec,vec);}
+        bool none() const {return  _mm256_testz_si256(vec,vec);}
+
+        int movemask() const {return _mm256_movemask_ps(_mm256_castsi256_ps(vec));}
+
+        friend Float8;
+
+        void store(int32_t* vec_, Alignment align=Alignment::aligned) const { 
+            if(align==Alignment::aligned) 
+                _mm256_store_si256 ((__m256i*)vec_, vec); 
+            else 
+                _mm256_storeu_si256((__m256i*)vec_,vec);
+        }
+
+        Int8 srl(int shift_count) const {return Int8(_mm256_srli_epi32(vec,shift_count));} // right logical shift
+        Int8 sll(int shift_count) const {return Int8(_mm256_slli_epi32(vec,shift_count));} // left  logical shift
+};
+
+
 struct alignas(32) Float8 
 {
     protected:
@@ -332,32 +420,65 @@ struct alignas(32) Float8
         {};
 
     public:
+        typedef Float8 scalar_t;
         Float8(): vec(_mm256_setzero_ps()) {}
 
         // constructor from aligned storage
-        explicit Float8(const float* vec, Alignment align = Alignment::aligned):
-            vec(align==Alignment::aligned ? _mm256_load_ps(vec) : _mm256_loadu_ps(vec)) {}
+        explicit Float8(const float* vec_, Alignment align = Alignment::aligned):
+            vec(align==Alignment::aligned ? _mm256_load_ps(vec_) : _mm256_loadu_ps(vec_)) {}
 
         // broadcast constructor
-        Float8(float val):   
-            vec(_mm256_broadcast_ps(val)) {}
-
-        Float8 operator+(const Float8 &o) const {return Float8(_mm256_add_ps  (vec, o.vec));}
-        Float8 operator-(const Float8 &o) const {return Float8(_mm256_sub_ps  (vec, o.vec));}
-        Float8 operator*(const Float8 &o) const {return Float8(_mm256_mul_ps  (vec, o.vec));}
-        Float8 operator<(const Float8 &o) const {return Float8(_mm256_cmp_ps(vec,o.vec,_CMP_LT_OQ));}
-        Float8 operator!=(const Float8 &o) const {return Float8(_mm256_cmp_ps(vec,o.vec,_CMP_NEQ_OQ));}
+        Float8(const float val):   
+            vec(_mm256_set1_ps(val)) {}
+
+        // gather constructor from offsets
+        Float8(const float* base, const Int8& offsets):
+            vec(_mm256_i32gather_ps(base, offsets.vec, 4)) {}
+
+        // concatenation of two Float4's
+        Float8(const Float4& lo, const Float4& hi);
+
+        // move the entries selected by mask to the front, as for Int8::left_pack
+        Float8 left_pack(int mask) const {
+            return Float8(_mm256_castsi256_ps(Int8(_mm256_castps_si256(vec)).left_pack(mask).vec));
+        }
+
+        Float8 operator+ (const Float8 &o) const {return Float8(_mm256_add_ps  (vec, o.vec));}
+        Float8 operator- (const Float8 &o) const {return Float8(_mm256_sub_ps  (vec, o.vec));}
+        Float8 operator- ()                const {return _mm256_sub_ps(_mm256_setzero_ps(), vec);}
+        Float8 operator* (const Float8 &o) const {return Float8(_mm256_mul_ps  (vec, o.vec));}
+        Float8 operator< (const Float8 &o) const {return Float8(_mm256_cmp_ps(vec,o.vec,_CMP_LT_OQ));}
+        Float8 operator<=(const Float8 &o) const {return Float8(_mm256_cmp_ps(vec,o.vec,_CMP_LE_OQ));}
+        Float8 operator!=(const Float8 &o) const {return Float8(_mm256_cmp_ps(vec,o.vec,_CMP_NEQ_UQ));}
         Float8 operator==(const Float8 &o) const {return Float8(_mm256_cmp_ps(vec,o.vec,_CMP_EQ_OQ));}
-        Float8 operator&(const Float8 &o) const {return Float8(_mm256_and_ps(vec,o.vec));}
-        Float8 operator|(const Float8 &o) const {return Float8(_mm256_or_ps(vec,o.vec));}
-        Float8 sqrt() const {return Float8(_mm256_sqrt_ps(vec));}
+        Float8 operator& (const Float8 &o) const {return Float8(_mm256_and_ps(vec,o.vec));}
+        Float8 operator| (const Float8 &o) const {return Float8(_mm256_or_ps(vec,o.vec));}
+
+        Float8 approx_rsqrt() const {return _mm256_rsqrt_ps(vec);}
+        Float8 approx_rcp()   const {return _mm256_rcp_ps(vec);}
+        Float8 rsqrt() const { 
+            // one round of newton-raphson, as for Float4
+            Float8 a = _mm256_rsqrt_ps(vec);
+            return Float8(1.5f)*a - (Float8(0.5f)*(*this)) * a * (a*a);
+        }
+        Float8 rcp() const {
+            auto x = approx_rcp();
+            return x*(Float8(2.f) - (*this)*x);
+        }
+        Float8 sqrt() const {return _mm256_sqrt_ps(vec);}
+
+        Float8 abs() const {
+            return _mm256_and_ps(vec, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)));
+        }
 
         Float8 operator+=(const Float8 &o) {return vec = _mm256_add_ps(vec, o.vec);}
         Float8 operator-=(const Float8 &o) {return vec = _mm256_sub_ps(vec, o.vec);}
         Float8 operator*=(const Float8 &o) {return vec = _mm256_mul_ps(vec, o.vec);}
+        Float8 operator|=(const Float8 &o) {return vec = _mm256_or_ps(vec,o.vec);}
 
-        // int movemask() {return _mm256_movemask_ps(vec);}
-        // bool any() {return movemask();}
+        int movemask() const {return _mm256_movemask_ps(vec);}
+        bool none() const {__m256i v = _mm256_castps_si256(vec); return _mm256_testz_si256(v,v);}
+        bool any() const  {return !none();}
 
         void store(float* vec_, Alignment align=Alignment::aligned) const { 
             if(align==Alignment::aligned) 
@@ -366,8 +487,9 @@ struct alignas(32) Float8
                 _mm256_storeu_ps(vec_,vec);
         }
 
-
         Float8 swap_halves() const {return Float8(_mm256_permute2f128_ps(vec,vec,1));}
+        Float4 low()  const {return Float4(_mm256_castps256_ps128(vec));}
+        Float4 high() const {return Float4(_mm256_extractf128_ps(vec,1));}
 
         float sum() const {
             __m256 half_sum = _mm256_add_ps(vec, swap_halves().vec);
@@ -378,8 +500,28 @@ struct alignas(32) Float8
             _mm_store_ss(&ret, _mm256_castps256_ps128(x));
             return ret;
         }
+
+        //   c.ternary(a,b)  ==  c ? a : b;
+        Float8 ternary(const Float8& a, const Float8& b) const {
+            return Float8(_mm256_blendv_ps(b.vec, a.vec, vec));
+        }
+
+        Int8 truncate_to_int() const {return Int8(_mm256_cvttps_epi32(vec));}
+
+        Int8 cast_int() const {
+            // bit-equivalent cast to int
+            return Int8(_mm256_castps_si256(vec));
+        } 
+
+        friend Int8;
+        friend void transpose4(Float8&, Float8&, Float8&, Float8&);
+        friend inline Float8 fmadd(const Float8& a1, const Float8& a2, const Float8& b);
+        friend inline Float8 fmsub(const Float8& a1, const Float8& a2, const Float8& b);
+        friend inline Float8 min(const Float8& a, const Float8& b);
+        friend inline Float8 max(const Float8& a, const Float8& b);
 };
-*/
+#endif
+
 
 static void print_vector(const char* nm, const Float4& val) {
     printf("%s % .2f % .2f % .2f % .2f\n", nm, val.x(), val.y(), val.z(), val.w());
@@ -519,6 +661,134 @@ inline Float4 copysignf(const Float4 &mag_carrier, const Float4 &sign_carrier) {
     return mag_carrier.copysign(sign_carrier);
 }
 
+#ifdef UPSIDE_HAVE_FLOAT8
+inline Int8::Int8(const Int4& lo, const Int4& hi):
+    vec(_mm256_inserti128_si256(_mm256_castsi128_si256(lo.vec), hi.vec, 1)) {}
+
+inline Float8::Float8(const Float4& lo, const Float4& hi):
+    vec(_mm256_insertf128_ps(_mm256_castps128_ps256(lo.vec), hi.vec, 1)) {}
+
+// transposes the 4x4 blocks in the low and high halves independently
+inline void transpose4(Float8 &x, Float8 &y, Float8 &z, Float8 &w)
+{
+    __m256 t0 = _mm256_unpacklo_ps(x.vec, y.vec);
+    __m256 t1 = _mm256_unpacklo_ps(z.vec, w.vec);
+    __m256 t2 = _mm256_unpackhi_ps(x.vec, y.vec);
+    __m256 t3 = _mm256_unpackhi_ps(z.vec, w.vec);
+    x.vec = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1,0,1,0));
+    y.vec = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3,2,3,2));
+    z.vec = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1,0,1,0));
+    w.vec = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3,2,3,2));
+}
+
+inline Float8 fmadd(const Float8& a1, const Float8& a2, const Float8& b) {
+    return Float8(_mm256_fmadd_ps(a1.vec,a2.vec, b.vec));
+}
+inline Float8 fmsub(const Float8& a1, const Float8& a2, const Float8& b) {
+    return Float8(_mm256_fmsub_ps(a1.vec,a2.vec, b.vec));
+}
+inline Float8 min(const Float8& a, const Float8& b) {return _mm256_min_ps(a.vec, b.vec);}
+inline Float8 max(const Float8& a, const Float8& b) {return _mm256_max_ps(a.vec, b.vec);}
+
+inline Float8 rsqrt(const Float8& x) { return x.rsqrt(); }
+inline Float8 sqrtf(const Float8& x) { return x.sqrt(); }
+inline Float8 rcp(const Float8& x) { return x.rcp();}
+inline Float8 ternary(const Float8& which, const Float8& a, const Float8& b) {return which.ternary(a,b);}
+inline bool any(const Float8& x) {return x.any();}
+inline bool none(const Float8& x) {return x.none();}
+#endif
+
+// Load rows of 4 floats from base+stride*index[j] for each lane j and transpose, so that
+// x, y, z, and w hold the first through fourth entries of each row
+inline void load_transposed4(const float* base, int stride, const int32_t* index,
+        Float4& x, Float4& y, Float4& z, Float4& w) {
+    x = Float4(base+stride*index[0]);
+    y = Float4(base+stride*index[1]);
+    z = Float4(base+stride*index[2]);
+    w = Float4(base+stride*index[3]);
+    transpose4(x,y,z,w);
+}
+
+#ifdef UPSIDE_HAVE_FLOAT8
+inline void load_transposed4(const float* base, int stride, const int32_t* index,
+        Float8& x, Float8& y, Float8& z, Float8& w) {
+    x = Float8(Float4(base+stride*index[0]), Float4(base+stride*index[4]));
+    y = Float8(Float4(base+stride*index[1]), Float4(base+stride*index[5]));
+    z = Float8(Float4(base+stride*index[2]), Float4(base+stride*index[6]));
+    w = Float8(Float4(base+stride*index[3]), Float4(base+stride*index[7]));
+    transpose4(x,y,z,w);
+}
+#endif
+
+// As load_transposed4, for rows of 4 floats at rows[j] for each lane j
+inline void load_transposed4(const float* const* rows, Float4& x, Float4& y, Float4& z, Float4& w) {
+    x = Float4(rows[0]);
+    y = Float4(rows[1]);
+    z = Float4(rows[2]);
+    w = Float4(rows[3]);
+    transpose4(x,y,z,w);
+}
+
+#ifdef UPSIDE_HAVE_FLOAT8
+inline void load_transposed4(const float* const* rows, Float8& x, Float8& y, Float8& z, Float8& w) {
+    x = Float8(Float4(rows[0]), Float4(rows[4]));
+    y = Float8(Float4(rows[1]), Float4(rows[5]));
+    z = Float8(Float4(rows[2]), Float4(rows[6]));
+    w = Float8(Float4(rows[3]), Float4(rows[7]));
+    transpose4(x,y,z,w);
+}
+#endif
+
+// Inverse of load_transposed4, which stores the rows
+inline void store_transposed4(float* base, int stride, const int32_t* index,
+        Float4 x, Float4 y, Float4 z, Float4 w) {
+    transpose4(x,y,z,w);
+    x.store(base+stride*index[0]);
+    y.store(base+stride*index[1]);
+    z.store(base+stride*index[2]);
+    w.store(base+stride*index[3]);
+}
+
+#ifdef UPSIDE_HAVE_FLOAT8
+inline void store_transposed4(float* base, int stride, const int32_t* index,
+        Float8 x, Float8 y, Float8 z, Float8 w) {
+    transpose4(x,y,z,w);
+    x.low ().store(base+stride*index[0]);
+    y.low ().store(base+stride*index[1]);
+    z.low ().store(base+stride*index[2]);
+    w.low ().store(base+stride*index[3]);
+    x.high().store(base+stride*index[4]);
+    y.high().store(base+stride*index[5]);
+    z.high().store(base+stride*index[6]);
+    w.high().store(base+stride*index[7]);
+}
+#endif
+
+// Lane types by width, so that kernels may be written once for any width.  quad(x,k) is
+// lanes 4k..4k+3 of x, and join is its inverse, for code that handles 4 lanes at a time.
+template <int W> struct SimdLanes;
+template <> struct SimdLanes<4> {
+    typedef Float4 Float; typedef Int4 Int;
+    static Float4 quad(const Float4& x, int k) {return x;}
+    static Float4 join(const Float4* q) {return q[0];}
+};
+#ifdef UPSIDE_HAVE_FLOAT8
+template <> struct SimdLanes<8> {
+    typedef Float8 Float; typedef Int8 Int;
+    static Float4 quad(const Float8& x, int k) {return k ? x.high() : x.low();}
+    static Float8 join(const Float4* q) {return Float8(q[0],q[1]);}
+};
+#endif
+template <int W> using FloatLanes = typename SimdLanes<W>::Float;
+template <int W> using IntLanes   = typename SimdLanes<W>::Int;
+
+// widest lane width available for this build
+#ifdef UPSIDE_HAVE_FLOAT8
+constexpr static int max_simd_width = 8;
+#else
+constexpr static int max_simd_width = 4;
+#endif
+
 inline Float4 approx_max_normalize3(const Float4& o) {
     auto m = max(o.broadcast<0>(), max(o.broadcast<1>(), o.broadcast<2>()));
     return o*approx_rcp(m);
@@ -47,14 +47,14 @@ struct BackbonePairs : public PotentialNode
     vector<AffineParams> params;
     vector<RefPos> ref_pos;
     PairlistComputation<true> pairlist;
-    unique_ptr<int32_t[]> id;
+    aligned_ptr<int32_t> id;
     float dist_cutoff;
 
     BackbonePairs(hid_t grp, CoordNode& alignment_):
         PotentialNode(),
         n_residue(get_dset_size(1, grp, "id")[0]), alignment(alignment_), 
         params(n_residue), ref_pos(n_residue),
-        pairlist(n_residue, n_residue, (n_residue*(n_residue-1))/2),
+        pairlist(n_residue, n_residue, 16*n_residue),  // grows as needed
         id(new_aligned<int32_t>(n_residue,16))
     {
         check_elem_width(alignment, 7);
@@ -81,7 +81,7 @@ struct BackbonePairs : public PotentialNode
     virtual void compute_value(ComputeMode mode) {
         Timer timer(string("backbone_pairs"));
 
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = mode!=DerivMode ? &potential : nullptr;
         VecArrayStorage coords(3,round_up(n_residue,4));
         vector<int>    ref_pos_atoms (n_residue);
         vector<float3> ref_pos_coords(n_residue*4);
@@ -3,35 +3,48 @@
 
 #include "vector_math.h"
 #include "spline.h"
+#include "h5_support.h"
+#include <string>
+
+// Knot counts of the bead splines for each supported parameter set.  n_param is a template
+// parameter of InteractionGraph (as a constexpr member of IType), so the bead interactions are
+// instantiated for every set and the set is chosen when the node is created (see
+// create_for_bead_knots).
+struct BeadKnotsStandard {
+    constexpr static int   n_knot_sc_sc = 9,  n_knot_sc_bb = 7,  n_knot_angular = 8;
+    constexpr static float knot_spacing = 1.f;
+};
+
+struct BeadKnots7A {
+    constexpr static int   n_knot_sc_sc = 16, n_knot_sc_bb = 12, n_knot_angular = 15;
+    constexpr static float knot_spacing = 0.5f;
+};
 
-// Due to a cascade of requirements because I made n_param essentially a template parameter
-// of InteractionGraph (as a constexpr member of IType), I have to switch out the number of 
-// knots for the various splines using the preprocessor defines.  This is poor practice
-// FIXME Make n_param and the various n_knots proper runtime flags, probably by making sure
-// that InteractionGraph receives an IType object rather than just using it as a namespace.
+struct BeadKnots10A {
+    constexpr static int   n_knot_sc_sc = 12, n_knot_sc_bb = 12, n_knot_angular = 8;
+    constexpr static float knot_spacing = 1.f;
+};
+
+// The PARAM_7A_CUTOFF and PARAM_10A_CUTOFF defines only select the set that is tried first
 #if defined(PARAM_7A_CUTOFF)
-    #define N_KNOT_SC_SC   16
-    #define N_KNOT_SC_BB   12
-    #define N_KNOT_ANGULAR 15
-    #define KNOT_SPACING   0.5f
+typedef BeadKnots7A       DefaultBeadKnots;
 #elif defined(PARAM_10A_CUTOFF)
-    #define N_KNOT_SC_SC   12
-    #define N_KNOT_SC_BB   12
-    #define N_KNOT_ANGULAR 8
-    #define KNOT_SPACING   1.f
+typedef BeadKnots10A      DefaultBeadKnots;
 #else
-    #define N_KNOT_SC_SC   9
-    #define N_KNOT_SC_BB   7
-    #define N_KNOT_ANGULAR 8
-    #define KNOT_SPACING   1.f
+typedef BeadKnotsStandard DefaultBeadKnots;
 #endif
 
 namespace {
-    template<int n_knot_angular, int n_knot, int n_dim1, int n_dim2>
-        inline Float4 quadspline(
+    // Geometry of quadspline, where splines(angular_sigmoid1, angular_sigmoid2, wide_cover,
+    // narrow_cover, dist2, dist_coord, cos_cov_angle1, cos_cov_angle2) evaluates the four
+    // splines.  Derivatives are with respect to the spline coordinates, dist_coord for the
+    // covers and (cos_cov_angle+1)*inv_dtheta+1 for the angular sigmoids.
+    template<int n_dim1, int n_dim2, typename Splines>
+        inline Float4 quadspline_geometry(
                 Vec<n_dim1,Float4> &d1, Vec<n_dim2,Float4> &d2,
-                const float inv_dtheta, const float inv_dx, const float* p[4],
-                const Vec<n_dim1,Float4> &x1, const Vec<n_dim2,Float4> &x2)
+                const float inv_dtheta, const float inv_dx,
+                const Vec<n_dim1,Float4> &x1, const Vec<n_dim2,Float4> &x2,
+                Splines&& splines)
         {
             Float4 one(1.f);
             auto displace = extract<0,3>(x2)-extract<0,3>(x1);
@@ -47,16 +60,9 @@ namespace {
             auto cos_cov_angle2 = dot(rvec2,-displace_unitvec);
 
             // Spline evaluation
-            auto angular_sigmoid1 = deBoor_value_and_deriv(p,  (cos_cov_angle1+one)*Float4(inv_dtheta)+one);
-            int o = n_knot_angular; const float* pp[4] = {p[0]+o, p[1]+o, p[2]+o, p[3]+o};
-
-            auto angular_sigmoid2 = deBoor_value_and_deriv(pp, (cos_cov_angle2+one)*Float4(inv_dtheta)+one);
-            o=n_knot_angular; pp[0]+=o; pp[1]+=o; pp[2]+=o; pp[3]+=o;
-
-            auto wide_cover   = clamped_deBoor_value_and_deriv(pp, dist_coord, n_knot);
-            o=n_knot; pp[0]+=o; pp[1]+=o; pp[2]+=o; pp[3]+=o;
-
-            auto narrow_cover = clamped_deBoor_value_and_deriv(pp, dist_coord, n_knot);
+            Vec<2,Float4> angular_sigmoid1, angular_sigmoid2, wide_cover, narrow_cover;
+            splines(angular_sigmoid1, angular_sigmoid2, wide_cover, narrow_cover,
+                    dist2, dist_coord, cos_cov_angle1, cos_cov_angle2);
 
             // Partition derivatives
             auto angular_weight = angular_sigmoid1.x() * angular_sigmoid2.x();
@@ -83,6 +89,90 @@ namespace {
             return coverage;
         }
 
+    template<int n_knot_angular, int n_knot, int n_dim1, int n_dim2>
+        inline Float4 quadspline(
+                Vec<n_dim1,Float4> &d1, Vec<n_dim2,Float4> &d2,
+                const float inv_dtheta, const float inv_dx, const float* p[4],
+                const Vec<n_dim1,Float4> &x1, const Vec<n_dim2,Float4> &x2)
+        {
+            return quadspline_geometry(d1,d2, inv_dtheta,inv_dx, x1,x2, [&](
+                        Vec<2,Float4>& angular_sigmoid1, Vec<2,Float4>& angular_sigmoid2,
+                        Vec<2,Float4>& wide_cover,       Vec<2,Float4>& narrow_cover,
+                        const Float4& dist2, const Float4& dist_coord,
+                        const Float4& cos_cov_angle1, const Float4& cos_cov_angle2) {
+                    Float4 one(1.f);
+                    angular_sigmoid1 = deBoor_value_and_deriv(p,  (cos_cov_angle1+one)*Float4(inv_dtheta)+one);
+                    int o = n_knot_angular; const float* pp[4] = {p[0]+o, p[1]+o, p[2]+o, p[3]+o};
+
+                    angular_sigmoid2 = deBoor_value_and_deriv(pp, (cos_cov_angle2+one)*Float4(inv_dtheta)+one);
+                    o=n_knot_angular; pp[0]+=o; pp[1]+=o; pp[2]+=o; pp[3]+=o;
+
+                    wide_cover   = clamped_deBoor_value_and_deriv(pp, dist_coord, n_knot);
+                    o=n_knot; pp[0]+=o; pp[1]+=o; pp[2]+=o; pp[3]+=o;
+
+                    narrow_cover = clamped_deBoor_value_and_deriv(pp, dist_coord, n_knot);
+                });
+        }
+
+    // Tables of a clamped spline on squared distance and of an angular spline on
+    // cos(angle), for the compute_edge_tabulated of the bead interactions.  u is the
+    // table coordinate, so dist2 = u/inv_ds or cos(angle) = u*2/n_bin-1.
+    inline void tabulate_clamped_spline_dist2(float* table, int n_bin, float inv_ds,
+            const float* p, int n_knot, float inv_dx) {
+        tabulate_cubic(table, n_bin, [&](float u) {
+                float dist = sqrtf(u/inv_ds);
+                auto  en   = clamped_deBoor_value_and_deriv(p, dist*inv_dx, n_knot);
+                // the spline is flat near the origin, so d/du is finite there
+                float d_du = en.y()!=0.f ? en.y()*inv_dx/(2.f*dist*inv_ds) : 0.f;
+                return make_vec2(en.x(), d_du);});
+    }
+
+    inline void tabulate_angular_spline(float* table, int n_bin,
+            const float* p, int n_knot_angular, float inv_dtheta) {
+        tabulate_cubic(table, n_bin, [&](float u) {
+                float x = (u*(2.f/n_bin))*inv_dtheta + 1.f;
+                // the end of the range is the end of the spline, so stay inside the last bin
+                x = std::min(x, (n_knot_angular-2)*(1.f-1e-6f));
+                auto en = deBoor_value_and_deriv(p, x);
+                return make_vec2(en.x(), en.y()*inv_dtheta*(2.f/n_bin));});
+    }
+
+    template<int n_knot_angular, int n_knot, int n_angular_bin, int n_radial_bin, int n_dim1, int n_dim2>
+        inline Float4 quadspline_tabulated(
+                Vec<n_dim1,Float4> &d1, Vec<n_dim2,Float4> &d2,
+                const float inv_dtheta, const float inv_dx, const float inv_ds, const float* t[4],
+                const Vec<n_dim1,Float4> &x1, const Vec<n_dim2,Float4> &x2)
+        {
+            return quadspline_geometry(d1,d2, inv_dtheta,inv_dx, x1,x2, [&](
+                        Vec<2,Float4>& angular_sigmoid1, Vec<2,Float4>& angular_sigmoid2,
+                        Vec<2,Float4>& wide_cover,       Vec<2,Float4>& narrow_cover,
+                        const Float4& dist2, const Float4& dist_coord,
+                        const Float4& cos_cov_angle1, const Float4& cos_cov_angle2) {
+                    Float4 one(1.f);
+                    auto angular_scale = Float4(0.5f*n_angular_bin);
+                    auto dist2_scale   = Float4(inv_ds);
+
+                    angular_sigmoid1 = cubic_table_value_and_deriv(t, (cos_cov_angle1+one)*angular_scale, n_angular_bin);
+                    int o = 4*n_angular_bin; const float* tt[4] = {t[0]+o, t[1]+o, t[2]+o, t[3]+o};
+
+                    angular_sigmoid2 = cubic_table_value_and_deriv(tt, (cos_cov_angle2+one)*angular_scale, n_angular_bin);
+                    o=4*n_angular_bin; tt[0]+=o; tt[1]+=o; tt[2]+=o; tt[3]+=o;
+
+                    wide_cover   = cubic_table_value_and_deriv(tt, dist2*dist2_scale, n_radial_bin);
+                    o=4*n_radial_bin; tt[0]+=o; tt[1]+=o; tt[2]+=o; tt[3]+=o;
+
+                    narrow_cover = cubic_table_value_and_deriv(tt, dist2*dist2_scale, n_radial_bin);
+
+                    // convert to derivatives with respect to the spline coordinates
+                    auto angular_factor = angular_scale*Float4(1.f/inv_dtheta);
+                    angular_sigmoid1.y() *= angular_factor;
+                    angular_sigmoid2.y() *= angular_factor;
+                    auto radial_factor = Float4(2.f*inv_ds/sqr(inv_dx))*dist_coord;
+                    wide_cover  .y() *= radial_factor;
+                    narrow_cover.y() *= radial_factor;
+                });
+        }
+
     template<int n_knot_angular, int n_knot, int n_param, int n_dim1, int n_dim2>
         inline void quadspline_param_deriv(
                 Vec<n_param> &d_param,
@@ -130,6 +220,7 @@ namespace {
 
     constexpr static const int n_bit_rotamer = 4; // max number of rotamers is 2**n_bit_rotamer
 
+    template <typename BK>
     struct PosDistSplineInteraction {
         // spline-based distance interaction
         // n_param is the number of basis splines (including those required to get zero
@@ -139,7 +230,11 @@ namespace {
 
         constexpr static float inv_dx = 1.f/0.50f;  // half-angstrom bins
         constexpr static bool  symmetric = true;
-        constexpr static int   n_param=N_KNOT_SC_SC, n_dim1=3, n_dim2=3, simd_width=1;  // 8 angstrom cutoff
+        constexpr static int   n_param=BK::n_knot_sc_sc, n_dim1=3, n_dim2=3, simd_width=1;  // 8 angstrom cutoff
+
+        // table over squared distance, up to the end of the spline (see compute_edge_tabulated)
+        constexpr static int   n_radial_bin = 128, n_table = 4*n_radial_bin;
+        constexpr static float inv_ds = n_radial_bin*inv_dx*inv_dx/((n_param-2)*(n_param-2));
 
         static float cutoff(const float* p) {
             return (n_param-2-1e-6)/inv_dx;  // 1e-6 just insulates us from round-off error
@@ -167,6 +262,22 @@ namespace {
             return en.x();
         }
 
+        static void tabulate(float* table, const float* p) {
+            tabulate_clamped_spline_dist2(table, n_radial_bin, inv_ds, p, n_param, inv_dx);
+        }
+
+        // Cubic interpolation in squared distance, which needs no square root
+        static Float4 compute_edge_tabulated(Vec<n_dim1,Float4> &d1, Vec<n_dim2,Float4> &d2, const float* t[4],
+                const Vec<n_dim1,Float4> &x1, const Vec<n_dim2,Float4> &x2) {
+            auto disp  = x1-x2;
+            auto dist2 = mag2(disp);
+
+            auto en = cubic_table_value_and_deriv(t, dist2*Float4(inv_ds), n_radial_bin);
+            d1 = disp*(Float4(2.f*inv_ds)*en.y());
+            d2 = -d1;
+            return en.x();
+        }
+
         static void param_deriv(Vec<n_param> &d_param, const float* p,
                 const Vec<n_dim1> &x1, const Vec<n_dim2> &x2) {
             auto dist_coord = inv_dx*mag(x1-x2);
@@ -179,14 +290,20 @@ namespace {
     };
 }
 
+    template <typename BK>
     struct PosQuadSplineInteraction {
         // radius scale angular_width angular_scale
         // first group is donors; second group is acceptors
 
         constexpr static bool  symmetric = true;
-        constexpr static int   n_knot = N_KNOT_SC_SC, n_knot_angular=N_KNOT_ANGULAR;
+        constexpr static int   n_knot = BK::n_knot_sc_sc, n_knot_angular=BK::n_knot_angular;
         constexpr static int   n_param=2*n_knot_angular+2*n_knot, n_dim1=6, n_dim2=6, simd_width=1;
-        constexpr static float inv_dx = 1.f/KNOT_SPACING, inv_dtheta = (n_knot_angular-3)/2.f;
+        constexpr static float inv_dx = 1.f/BK::knot_spacing, inv_dtheta = (n_knot_angular-3)/2.f;
+
+        // tables over cos(angle) for the angular splines and squared distance for the covers
+        constexpr static int   n_angular_bin = 32, n_radial_bin = 128;
+        constexpr static int   n_table = 4*(2*n_angular_bin + 2*n_radial_bin);
+        constexpr static float inv_ds = n_radial_bin*inv_dx*inv_dx/((n_knot-2)*(n_knot-2));
 
         static float cutoff(const float* p) {
             return (n_knot-2-1e-6)/inv_dx;  // 1e-6 insulates from roundoff
@@ -201,6 +318,20 @@ namespace {
             return quadspline<n_knot_angular, n_knot>(d1,d2, inv_dtheta,inv_dx,p, sc_pos1,sc_pos2);
         }
 
+        static void tabulate(float* table, const float* p) {
+            tabulate_angular_spline(table,                 n_angular_bin, p,                 n_knot_angular, inv_dtheta);
+            tabulate_angular_spline(table+4*n_angular_bin, n_angular_bin, p+n_knot_angular,  n_knot_angular, inv_dtheta);
+            table += 8*n_angular_bin; p += 2*n_knot_angular;
+            tabulate_clamped_spline_dist2(table,                n_radial_bin, inv_ds, p,        n_knot, inv_dx);
+            tabulate_clamped_spline_dist2(table+4*n_radial_bin, n_radial_bin, inv_ds, p+n_knot, n_knot, inv_dx);
+        }
+
+        static Float4 compute_edge_tabulated(Vec<n_dim1,Float4> &d1, Vec<n_dim2,Float4> &d2, const float* t[4],
+                const Vec<n_dim1,Float4> &sc_pos1, const Vec<n_dim2,Float4> &sc_pos2) {
+            return quadspline_tabulated<n_knot_angular, n_knot, n_angular_bin, n_radial_bin>(
+                    d1,d2, inv_dtheta,inv_dx,inv_ds,t, sc_pos1,sc_pos2);
+        }
+
         static void param_deriv(Vec<n_param> &d_param, const float* p,
                 const Vec<n_dim1> &sc_pos1, const Vec<n_dim2> &sc_pos2) {
             quadspline_param_deriv<n_knot_angular, n_knot>(d_param, inv_dtheta,inv_dx,p, sc_pos1,sc_pos2);
@@ -218,6 +349,33 @@ namespace {
         }
 };
 
-typedef PosQuadSplineInteraction preferred_bead_type;
+template <typename BK>
+inline bool bead_knots_match(hid_t grp, int n_param, bool sc_sc) {
+    int n_knot = sc_sc ? int(BK::n_knot_sc_sc) : int(BK::n_knot_sc_bb);
+    return n_param == 2*BK::n_knot_angular + 2*n_knot &&
+        h5::read_attribute<int>  (grp, ".", "n_knot",         n_knot)                   == n_knot &&
+        h5::read_attribute<int>  (grp, ".", "n_knot_angular", int(BK::n_knot_angular))  == BK::n_knot_angular &&
+        h5::read_attribute<float>(grp, ".", "knot_spacing",   float(BK::knot_spacing)) == BK::knot_spacing;
+}
+
+//! \brief Call Create<BK>::create(args...) for the bead knot set BK of an interaction group
+//!
+//! The set must fit the width of the interaction_param dataset of grp, which is
+//! 2*n_knot_angular+2*n_knot, where n_knot is n_knot_sc_sc if sc_sc and n_knot_sc_bb otherwise.
+//! The optional attributes n_knot, n_knot_angular and knot_spacing of grp must match as well.
+//! The compiled sets have distinct widths, so older files without the attributes still work.
+template <template<typename> class Create, typename... Args>
+auto create_for_bead_knots(hid_t grp, bool sc_sc, Args&&... args)
+        -> decltype(Create<DefaultBeadKnots>::create(std::forward<Args>(args)...)) {
+    int n_param = h5::get_dset_size(3, grp, "interaction_param")[2];
+
+    if(bead_knots_match<DefaultBeadKnots> (grp, n_param, sc_sc)) return Create<DefaultBeadKnots> ::create(std::forward<Args>(args)...);
+    if(bead_knots_match<BeadKnotsStandard>(grp, n_param, sc_sc)) return Create<BeadKnotsStandard>::create(std::forward<Args>(args)...);
+    if(bead_knots_match<BeadKnots7A>      (grp, n_param, sc_sc)) return Create<BeadKnots7A>      ::create(std::forward<Args>(args)...);
+    if(bead_knots_match<BeadKnots10A>     (grp, n_param, sc_sc)) return Create<BeadKnots10A>     ::create(std::forward<Args>(args)...);
+
+    throw std::string("no bead interaction is compiled for ") + std::to_string(n_param) +
+        " parameters per type pair and the knot attributes of the interaction group";
+}
 
 #endif
@@ -1,6 +1,7 @@
 #include "deriv_engine.h"
 #include "timing.h"
 #include "state_logger.h"
+#include <cstring>
 
 using namespace h5;
 using namespace std;
@@ -34,7 +35,7 @@ struct PosSpring : public PotentialNode
 
     virtual void compute_value(ComputeMode mode) {
         Timer timer(string("pos_spring")); 
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = mode!=DerivMode ? &potential : nullptr;
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
 
@@ -145,6 +146,17 @@ struct AFMPotential : public PotentialNode
         }
     }
 
+    virtual vector<char> get_checkpoint_state() const override {
+        vector<char> state(sizeof(round_num));
+        memcpy(state.data(), &round_num, sizeof(round_num));
+        return state;
+    }
+
+    virtual void set_checkpoint_state(const vector<char>& state) override {
+        if(state.size() != sizeof(round_num)) throw string("invalid checkpoint state for AFM");
+        memcpy(&round_num, state.data(), sizeof(round_num));
+    }
+
     virtual void compute_value(ComputeMode mode) {
         Timer timer(string("AFM"));
         
@@ -175,25 +187,32 @@ struct RamaCoord : public CoordNode
 
     CoordNode& pos;
     vector<Params> params;
-    unique_ptr<Jac[]> jac;
+    aligned_ptr<Jac> jac;
+    ChangeMap atom_to_rama;
 
     RamaCoord(hid_t grp, CoordNode& pos_):
         CoordNode(get_dset_size(2, grp, "id")[0], 2),
         pos(pos_),
         params(n_elem),
-        jac(new_aligned<Jac>(n_elem,1))
+        jac(new_aligned<Jac>(n_elem,1)),
+        atom_to_rama(pos.n_elem)
     {
         check_size(grp, "id", n_elem, 5);
         traverse_dset<2,int>(grp, "id", [&](size_t nr, size_t na, int x) {
                 params[nr].atom[na] = x;});
 
-        for(auto& p: params) {
+        for(int nt=0; nt<n_elem; ++nt) {
+            auto& p = params[nt];
             // handle dummy angles uniformly (N-terminal phi and C-terminal psi)
             p.dummy_angle[0] = p.atom[0] == index_t(-1);
             p.dummy_angle[1] = p.atom[4] == index_t(-1);
 
             p.atom[0] = p.dummy_angle[0] ? 0 : p.atom[0];
             p.atom[4] = p.dummy_angle[1] ? 0 : p.atom[4];
+
+            for(int na: range(5))
+                if(!((na==0 && p.dummy_angle[0]) || (na==4 && p.dummy_angle[1])))
+                    atom_to_rama.add(p.atom[na], nt);
         }
 
         if(logging(LOG_DETAILED)) {
@@ -202,30 +221,38 @@ struct RamaCoord : public CoordNode
         }
     }
 
-    virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("rama_coord"));
-
+    void compute_rama(int nt) {
         VecArray rama_pos = output;
         float*   posv     = pos.output.x.get();
 
-        for(int nt=0; nt<n_elem; ++nt) {
-            const auto& p = params[nt];
-            Float4 x[5];
-            for(int na: range(5)) x[na] = Float4(posv + 4*p.atom[na]);
+        const auto& p = params[nt];
+        Float4 x[5];
+        for(int na: range(5)) x[na] = Float4(posv + 4*p.atom[na]);
 
-            for(int phipsi: range(2)) {  // phi then psi
-                Float4 d[5];
+        for(int phipsi: range(2)) {  // phi then psi
+            Float4 d[5];
 
-                rama_pos(phipsi,nt) = p.dummy_angle[phipsi]
-                    ? -1.3963f   // -80 degrees if dummy angle
-                    : dihedral_germ(x[0+phipsi],x[1+phipsi],x[2+phipsi],x[3+phipsi], // shift by 1 for psi
-                                    d[0+phipsi],d[1+phipsi],d[2+phipsi],d[3+phipsi]).x();
+            rama_pos(phipsi,nt) = p.dummy_angle[phipsi]
+                ? -1.3963f   // -80 degrees if dummy angle
+                : dihedral_germ(x[0+phipsi],x[1+phipsi],x[2+phipsi],x[3+phipsi], // shift by 1 for psi
+                                d[0+phipsi],d[1+phipsi],d[2+phipsi],d[3+phipsi]).x();
 
-                for(int na: range(5)) d[na].store(jac[nt].j[phipsi][na]);
-            }
+            for(int na: range(5)) d[na].store(jac[nt].j[phipsi][na]);
         }
     }
 
+    virtual void compute_value(ComputeMode mode) {
+        Timer timer(string("rama_coord"));
+        for(int nt=0; nt<n_elem; ++nt) compute_rama(nt);
+    }
+
+    virtual bool compute_value_incremental() override {
+        if(pos.all_changed) return false;
+        atom_to_rama.collect(changed_elems, pos);
+        for(auto nt: changed_elems) compute_rama(nt);
+        return true;
+    }
+
     virtual void propagate_deriv() {
         Timer timer(string("rama_coord_deriv"));
         float* pos_sens = pos.sens.x.get();
@@ -261,10 +288,14 @@ struct DistSpring : public PotentialNode
     CoordNode& pos;
     vector<Params> params;
     vector<int> bonded_atoms;
+    vector<float> term_potential;
+    ChangeMap atom_to_term;
+    vector<index_t> changed_terms;
 
     DistSpring(hid_t grp, CoordNode& pos_):
         PotentialNode(),
-        n_elem(get_dset_size(2, grp, "id")[0]), pos(pos_), params(n_elem)
+        n_elem(get_dset_size(2, grp, "id")[0]), pos(pos_), params(n_elem),
+        term_potential(n_elem), atom_to_term(pos.n_elem)
     {
         int n_dep = 2;  // number of atoms that each term depends on 
         check_size(grp, "id",           n_elem, n_dep);
@@ -277,6 +308,7 @@ struct DistSpring : public PotentialNode
         traverse_dset<1,float>(grp, "equil_dist",   [&](size_t i,           float x) {p[i].equil_dist = x;});
         traverse_dset<1,float>(grp, "spring_const", [&](size_t i,           float x) {p[i].spring_constant = x;});
         traverse_dset<1,int>  (grp, "bonded_atoms", [&](size_t i,           int   x) {bonded_atoms.push_back(x);});
+        for(int nt=0; nt<n_elem; ++nt) for(int na: range(2)) atom_to_term.add(p[nt].atom[na], nt);
 
         if(logging(LOG_DETAILED))
             default_logger->add_logger<float>("nonbonded_spring_energy", {1}, [&](float* buffer) {
@@ -294,27 +326,44 @@ struct DistSpring : public PotentialNode
                     });
     }
 
+    float compute_term(int nt, VecArray posc, VecArray pos_sens, bool need_pot) {
+        auto& p = params[nt];
+
+        auto x1 = load_vec<3>(posc, p.atom[0]);
+        auto x2 = load_vec<3>(posc, p.atom[1]);
+
+        auto disp = x1 - x2;
+        auto deriv = p.spring_constant * (1.f - p.equil_dist*inv_mag(disp)) * disp;
+
+        update_vec(pos_sens, p.atom[0],  deriv);
+        update_vec(pos_sens, p.atom[1], -deriv);
+        return need_pot ? 0.5f * p.spring_constant * sqr(mag(disp) - p.equil_dist) : 0.f;
+    }
+
     virtual void compute_value(ComputeMode mode) {
         Timer timer(string("dist_spring"));
 
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = mode!=DerivMode ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
         for(int nt=0; nt<n_elem; ++nt) {
-            auto& p = params[nt];
-
-            auto x1 = load_vec<3>(posc, p.atom[0]);
-            auto x2 = load_vec<3>(posc, p.atom[1]);
-
-            auto disp = x1 - x2;
-            auto deriv = p.spring_constant * (1.f - p.equil_dist*inv_mag(disp)) * disp;
-            if(pot) *pot += 0.5f * p.spring_constant * sqr(mag(disp) - p.equil_dist);
+            float e = compute_term(nt, posc, pos_sens, pot);
+            if(pot) {*pot += e; term_potential[nt] = e;}
+        }
+    }
 
-            update_vec(pos_sens, p.atom[0],  deriv);
-            update_vec(pos_sens, p.atom[1], -deriv);
+    virtual bool compute_value_incremental() override {
+        if(pos.all_changed) return false;
+        changed_terms.clear();
+        atom_to_term.collect(changed_terms, pos);
+        for(auto nt: changed_terms) {
+            potential -= term_potential[nt];
+            term_potential[nt] = compute_term(nt, pos.output, pos.sens, true);
+            potential += term_potential[nt];
         }
+        return true;
     }
 };
 static RegisterNodeType<DistSpring,1> dist_spring_node("dist_spring");
@@ -352,7 +401,7 @@ struct CavityRadial : public PotentialNode
 
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = mode!=DerivMode ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
         for(int nt=0; nt<n_term; ++nt) {
@@ -409,7 +458,7 @@ struct ZFlatBottom : public PotentialNode
 
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = mode!=DerivMode ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
         for(int nt=0; nt<n_term; ++nt) {
@@ -438,10 +487,14 @@ struct AngleSpring : public PotentialNode
     int n_elem;
     CoordNode& pos;
     vector<Params> params;
+    vector<float> term_potential;
+    ChangeMap atom_to_term;
+    vector<index_t> changed_terms;
 
     AngleSpring(hid_t grp, CoordNode& pos_):
         PotentialNode(),
-        n_elem(get_dset_size(2, grp, "id")[0]), pos(pos_), params(n_elem)
+        n_elem(get_dset_size(2, grp, "id")[0]), pos(pos_), params(n_elem),
+        term_potential(n_elem), atom_to_term(pos.n_elem)
     {
         int n_dep = 3;  // number of atoms that each term depends on 
         check_size(grp, "id",              n_elem, n_dep);
@@ -452,6 +505,30 @@ struct AngleSpring : public PotentialNode
         traverse_dset<2,int>  (grp, "id",           [&](size_t i, size_t j, int   x) { p[i].atom[j] = x;});
         traverse_dset<1,float>(grp, "equil_dist",   [&](size_t i,           float x) { p[i].equil_dp = x;});
         traverse_dset<1,float>(grp, "spring_const", [&](size_t i,           float x) { p[i].spring_constant = x;});
+        for(int nt=0; nt<n_elem; ++nt) for(int na: range(n_dep)) atom_to_term.add(p[nt].atom[na], nt);
+    }
+
+    float compute_term(int nt, float* posc, float* pos_sens) {
+        auto& p = params[nt];
+        auto atom1 = Float4(posc + 4*p.atom[0]);
+        auto atom2 = Float4(posc + 4*p.atom[1]);
+        auto atom3 = Float4(posc + 4*p.atom[2]);
+
+        auto x1 = atom1 - atom3; auto inv_d1 = inv_mag(x1); auto x1h = x1*inv_d1;
+        auto x2 = atom2 - atom3; auto inv_d2 = inv_mag(x2); auto x2h = x2*inv_d2;
+
+        auto dp = dot(x1h, x2h);
+        auto force_prefactor = Float4(p.spring_constant) * (dp - Float4(p.equil_dp));
+
+        auto d1 = force_prefactor * (x2h - x1h*dp) * inv_d1;
+        auto d2 = force_prefactor * (x1h - x2h*dp) * inv_d2;
+        auto d3 = -d1-d2;
+
+        d1.update(pos_sens + 4*p.atom[0]);
+        d2.update(pos_sens + 4*p.atom[1]);
+        d3.update(pos_sens + 4*p.atom[2]);
+
+        return 0.5f * p.spring_constant * sqr(dp.x()-p.equil_dp);
     }
 
     virtual void compute_value(ComputeMode mode) {
@@ -459,31 +536,25 @@ struct AngleSpring : public PotentialNode
 
         float* posc = pos.output.x.get();
         float* pos_sens = pos.sens.x.get();
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = mode!=DerivMode ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
         for(int nt=0; nt<n_elem; ++nt) {
-            auto& p = params[nt];
-            auto atom1 = Float4(posc + 4*p.atom[0]);
-            auto atom2 = Float4(posc + 4*p.atom[1]);
-            auto atom3 = Float4(posc + 4*p.atom[2]);
-
-            auto x1 = atom1 - atom3; auto inv_d1 = inv_mag(x1); auto x1h = x1*inv_d1;
-            auto x2 = atom2 - atom3; auto inv_d2 = inv_mag(x2); auto x2h = x2*inv_d2;
-
-            auto dp = dot(x1h, x2h);
-            auto force_prefactor = Float4(p.spring_constant) * (dp - Float4(p.equil_dp));
-
-            auto d1 = force_prefactor * (x2h - x1h*dp) * inv_d1;
-            auto d2 = force_prefactor * (x1h - x2h*dp) * inv_d2;
-            auto d3 = -d1-d2;
-
-            d1.update(pos_sens + 4*p.atom[0]);
-            d2.update(pos_sens + 4*p.atom[1]);
-            d3.update(pos_sens + 4*p.atom[2]);
+            float e = compute_term(nt, posc, pos_sens);
+            if(pot) {*pot += e; term_potential[nt] = e;}
+        }
+    }
 
-            if(pot) *pot += 0.5f * p.spring_constant * sqr(dp.x()-p.equil_dp);
+    virtual bool compute_value_incremental() override {
+        if(pos.all_changed) return false;
+        changed_terms.clear();
+        atom_to_term.collect(changed_terms, pos);
+        for(auto nt: changed_terms) {
+            potential -= term_potential[nt];
+            term_potential[nt] = compute_term(nt, pos.output.x.get(), pos.sens.x.get());
+            potential += term_potential[nt];
         }
+        return true;
     }
 };
 static RegisterNodeType<AngleSpring,1> angle_spring_node("angle_spring");
@@ -500,10 +571,14 @@ struct DihedralSpring : public PotentialNode
     int n_elem;
     CoordNode& pos;
     vector<Params> params;
+    vector<float> term_potential;
+    ChangeMap atom_to_term;
+    vector<index_t> changed_terms;
 
     DihedralSpring(hid_t grp, CoordNode& pos_):
         PotentialNode(),
-        n_elem(get_dset_size(2, grp, "id")[0]), pos(pos_), params(n_elem)
+        n_elem(get_dset_size(2, grp, "id")[0]), pos(pos_), params(n_elem),
+        term_potential(n_elem), atom_to_term(pos.n_elem)
     {
         int n_dep = 4;  // number of atoms that each term depends on 
         check_size(grp, "id",           n_elem, n_dep);
@@ -514,6 +589,26 @@ struct DihedralSpring : public PotentialNode
         traverse_dset<2,int>  (grp, "id",           [&](size_t i, size_t j, int   x) {p[i].atom[j]  =x;});
         traverse_dset<1,float>(grp, "equil_dist",   [&](size_t i,           float x) {p[i].equil_dihedral =x;});
         traverse_dset<1,float>(grp, "spring_const", [&](size_t i,           float x) {p[i].spring_constant=x;});
+        for(int nt=0; nt<n_elem; ++nt) for(int na: range(n_dep)) atom_to_term.add(p[nt].atom[na], nt);
+    }
+
+    float compute_term(int nt, float* posc, float* pos_sens) {
+        const auto& p = params[nt];
+        Float4 x[4];
+        for(int na: range(4)) x[na] = Float4(posc + 4*params[nt].atom[na]);
+
+        Float4 d[4];
+        float dihedral = dihedral_germ(x[0],x[1],x[2],x[3], d[0],d[1],d[2],d[3]).x();
+
+        // determine minimum periodic image (can be off by at most 2pi)
+        float displacement = dihedral - p.equil_dihedral;
+        displacement = (displacement> M_PI_F) ? displacement-2.f*M_PI_F : displacement;
+        displacement = (displacement<-M_PI_F) ? displacement+2.f*M_PI_F : displacement;
+
+        auto s = Float4(p.spring_constant * displacement);
+        for(int na: range(4)) d[na].scale_update(s, pos_sens + 4*params[nt].atom[na]);
+
+        return 0.5f * p.spring_constant * sqr(displacement);
     }
 
     virtual void compute_value(ComputeMode mode) {
@@ -521,27 +616,25 @@ struct DihedralSpring : public PotentialNode
 
         float* posc = pos.output.x.get();
         float* pos_sens = pos.sens.x.get();
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = mode!=DerivMode ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
         for(int nt=0; nt<n_elem; ++nt) {
-            const auto& p = params[nt];
-            Float4 x[4];
-            for(int na: range(4)) x[na] = Float4(posc + 4*params[nt].atom[na]);
-
-            Float4 d[4];
-            float dihedral = dihedral_germ(x[0],x[1],x[2],x[3], d[0],d[1],d[2],d[3]).x();
-
-            // determine minimum periodic image (can be off by at most 2pi)
-            float displacement = dihedral - p.equil_dihedral;
-            displacement = (displacement> M_PI_F) ? displacement-2.f*M_PI_F : displacement;
-            displacement = (displacement<-M_PI_F) ? displacement+2.f*M_PI_F : displacement;
-
-            auto s = Float4(p.spring_constant * displacement);
-            for(int na: range(4)) d[na].scale_update(s, pos_sens + 4*params[nt].atom[na]);
+            float e = compute_term(nt, posc, pos_sens);
+            if(pot) {*pot += e; term_potential[nt] = e;}
+        }
+    }
 
-            if(pot) *pot += 0.5f * p.spring_constant * sqr(displacement);
+    virtual bool compute_value_incremental() override {
+        if(pos.all_changed) return false;
+        changed_terms.clear();
+        atom_to_term.collect(changed_terms, pos);
+        for(auto nt: changed_terms) {
+            potential -= term_potential[nt];
+            term_potential[nt] = compute_term(nt, pos.output.x.get(), pos.sens.x.get());
+            potential += term_potential[nt];
         }
+        return true;
     }
 };
 static RegisterNodeType<DihedralSpring,1> dihedral_spring_node("dihedral_spring");
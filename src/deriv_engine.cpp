@@ -1,5 +1,7 @@
 #include "deriv_engine.h"
 #include "timing.h"
+#include "thermostat.h"
+#include "Float4.h"
 #include <map>
 #include <algorithm>
 #include <memory>
@@ -16,22 +18,37 @@ integration_stage(
         float vel_factor,
         float pos_factor,
         float max_force,
-        int n_atom)
+        int n_atom,
+        OrnsteinUhlenbeckThermostat* thermostat)
 {
-    for(int na=0; na<n_atom; ++na) {
-        // assumes unit mass for all particles
-
-        auto d = load_vec<3>(deriv, na);
-        if(max_force) {
-            float f_mag = mag(d)+1e-6f;  // ensure no NaN when mag(deriv)==0.
-            float scale_factor = atan(f_mag * ((0.5f*M_PI_F) / max_force)) * (max_force/f_mag * (2.f/M_PI_F));
-            d *= scale_factor;
-        }
+    // thermostat noise is generated for max_simd_width atoms at a time
+    const int W = max_simd_width;
+    float3 noise[W];
+
+    for(int na0=0; na0<n_atom; na0+=W) {
+        int n = min(W, n_atom-na0);
+        if(thermostat) thermostat->noise(noise, na0, n);
+
+        for(int i=0; i<n; ++i) {
+            int na = na0+i;
+            // assumes unit mass for all particles
+
+            auto d = load_vec<3>(deriv, na);
+            if(max_force) {
+                float f_mag = mag(d)+1e-6f;  // ensure no NaN when mag(deriv)==0.
+                float scale_factor = atan(f_mag * ((0.5f*M_PI_F) / max_force)) * (max_force/f_mag * (2.f/M_PI_F));
+                d *= scale_factor;
+            }
 
-        auto p = load_vec<3>(mom, na) - vel_factor*d;
-        store_vec (mom, na, p);
-        update_vec(pos, na, pos_factor*p);
+            auto p = load_vec<3>(mom, na);
+            if(thermostat) p = thermostat->mom_scale*p + thermostat->noise_scale*noise[i];
+            p -= vel_factor*d;
+            store_vec (mom, na, p);
+            update_vec(pos, na, pos_factor*p);
+        }
     }
+
+    if(thermostat) thermostat->finish_invocation();
 }
 
 void
@@ -107,6 +124,8 @@ void DerivEngine::add_node(
         node.parents.push_back(parent_idx);
         nodes[parent_idx].children.push_back(nodes.size()-1);
     }
+    plan_valid = false;
+    incremental_valid = false;
 }
 
 DerivEngine::Node& DerivEngine::get(const string& name) {
@@ -121,55 +140,237 @@ int DerivEngine::get_idx(const string& name, bool must_exist) {
     return loc != nodes.end() ? loc-begin(nodes) : -1;
 }
 
-void DerivEngine::compute(ComputeMode mode) {
-    // FIXME depth-first traversal would be simpler and more cache-friendly
-    for(auto& n: nodes) n.germ_exec_level = n.deriv_exec_level = -1;
-
-    if(mode == PotentialAndDerivMode) potential = 0.f;
-
-    // BFS traversal
-    for(int lvl=0, not_finished=1; ; ++lvl, not_finished=0) {
-        for(auto& n: nodes) {
-            if(n.germ_exec_level == -1) {
-                not_finished = 1;
-                bool all_parents = all_of(begin(n.parents), end(n.parents), [&] (int ip) {
-                        int exec_lvl = nodes[ip].germ_exec_level;
-                        return exec_lvl!=-1 && exec_lvl!=lvl; // do not execute at same level as your parents
-                        });
-
-                if(all_parents) {
-                    n.computation->compute_value(mode);
-                    n.germ_exec_level = lvl;
-                    if(mode == PotentialAndDerivMode && n.computation->potential_term) {
-                        auto pot_node = static_cast<PotentialNode*>(n.computation.get());
-                        potential += pot_node->potential;
-                    }
-                    if(!n.computation->potential_term) {
-                        // ensure zero sensitivity for later derivative writing
-                        CoordNode* coord_node = static_cast<CoordNode*>(n.computation.get());
-                        fill(coord_node->sens, 0.f);
-                    }
+void DerivEngine::build_plan() {
+    // Nodes are stored in topological order, since add_node requires that all
+    // parents already exist.  A node executes compute_value one level after
+    // its last parent, and executes propagate_deriv one level after its last
+    // child (but never before its own compute_value).
+    int n_node = nodes.size();
+    int max_germ_level = -1;
+    for(int i=0; i<n_node; ++i) {
+        auto& n = nodes[i];
+        n.germ_exec_level = 0;
+        for(auto ip: n.parents) {
+            if(int(ip) >= i) throw string("nodes not in topological order");
+            n.germ_exec_level = max(n.germ_exec_level, nodes[ip].germ_exec_level+1);
+        }
+        max_germ_level = max(max_germ_level, n.germ_exec_level);
+    }
+
+    int max_deriv_level = -1;
+    for(int i=n_node-1; i>=0; --i) {
+        auto& n = nodes[i];
+        n.deriv_exec_level = n.germ_exec_level;
+        for(auto ic: n.children)
+            n.deriv_exec_level = max(n.deriv_exec_level, nodes[ic].deriv_exec_level+1);
+        max_deriv_level = max(max_deriv_level, n.deriv_exec_level);
+    }
+
+    // Greedily split each level into stages so that no two nodes in a stage
+    // write to the sensitivity of the same parent.  Potential nodes write
+    // parent sensitivities in compute_value and CoordNode's write them in
+    // propagate_deriv.
+    auto make_stages = [&](int max_level, bool forward, const vector<bool>& active,
+                           vector<int>& stage_start, const function<void(Node&)>& add_step) {
+        stage_start.clear();
+        int n_step = 0;
+        for(int lvl=0; lvl<=max_level; ++lvl) {
+            vector<vector<int>>  stage_nodes;
+            vector<vector<bool>> stage_parents;
+            for(int i=0; i<n_node; ++i) {
+                auto& n = nodes[i];
+                bool is_pot = n.computation->potential_term;
+                if(!active[i]) continue;
+                if((forward ? n.germ_exec_level : n.deriv_exec_level) != lvl) continue;
+                if(!forward && is_pot) continue;  // propagate_deriv is never called for potential nodes
+                bool writes_parents = forward ? is_pot : true;
+
+                size_t ns = 0;
+                if(writes_parents) {
+                    for(; ns<stage_nodes.size(); ++ns)
+                        if(none_of(begin(n.parents), end(n.parents), [&](size_t ip) {return stage_parents[ns][ip];}))
+                            break;
                 }
+                if(ns == stage_nodes.size()) {
+                    stage_nodes  .emplace_back();
+                    stage_parents.emplace_back(n_node, false);
+                }
+                stage_nodes[ns].push_back(i);
+                if(writes_parents) for(auto ip: n.parents) stage_parents[ns][ip] = true;
             }
 
-            if(n.deriv_exec_level == -1 && n.germ_exec_level != -1) {
-                not_finished = 1;
-                bool all_children = all_of(begin(n.children), end(n.children), [&] (int ip) {
-                        int exec_lvl = nodes[ip].deriv_exec_level;
-                        return exec_lvl!=-1 && exec_lvl!=lvl; // do not execute at same level as your children
-                        });
-                if(all_children) {
-                    n.computation->propagate_deriv();
-                    n.deriv_exec_level = lvl;
-                }
+            for(auto& sn: stage_nodes) {
+                stage_start.push_back(n_step);
+                for(int i: sn) {add_step(nodes[i]); ++n_step;}
             }
         }
-        if(!not_finished) break;
+        stage_start.push_back(n_step);
+    };
+
+    auto make_plan = [&](ExecutionPlan& p, const vector<bool>& active) {
+        p.forward .clear();
+        p.backward.clear();
+
+        make_stages(max_germ_level, true, active, p.forward_stage_start, [&](Node& n) {
+                auto c = n.computation.get();
+                ForwardStep step;
+                step.computation = c;
+                step.coord    = c->potential_term ? nullptr : static_cast<CoordNode*>(c);
+                step.pot_node = c->potential_term ? static_cast<PotentialNode*>(c) : nullptr;
+                p.forward.push_back(step);});
+
+        make_stages(max_deriv_level, false, active, p.backward_stage_start, [&](Node& n) {
+                p.backward.push_back(static_cast<CoordNode*>(n.computation.get()));});
+    };
+
+    // A subgraph contains the selected potential nodes and their ancestors.
+    // The Pos node is always included so that its sensitivity is zeroed.
+    auto subgraph = [&](bool slow) {
+        vector<bool> active(n_node, false);
+        active[0] = true;
+        for(int i=n_node-1; i>=0; --i) {
+            auto& n = nodes[i];
+            if(n.computation->potential_term) 
+                active[i] = n.slow==slow;
+            else
+                for(auto ic: n.children) active[i] = active[i] || active[ic];
+        }
+        return active;
+    };
+
+    make_plan(plan,      vector<bool>(n_node, true));
+    make_plan(fast_plan, subgraph(false));
+    make_plan(slow_plan, subgraph(true));
+
+    shared.reset(new SharedResources());
+    for(auto& n: nodes) n.computation->connect_shared(*shared);
+
+    plan_valid = true;
+}
+
+
+void DerivEngine::allocate_arena() {
+    if(!plan_valid) build_plan();
+
+    vector<VecArrayStorage*> buffers;
+    for(auto& step: plan.forward) {
+        if(!step.coord) continue;
+        buffers.push_back(&step.coord->output);
+        buffers.push_back(&step.coord->sens);
+    }
+
+    const int line = cache_line_bytes/sizeof(float);
+    auto buffer_size = [&](const VecArrayStorage* b) {return round_up(b->n_elem*b->row_width, line);};
+
+    int total_size = 0;
+    for(auto b: buffers) total_size += buffer_size(b);
+    auto new_arena = new_aligned<float>(total_size, line);  // first touch is here
+
+    int offset = 0;
+    for(auto b: buffers) {
+        float* x = new_arena.get() + offset;
+        copy_n(b->x.get(), b->n_elem*b->row_width, x);
+        b->x = aligned_ptr<float>(x, AlignedDeleter(false));
+        offset += buffer_size(b);
     }
+    arena = move(new_arena);
 }
 
+void DerivEngine::compute(ComputeMode mode, NodeSelection selection) {
+    if(!plan_valid) build_plan();
+    auto& plan = selection==AllNodes ? this->plan : (selection==FastNodes ? fast_plan : slow_plan);
+    shared->n_compute++;
+    shared->computing = true;
+
+    auto forward_step = [&](int i, int node_threads) {
+        auto& step = plan.forward[i];
+        step.computation->n_threads = node_threads;
+        step.computation->compute_value(mode);
+        // ensure zero sensitivity for later derivative writing
+        if(step.coord && mode!=PotentialOnlyMode) fill(step.coord->sens, 0.f);
+    };
+    auto backward_step = [&](int i, int node_threads) {
+        plan.backward[i]->n_threads = node_threads;
+        plan.backward[i]->propagate_deriv();
+    };
+
+    // Execute each stage, in parallel if there is more than one node to run.  Any
+    // threads beyond the number of nodes in the stage are divided among the nodes.
+    auto run_stages = [&](const vector<int>& stage_start, const function<void(int,int)>& f) {
+        for(size_t ns=0; ns+1<stage_start.size(); ++ns) {
+            int start = stage_start[ns];
+            int stop  = stage_start[ns+1];
+            if(n_threads>1 && stop-start>1) {
+                int node_threads = max(1, n_threads/(stop-start));
+                #pragma omp parallel for schedule(dynamic,1) num_threads(min(n_threads,stop-start))
+                for(int i=start; i<stop; ++i) f(i, node_threads);
+            } else {
+                for(int i=start; i<stop; ++i) f(i, n_threads);
+            }
+        }
+    };
+
+    run_stages(plan.forward_stage_start, forward_step);
+
+    // sum in plan order so that the result does not depend on n_threads
+    if(mode != DerivMode) {
+        potential = 0.f;
+        for(auto& step: plan.forward)
+            if(step.pot_node) potential += step.pot_node->potential;
+    }
+
+    if(mode != PotentialOnlyMode) run_stages(plan.backward_stage_start, backward_step);
+    shared->computing = false;
+
+    // In DerivMode, potential nodes may not record their potential
+    incremental_valid = mode != DerivMode && selection == AllNodes;
+}
+
+
+void DerivEngine::compute_incremental(const vector<index_t>& changed_atoms) {
+    if(!plan_valid || !incremental_valid) {
+        compute(PotentialOnlyMode);
+        return;
+    }
+    Timer timer(string("compute_incremental"));
+    shared->n_compute++;
+    shared->computing = true;
+
+    pos->changed_elems = changed_atoms;
+    sort(begin(pos->changed_elems), end(pos->changed_elems));
+    pos->changed_elems.erase(unique(begin(pos->changed_elems), end(pos->changed_elems)), end(pos->changed_elems));
+    pos->all_changed = false;
+
+    // nodes are in topological order and pos is nodes[0]
+    for(size_t i=1; i<nodes.size(); ++i) {
+        auto& n = nodes[i];
+        auto  c = n.computation.get();
+        auto  cn = c->potential_term ? nullptr : static_cast<CoordNode*>(c);
+        if(cn) {
+            cn->changed_elems.clear();
+            cn->all_changed = false;
+        }
+
+        bool input_changed = any_of(begin(n.parents), end(n.parents), [&](size_t ip) {
+                return static_cast<CoordNode*>(nodes[ip].computation.get())->any_changed();});
 
-void DerivEngine::integration_cycle(VecArray mom, float dt, float max_force, IntegratorType type) {
+        c->n_threads = n_threads;
+        if(input_changed && !c->compute_value_incremental()) {
+            c->compute_value(PotentialOnlyMode);
+            if(cn) cn->all_changed = true;
+        }
+    }
+
+    shared->computing = false;
+
+    potential = 0.f;
+    for(auto& step: plan.forward)
+        if(step.pot_node) potential += step.pot_node->potential;
+}
+
+
+void DerivEngine::integration_cycle(VecArray mom, float dt, float max_force, IntegratorType type,
+        OrnsteinUhlenbeckThermostat* thermostat) {
     // integrator from Predescu et al., 2012
     // http://dx.doi.org/10.1080/00268976.2012.681311
 
@@ -179,15 +380,38 @@ void DerivEngine::integration_cycle(VecArray mom, float dt, float max_force, Int
     float mom_update[] = {1.5f-3.f*a, 1.5f-3.f*a, 6.f*a};
     float pos_update[] = {     3.f*b, 3.0f-6.f*b, 3.f*b};
 
+    if(!plan_valid) build_plan();
+    bool respa = respa_interval>1 && any_of(begin(slow_plan.forward), end(slow_plan.forward),
+            [](const ForwardStep& step) {return step.pot_node != nullptr;});
+
+    if(respa) {
+        // Impulse from the slow forces for the next respa_interval cycles.  The
+        // scheme above merges the final momentum update of each cycle with the
+        // first of the next, so the slow impulse is applied in one kick.
+        if(!respa_phase) {
+            compute(DerivMode, SlowNodes);
+            Timer timer(string("integration"));
+            integration_stage(
+                    mom,
+                    pos->output,
+                    pos->sens,
+                    3.f*dt*respa_interval, 0.f, max_force,
+                    pos->n_atom, thermostat);
+            thermostat = nullptr;
+        }
+        respa_phase = (respa_phase+1) % respa_interval;
+    }
+
     for(int stage=0; stage<3; ++stage) {
-        compute(DerivMode);   // compute derivatives
+        compute(DerivMode, respa ? FastNodes : AllNodes);   // compute derivatives
         Timer timer(string("integration"));
         integration_stage( 
                 mom,
                 pos->output,
                 pos->sens,
                 dt*mom_update[stage], dt*pos_update[stage], max_force, 
-                pos->n_atom);
+                pos->n_atom, thermostat);
+        thermostat = nullptr;  // only the first momentum update is thermostatted
     }
 }
 
@@ -261,11 +485,19 @@ DerivEngine initialize_engine_from_hdf5(int n_atom, hid_t potential_group, bool
             auto grp = open_group(potential_group,nm.c_str());
             auto computation = unique_ptr<DerivComputation>(node_func(grp.get(),arguments));
             engine.add_node(nm, move(computation), argument_names);
+
+            // nonzero attribute "slow" places a potential on the outer RESPA time step
+            auto& node = engine.nodes.back();
+            node.slow = read_attribute<int>(grp.get(), ".", "slow", 0);
+            if(node.slow && !node.computation->potential_term)
+                throw string("only potential nodes may be marked slow");
         } catch(const string &e) {
             throw "while adding '" + nm + "', " + e;
         }
     }
 
+    engine.build_plan();
+    engine.allocate_arena();
     return engine;
 }
 
@@ -7,6 +7,9 @@
 #include <functional>
 #include <initializer_list>
 #include <map>
+#include <memory>
+#include <cstdint>
+#include <cstring>
 #include "vector_math.h"
 
 //!\brief Copy VecArray to a flat float* array
@@ -18,6 +21,8 @@ inline void copy_vec_array_to_buffer(VecArray arr, int n_elem, int n_dim, float*
 
 typedef int index_t;  //!< Type of coordinate indices
 
+struct OrnsteinUhlenbeckThermostat;
+
 //! \brief Update position and momentum
 void
 integration_stage(
@@ -27,7 +32,10 @@ integration_stage(
         float vel_factor, //!< [in] fraction of force to add to momentum (integration dependent)
         float pos_factor,//!< [in] fraction of momentum to add to position (integration dependent)
         float max_force, //!< [in] clip forces so that they do not exceed maxforce (increase stability)
-        int n_atom //!<[in] number of atoms
+        int n_atom, //!<[in] number of atoms
+        //! [inout] if not null, thermostat applied to each momentum just before its update,
+        //! in the same pass over the atoms (counts as one invocation of the thermostat)
+        OrnsteinUhlenbeckThermostat* thermostat = nullptr
         );
 
 //! \brief Recenter position array to origin
@@ -41,18 +49,73 @@ recenter(
 //! \brief Whether to compute potential value as well as its derivative
 enum ComputeMode {
     DerivMode = 0, //!< Only derivative must be computed correctly (potential may not be correct)
-    PotentialAndDerivMode = 1 //!< Compute potential and derivative correctly
+    PotentialAndDerivMode = 1, //!< Compute potential and derivative correctly
+    PotentialOnlyMode = 2 //!< Only potential must be computed correctly (sens and derivatives are skipped)
+};
+
+//! \brief Objects shared between the nodes of a DerivEngine
+//!
+//! Nodes that would otherwise compute the same intermediate result (such as
+//! a neighbor list over the same coordinates) look it up here by a key in
+//! DerivComputation::connect_shared.  The first node to ask for a key
+//! creates the entry.
+struct SharedResources {
+    std::map<std::string, std::shared_ptr<void>> entries; //!< shared objects by key
+    //! \brief Incremented at the start of each DerivEngine::compute and compute_incremental
+    uint64_t n_compute;
+    //! \brief True while DerivEngine::compute or compute_incremental is running
+    //!
+    //! Node inputs do not change while this is true, so work keyed by
+    //! n_compute may be reused by every node within a compute.
+    bool computing;
+
+    SharedResources(): n_compute(0), computing(false) {}
+
+    //! \brief Get the entry for key, calling make() to create it if it does not exist
+    template <typename T, typename F>
+    std::shared_ptr<T> get(const std::string& key, F&& make) {
+        auto& entry = entries[key];
+        if(!entry) entry = std::shared_ptr<T>(make());
+        return std::static_pointer_cast<T>(entry);
+    }
 };
 
+//! \brief Append a length-prefixed vector to a node checkpoint state (see DerivComputation::get_checkpoint_state)
+template <typename T>
+inline void write_checkpoint_vector(std::vector<char>& state, const std::vector<T>& v) {
+    int32_t n = v.size();
+    auto p = reinterpret_cast<const char*>(&n);
+    state.insert(state.end(), p, p+sizeof(n));
+    p = reinterpret_cast<const char*>(v.data());
+    state.insert(state.end(), p, p+n*sizeof(T));
+}
+
+//! \brief Read a vector written by write_checkpoint_vector at pos, and advance pos past it
+template <typename T>
+inline void read_checkpoint_vector(const std::vector<char>& state, size_t& pos, std::vector<T>& v) {
+    int32_t n;
+    if(pos+sizeof(n) > state.size()) throw std::string("invalid checkpoint state");
+    std::memcpy(&n, state.data()+pos, sizeof(n)); pos += sizeof(n);
+    if(n<0 || pos+n*sizeof(T) > state.size()) throw std::string("invalid checkpoint state");
+    v.resize(n);
+    std::memcpy(v.data(), state.data()+pos, n*sizeof(T)); pos += n*sizeof(T);
+}
+
 //! \brief Differentiable computation node
 struct DerivComputation 
 {
     //! \brief True if output represents a potential energy rather than a new coordinate
     const bool potential_term;
+    //! \brief Number of OpenMP threads the node may use internally
+    //!
+    //! Set by DerivEngine::compute before each call to compute_value or
+    //! propagate_deriv.  Nodes are free to ignore it, but nodes that use
+    //! several threads must produce results that do not depend on the count.
+    int n_threads;
 
     //! \brief Construct only noting if node is a potential_node
     DerivComputation(bool potential_term_):
-        potential_term(potential_term_) {}
+        potential_term(potential_term_), n_threads(1) {}
 
     //! \brief Trivial destructor
     virtual ~DerivComputation() {}
@@ -77,6 +140,34 @@ struct DerivComputation
     virtual std::vector<float> get_value_by_name(const char* log_name) {
         throw std::string("No values implemented");
     }
+
+    //! \brief Internal state that changes during a simulation, for checkpoints
+    //!
+    //! Only state that cannot be recomputed from the positions and parameters
+    //! needs to be returned.  The default is stateless.
+    virtual std::vector<char> get_checkpoint_state() const {return std::vector<char>();}
+
+    //! \brief Restore state saved by get_checkpoint_state
+    virtual void set_checkpoint_state(const std::vector<char>& state) {
+        if(state.size()) throw std::string("node does not accept checkpoint state");
+    }
+
+    //! \brief Update the value after only some elements of the inputs have changed
+    //!
+    //! Called by DerivEngine::compute_incremental instead of compute_value when
+    //! at least one input has changed elements.  An implementation reads the
+    //! changed_elems of its inputs, updates its output (recording changed_elems)
+    //! or its potential, and returns true.  Sensitivities need not be written.
+    //! Returning false (the default) requests a full
+    //! compute_value(PotentialOnlyMode) instead.
+    virtual bool compute_value_incremental() {return false;}
+
+    //! \brief Look up or register objects shared with other nodes of the engine
+    //!
+    //! Called by DerivEngine::build_plan with a fresh SharedResources, so an
+    //! implementation must drop anything it obtained from an earlier call.
+    //! The default shares nothing.
+    virtual void connect_shared(SharedResources& shared) {}
 };
 
 //! Specialization of DerivComputation for derived coordinates
@@ -87,12 +178,48 @@ struct CoordNode : public DerivComputation
     VecArrayStorage output; //!< output values
     VecArrayStorage sens; //!< sensitivity of the overall potential to each output value
 
+    //! \brief Sorted elements whose output changed in the last DerivEngine::compute_incremental
+    //!
+    //! Ignored if all_changed is true
+    std::vector<index_t> changed_elems;
+    bool all_changed; //!< if true, every output element may have changed
+
     //! Initialize from n_elem and elem_width
     CoordNode(int n_elem_, int elem_width_):
         DerivComputation(false),
         n_elem(n_elem_), elem_width(elem_width_), 
         output(elem_width, round_up(n_elem,4)),
-        sens  (elem_width, round_up(n_elem,4)) {}
+        sens  (elem_width, round_up(n_elem,4)),
+        all_changed(false) {}
+
+    //! \brief True if any output element changed in the last incremental computation
+    bool any_changed() const {return all_changed || changed_elems.size();}
+};
+
+
+//! \brief Map from the elements of an input to the outputs (or terms) that depend on them
+//!
+//! Used to implement DerivComputation::compute_value_incremental
+struct ChangeMap {
+    std::vector<std::vector<index_t>> dependents; //!< dependents of each input element
+
+    //! \brief Construct with no dependencies for n_input input elements
+    ChangeMap(int n_input=0): dependents(n_input) {}
+
+    //! \brief Record that dependent reads input element input_elem
+    void add(index_t input_elem, index_t dependent) {
+        if(input_elem<0 || input_elem>=index_t(dependents.size())) 
+            throw std::string("invalid input element for ChangeMap");
+        dependents[input_elem].push_back(dependent);
+    }
+
+    //! \brief Append dependents of the changed elements of input to result (sorted and unique)
+    void collect(std::vector<index_t>& result, const CoordNode& input) const {
+        for(auto ne: input.changed_elems)
+            result.insert(result.end(), dependents[ne].begin(), dependents[ne].end());
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+    }
 };
 
 
@@ -154,13 +281,14 @@ struct DerivEngine
 
         int germ_exec_level; //!< Directed acyclic graph height of compute_value computation
         int deriv_exec_level;//!< Directed acyclic graph height of propagate_deriv computation
+        bool slow;           //!< true for potential nodes evaluated on the outer RESPA time step
 
         //! \brief Construct from name and unique_ptr to computation
         Node(std::string name_, std::unique_ptr<DerivComputation> computation_):
-            name(name_), computation(std::move(computation_)) {};
+            name(name_), computation(std::move(computation_)), slow(false) {};
         //! \brief Construct from name and raw pointer to computation
         Node(std::string name_, DerivComputation* computation_):
-            name(name_), computation(computation_) {};
+            name(name_), computation(computation_), slow(false) {};
         Node(const Node& other) = delete;
         //! \brief Move constructor (Node's are not copyable)
         Node(Node&& other):
@@ -169,10 +297,32 @@ struct DerivEngine
             parents(std::move(other.parents)),
             children(std::move(other.children)),
             germ_exec_level(other.germ_exec_level),
-            deriv_exec_level(other.deriv_exec_level)
+            deriv_exec_level(other.deriv_exec_level),
+            slow(other.slow)
         {}
     };
 
+    //! \brief Single compute_value step of the cached execution plan
+    struct ForwardStep {
+        DerivComputation* computation; //!< computation to execute
+        CoordNode*     coord;     //!< non-null if the computation is a CoordNode (sens zeroed after execution)
+        PotentialNode* pot_node;  //!< non-null if the computation is a PotentialNode (potential accumulated)
+    };
+
+    //! \brief Static schedule for compute, derived from the graph structure
+    //!
+    //! Steps are grouped into stages sorted by exec level (ties broken by node
+    //! index).  The steps of stage i are in the half-open range
+    //! [stage_start[i], stage_start[i+1]).  All nodes in a stage are at the
+    //! same exec level and no two of them write to the sensitivity of a shared
+    //! parent, so the nodes within a stage may be executed concurrently.
+    struct ExecutionPlan {
+        std::vector<ForwardStep> forward;        //!< compute_value steps in germ_exec_level order
+        std::vector<int>         forward_stage_start;  //!< offsets of each stage in forward
+        std::vector<CoordNode*>  backward;       //!< propagate_deriv steps in deriv_exec_level order
+        std::vector<int>         backward_stage_start; //!< offsets of each stage in backward
+    };
+
     //! \brief vector of all Node's in the computation graph
     //!
     //! nodes[0] is guaranteed to be the Pos node
@@ -182,14 +332,59 @@ struct DerivEngine
     //! \brief potential energy output of the computation graph
     //!
     //! The potential should only be read after calling compute(PotentialAndDerivMode)
-    //! and may be any value after the completion of compute(DerivMode)
+    //! or compute(PotentialOnlyMode) and may be any value after the completion of
+    //! compute(DerivMode)
     float potential;
 
+    //! \brief Subset of the graph to execute in compute
+    //!
+    //! FastNodes and SlowNodes contain the fast or slow potential nodes (see
+    //! Node::slow) and all of their ancestors, so coordinate nodes and the Pos
+    //! node may be shared by both.
+    enum NodeSelection {AllNodes=0, FastNodes=1, SlowNodes=2};
+
+    //! \brief Cached schedule for compute (only meaningful if plan_valid)
+    ExecutionPlan plan;
+    //! \brief Cached schedules restricted to FastNodes and SlowNodes
+    ExecutionPlan fast_plan, slow_plan;
+    //! \brief Single slab holding the output and sens of each CoordNode (see allocate_arena)
+    aligned_ptr<float> arena;
+    //! \brief False if the graph has changed since the plan was built
+    bool plan_valid;
+    //! \brief True if all node values are consistent with the current pos (see compute_incremental)
+    bool incremental_valid;
+    //! \brief Number of OpenMP threads used to execute independent nodes of a stage
+    //!
+    //! The default of 1 executes the plan serially.  Threads not needed to run
+    //! the nodes of a stage concurrently are divided among those nodes (see
+    //! DerivComputation::n_threads).  When compute is called from within a
+    //! parallel region (e.g. one thread per replica), nested parallelism must be
+    //! enabled for additional threads to be used.
+    int n_threads;
+    //! \brief Number of integration cycles per evaluation of the slow nodes
+    //!
+    //! A value of 1 (the default) evaluates all nodes at every stage of each
+    //! integration cycle.  See integration_cycle for details.
+    int respa_interval;
+    //! \brief Integration cycles completed since the last slow force evaluation
+    int respa_phase;
+    //! \brief Objects shared between nodes, rebuilt by build_plan (see DerivComputation::connect_shared)
+    //!
+    //! Held by pointer so that its address is stable when the engine is moved.
+    std::unique_ptr<SharedResources> shared;
+
     //! \brief Default constructor (not used)
-    DerivEngine() {}
+    DerivEngine(): plan_valid(false), incremental_valid(false), n_threads(1), respa_interval(1), respa_phase(0),
+        shared(new SharedResources()) {}
     //! \brief Construct from number of atoms
     DerivEngine(int n_atom): 
-        potential(0.f)
+        potential(0.f),
+        plan_valid(false),
+        incremental_valid(false),
+        n_threads(1),
+        respa_interval(1),
+        respa_phase(0),
+        shared(new SharedResources())
     {
         nodes.emplace_back("pos", new Pos(n_atom));
         pos = dynamic_cast<Pos*>(nodes[0].computation.get());
@@ -221,19 +416,57 @@ struct DerivEngine
         return dynamic_cast<T&>(*computation);
     }
 
+    //! \brief Compute exec levels for all nodes and cache the execution plan
+    //!
+    //! The plan depends only on the graph structure, so it is rebuilt only
+    //! after add_node.  compute will build the plan if it is not valid.
+    //! Nodes are assumed to write to parent sensitivities only in
+    //! propagate_deriv (for CoordNode's) or compute_value (for PotentialNode's).
+    //! Shared resources are reconnected in node order.
+    void build_plan();
+
+    //! \brief Move the output and sens buffers of all CoordNode's into a single slab
+    //!
+    //! Buffers are laid out in execution-plan order, each starting on a new
+    //! cache line, and their contents are preserved.  The slab is zeroed by
+    //! the calling thread before use, so calling this from the thread that
+    //! will run the engine places the memory on that thread's NUMA node.  It
+    //! may be called again to move the slab; nodes added later allocate
+    //! their own buffers until the next call.
+    void allocate_arena();
+
     //! \brief Execute computational graph
     //!
-    //! See ComputeMode for details.
-    void compute(ComputeMode mode);
+    //! See ComputeMode for details.  If selection is not AllNodes, only the
+    //! chosen subgraph is executed, the potential is the sum over its
+    //! potential nodes, and sensitivities contain only their derivatives.
+    void compute(ComputeMode mode, NodeSelection selection = AllNodes);
+
+    //! \brief Recompute the potential after only changed_atoms of pos have moved
+    //!
+    //! Nodes with no changed inputs are skipped, and nodes that implement
+    //! compute_value_incremental update only the affected elements.  The
+    //! positions must differ only at changed_atoms from those of the previous
+    //! compute(PotentialAndDerivMode), compute(PotentialOnlyMode), or
+    //! compute_incremental; otherwise a full compute is done.
+    //! Only the potential is valid afterward, and sensitivities are undefined
+    //! until the next call to compute.
+    void compute_incremental(const std::vector<index_t>& changed_atoms);
 
     //! \brief Integration scheme (i.e. position and velocity update weights) to use
     enum IntegratorType {Verlet=0, Predescu=1};
 
     //! \brief Perform a full integration cycle (3 time steps)
     //!
-    //! See integration_stage for details.
+    //! See integration_stage for details.  If respa_interval > 1 and some
+    //! potential nodes are slow, this is an impulse (r-RESPA) multiple time
+    //! step integrator.  Every respa_interval cycles, the slow forces are
+    //! applied as a single momentum kick covering respa_interval cycles, and
+    //! only the fast nodes are evaluated at the stages of each cycle.  If
+    //! thermostat is given, it is applied within the first momentum update of
+    //! the cycle, which is equivalent to calling its apply method beforehand.
     void integration_cycle(VecArray mom, float dt, float max_force,
-            IntegratorType type = Verlet);
+            IntegratorType type = Verlet, OrnsteinUhlenbeckThermostat* thermostat = nullptr);
 };
 
 //! \brief Count the number hbonds for a system
@@ -284,8 +284,9 @@ struct AffineAlignment : public CoordNode
     int n_group;
     CoordNode& pos;
     vector<Params> params;
-    unique_ptr<Float4[]> evals_storage;
-    unique_ptr<Float4[]> evecs_storage;
+    aligned_ptr<Float4> evals_storage;
+    aligned_ptr<Float4> evecs_storage;
+    ChangeMap atom_to_residue;
 
     AffineAlignment(hid_t grp, CoordNode& pos_):
         CoordNode(get_dset_size(2, grp, "atoms")[0], 7),
@@ -293,12 +294,14 @@ struct AffineAlignment : public CoordNode
         
         pos(pos_), params(n_group),
         evals_storage(new_aligned<Float4>(n_group* 4)),
-        evecs_storage(new_aligned<Float4>(n_group*16))
+        evecs_storage(new_aligned<Float4>(n_group*16)),
+        atom_to_residue(pos.n_elem)
     {
         check_size(grp, "atoms",    n_elem, 3);
         check_size(grp, "ref_geom", n_elem, 3,3);  // (residue, atom, xyz)
 
         traverse_dset<2,int  >(grp,"atoms",   [&](size_t i,size_t j,          int   x){
+                atom_to_residue.add(x, i);
                 params[i/4].atom_offsets[j][i%4] = x*pos.output.row_width;});
         traverse_dset<3,float>(grp,"ref_geom",[&](size_t i,size_t na,size_t d,float x){
                 params[i/4].ref_geom[na][d][i%4]=x;});
@@ -314,75 +317,89 @@ struct AffineAlignment : public CoordNode
         }
     }
 
-    virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("affine_alignment"));
-
+    void compute_group(int ng) {
         VecArray rigid_body = output;
         float* posc = pos.output.x.get();
+        const auto& p = params[ng];
+
+        auto atom1 = aligned_gather_vec<3>(posc, Int4(p.atom_offsets[0]));
+        auto atom2 = aligned_gather_vec<3>(posc, Int4(p.atom_offsets[1]));
+        auto atom3 = aligned_gather_vec<3>(posc, Int4(p.atom_offsets[2]));
+
+        auto center = S(1.f/3.f)*(atom1+atom2+atom3);
+        atom1 -= center;
+        atom2 -= center;
+        atom3 -= center;
+
+        auto ref_geom1 = make_vec3(Float4(p.ref_geom[0][0]), Float4(p.ref_geom[0][1]), Float4(p.ref_geom[0][2]));
+        auto ref_geom2 = make_vec3(Float4(p.ref_geom[1][0]), Float4(p.ref_geom[1][1]), Float4(p.ref_geom[1][2]));
+        auto ref_geom3 = make_vec3(Float4(p.ref_geom[2][0]), Float4(p.ref_geom[2][1]), Float4(p.ref_geom[2][2]));
+
+        S R_[3][3];
+        #define R(i,j) (R_[i][j])
+        for(int i=0; i<3; ++i)
+            for(int j=0; j<3; ++j)
+                R(i,j) = atom1[j] * ref_geom1[i]
+                       + atom2[j] * ref_geom2[i]
+                       + atom3[j] * ref_geom3[i];
+
+        S F[10] = {R(0,0)+R(1,1)+R(2,2), R(1,2)-R(2,1),         R(2,0)-R(0,2),         R(0,1)-R(1,0),
+                                         R(0,0)-R(1,1)-R(2,2),  R(0,1)+R(1,0),         R(0,2)+R(2,0),
+                                                               -R(0,0)+R(1,1)-R(2,2),  R(1,2)+R(2,1),
+                                                                                      -R(0,0)-R(1,1)+R(2,2)};
+        #undef R
+
+        // S evals[4], evecs[16];
+        Float4* restrict evals = evals_storage.get() + ng* 4;
+        Float4* restrict evecs = evecs_storage.get() + ng*16;
+
+        symm_QR_4x4(evals, evecs, F, 1e-5f, 100);
+
+        // swap largest eigenvalue into location 0
+        for(int i=1; i<4; ++i) {
+            auto do_flip = evals[0] < evals[i];
+
+            auto eval0 = ternary(do_flip, evals[i], evals[0]);
+            auto evali = ternary(do_flip, evals[0], evals[i]);
+            evals[0] = eval0;
+            evals[i] = evali;
+
+            for(int d=0; d<4; ++d) {
+                auto evec0 = ternary(do_flip, evecs[i*4+d], evecs[0*4+d]);
+                auto eveci = ternary(do_flip, evecs[0*4+d], evecs[i*4+d]);
+                evecs[0*4+d] = evec0;
+                evecs[i*4+d] = eveci;
+            }
+        }
 
-        for(int ng=0; ng<n_group; ++ng) {
-            const auto& p = params[ng];
+        Vec<8,S> body; // really 7 components but I need the eight for the transpose
+        for(int j=0; j<3; ++j) body[j] = center[j];
+        for(int j=0; j<4; ++j) body[3+j] = evecs[0*4+j];
 
-            auto atom1 = aligned_gather_vec<3>(posc, Int4(p.atom_offsets[0]));
-            auto atom2 = aligned_gather_vec<3>(posc, Int4(p.atom_offsets[1]));
-            auto atom3 = aligned_gather_vec<3>(posc, Int4(p.atom_offsets[2]));
-
-            auto center = S(1.f/3.f)*(atom1+atom2+atom3);
-            atom1 -= center;
-            atom2 -= center;
-            atom3 -= center;
-
-            auto ref_geom1 = make_vec3(Float4(p.ref_geom[0][0]), Float4(p.ref_geom[0][1]), Float4(p.ref_geom[0][2]));
-            auto ref_geom2 = make_vec3(Float4(p.ref_geom[1][0]), Float4(p.ref_geom[1][1]), Float4(p.ref_geom[1][2]));
-            auto ref_geom3 = make_vec3(Float4(p.ref_geom[2][0]), Float4(p.ref_geom[2][1]), Float4(p.ref_geom[2][2]));
-
-            S R_[3][3];
-            #define R(i,j) (R_[i][j])
-            for(int i=0; i<3; ++i)
-                for(int j=0; j<3; ++j)
-                    R(i,j) = atom1[j] * ref_geom1[i]
-                           + atom2[j] * ref_geom2[i]
-                           + atom3[j] * ref_geom3[i];
-
-            S F[10] = {R(0,0)+R(1,1)+R(2,2), R(1,2)-R(2,1),         R(2,0)-R(0,2),         R(0,1)-R(1,0),
-                                             R(0,0)-R(1,1)-R(2,2),  R(0,1)+R(1,0),         R(0,2)+R(2,0),
-                                                                   -R(0,0)+R(1,1)-R(2,2),  R(1,2)+R(2,1),
-                                                                                          -R(0,0)-R(1,1)+R(2,2)};
-            #undef R
-
-            // S evals[4], evecs[16];
-            Float4* restrict evals = evals_storage.get() + ng* 4;
-            Float4* restrict evecs = evecs_storage.get() + ng*16;
-
-            symm_QR_4x4(evals, evecs, F, 1e-5f, 100);
-
-            // swap largest eigenvalue into location 0
-            for(int i=1; i<4; ++i) {
-                auto do_flip = evals[0] < evals[i];
-
-                auto eval0 = ternary(do_flip, evals[i], evals[0]);
-                auto evali = ternary(do_flip, evals[0], evals[i]);
-                evals[0] = eval0;
-                evals[i] = evali;
-
-                for(int d=0; d<4; ++d) {
-                    auto evec0 = ternary(do_flip, evecs[i*4+d], evecs[0*4+d]);
-                    auto eveci = ternary(do_flip, evecs[0*4+d], evecs[i*4+d]);
-                    evecs[0*4+d] = evec0;
-                    evecs[i*4+d] = eveci;
-                }
-            }
+        transpose4(body[0],body[1],body[2],body[3]);
+        for(int i=0; i<4; ++i) body[i].store(&rigid_body(0,4*ng+i));
+
+        transpose4(body[4],body[5],body[6],body[7]);
+        for(int i=0; i<4; ++i) body[4+i].store(&rigid_body(4,4*ng+i));
+    }
 
-            Vec<8,S> body; // really 7 components but I need the eight for the transpose
-            for(int j=0; j<3; ++j) body[j] = center[j];
-            for(int j=0; j<4; ++j) body[3+j] = evecs[0*4+j];
+    virtual void compute_value(ComputeMode mode) {
+        Timer timer(string("affine_alignment"));
+        for(int ng=0; ng<n_group; ++ng) compute_group(ng);
+    }
 
-            transpose4(body[0],body[1],body[2],body[3]);
-            for(int i=0; i<4; ++i) body[i].store(&rigid_body(0,4*ng+i));
+    virtual bool compute_value_incremental() override {
+        if(pos.all_changed) return false;
+        atom_to_residue.collect(changed_elems, pos);
 
-            transpose4(body[4],body[5],body[6],body[7]);
-            for(int i=0; i<4; ++i) body[4+i].store(&rigid_body(4,4*ng+i));
+        // residues are computed in groups of 4
+        int last_group = -1;
+        for(auto nr: changed_elems) {
+            if(nr/4 == last_group) continue;
+            last_group = nr/4;
+            compute_group(last_group);
         }
+        return true;
     }
 
     virtual void propagate_deriv() {
@@ -1,6 +1,9 @@
 #include "engine_c_library.h"
 #include "deriv_engine.h"
 #include <algorithm>
+#include <memory>
+#include <atomic>
+#include <omp.h>
 #include "spline.h"
 
 using namespace h5;
@@ -64,6 +67,115 @@ int evaluate_deriv(float* deriv, DerivEngine* engine, const float* pos) try {
 }
 
 
+// A pool of engines constructed from the same potential, used to evaluate
+// batches of configurations concurrently.  Each OpenMP thread evaluates with
+// its own engine, and parameter changes are applied to every engine.
+struct DerivEnginePool {
+    int n_atom;
+    vector<unique_ptr<DerivEngine>> engines;
+};
+
+
+DerivEnginePool* construct_deriv_engine_pool(int n_engine, int n_atom, const char* potential_file, bool quiet) try {
+    if(n_engine<1) n_engine = omp_get_max_threads();
+    H5Obj config = h5_obj(H5Fclose, H5Fopen(potential_file, H5F_ACC_RDONLY, H5P_DEFAULT));
+    auto potential_group = open_group(config.get(), "/input/potential");
+
+    unique_ptr<DerivEnginePool> pool(new DerivEnginePool);
+    pool->n_atom = n_atom;
+    for(int i=0; i<n_engine; ++i) {
+        // only the first engine reports on its construction
+        pool->engines.emplace_back(new DerivEngine(
+                    initialize_engine_from_hdf5(n_atom, potential_group.get(), quiet || i>0)));
+    }
+    return pool.release();
+} catch(const string& e) {
+    fprintf(stderr, "\n\nERROR: %s\n", e.c_str());
+    return 0;
+} catch(...) {
+    return 0;
+}
+
+
+void free_deriv_engine_pool(DerivEnginePool* pool) {
+    delete pool;
+}
+
+
+int set_param_pool(int n_param, const float* param, DerivEnginePool* pool, const char* node_name) try {
+    vector<float> param_v(param, param+n_param);
+    for(auto& engine: pool->engines)
+        engine->get(string(node_name)).computation->set_param(param_v);
+    return 0;
+} catch(const string& s) {
+    fprintf(stderr, "ERROR: %s\n", s.c_str());
+    return 1;
+} catch(...) {
+    fprintf(stderr, "ERROR: %s\n", "unknown error");
+    return 1;
+}
+
+
+// 0 indicates success, anything else is failure
+int evaluate_batch(int n_batch, float* energy, float* deriv, DerivEnginePool* pool, const float* pos,
+        int n_param, float* param_deriv, const char* param_node_name) try {
+    // pos is size (n_batch,n_atom,3), energy is size (n_batch), and deriv (if not null) is
+    // size (n_batch,n_atom,3).  If param_deriv is not null, it is filled with the
+    // (n_batch,n_param) parameter derivatives of the node param_node_name.
+#ifndef PARAM_DERIV
+    if(param_deriv) return -1;
+#endif
+    int n_atom = pool->n_atom;
+    int n_engine = pool->engines.size();
+    atomic<bool> error(false);  // set by any thread that fails
+
+    #pragma omp parallel for schedule(dynamic,1) num_threads(max(1,min(n_engine,n_batch)))
+    for(int nb=0; nb<n_batch; ++nb) {
+        if(error) continue;
+        try {
+            auto& engine = *pool->engines[omp_get_thread_num()];
+            const float* x = pos + nb*n_atom*3;
+
+            VecArray a = engine.pos->output;
+            for(int na: range(n_atom))
+                for(int d: range(3))
+                    a(d,na) = x[na*3+d];
+
+            // parameter derivatives are accumulated from the sensitivities, which must be
+            // recomputed rather than left over from the previous structure on this engine
+            engine.compute((deriv || param_deriv) ? PotentialAndDerivMode : PotentialOnlyMode);
+            energy[nb] = engine.potential;
+
+            if(deriv) {
+                VecArray b = engine.pos->sens;
+                for(int na: range(n_atom))
+                    for(int d: range(3))
+                        deriv[(nb*n_atom+na)*3+d] = b(d,na);
+            }
+
+#ifdef PARAM_DERIV
+            if(param_deriv) {
+                auto deriv_v = engine.get(string(param_node_name)).computation->get_param_deriv();
+                if(deriv_v.size() != size_t(n_param))
+                    throw string("Wrong number of parameters, expected ") + to_string(deriv_v.size()) +
+                        " but got " + to_string(n_param);
+                copy(begin(deriv_v), end(deriv_v), param_deriv + nb*n_param);
+            }
+#endif
+        } catch(const string& s) {
+            #pragma omp critical
+            fprintf(stderr, "ERROR: %s\n", s.c_str());
+            error = true;
+        } catch(...) {
+            error = true;
+        }
+    }
+    return error ? 1 : 0;
+} catch(...) {
+    return 1;
+}
+
+
 int set_param(int n_param, const float* param, DerivEngine* engine, const char* node_name) try {
     vector<float> param_v(param, param+n_param);
     engine->get(string(node_name)).computation->set_param(param_v);
@@ -26,6 +26,16 @@ extern "C" {
     int get_value_by_name(int n_output, float* output, DerivEngine* engine,
             const char* node_name, const char* log_name);
 
+    struct DerivEnginePool;
+
+    // n_engine<1 uses one engine per OpenMP thread
+    DerivEnginePool* construct_deriv_engine_pool(int n_engine, int n_atom, const char* potential_file, bool quiet);
+    void free_deriv_engine_pool(DerivEnginePool* pool);
+
+    int set_param_pool(int n_param, const float* param, DerivEnginePool* pool, const char* node_name);
+    int evaluate_batch(int n_batch, float* energy, float* deriv, DerivEnginePool* pool, const float* pos,
+            int n_param, float* param_deriv, const char* param_node_name);
+
     int clamped_spline_solve       (int N, float* bspline_coeff, const float* values);
     int clamped_spline_value       (int N, float* result, const float* bspline_coeff, int nx, float* x);
     int get_clamped_value_and_deriv(int N, float* result, const float* bspline_coeff, int nx, float* x);
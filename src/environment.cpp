@@ -14,6 +14,7 @@ namespace {
 
         constexpr static bool  symmetric = false;
         constexpr static int   n_param=4, n_dim1=6, n_dim2=4, simd_width=1;
+        constexpr static bool  wide_lanes = true;  // compute_edge for any lane width (see EdgeLanes)
 
         static float cutoff(const float* p) {
             return p[0] + compact_sigmoid_cutoff(p[1]);
@@ -24,9 +25,9 @@ namespace {
             return (sequence_exclude < id1-id2) | (sequence_exclude < id2-id1);
         }
 
-        static Float4 compute_edge(Vec<n_dim1,Float4> &d1, Vec<n_dim2,Float4> &d2, const float* p[4],
-                const Vec<n_dim1,Float4> &cb_pos, const Vec<n_dim2,Float4> &sc_pos) {
-            Float4 one(1.f);
+        template<int W>
+        static FloatLanes<W> compute_edge(Vec<n_dim1,FloatLanes<W>> &d1, Vec<n_dim2,FloatLanes<W>> &d2, const float** p,
+                const Vec<n_dim1,FloatLanes<W>> &cb_pos, const Vec<n_dim2,FloatLanes<W>> &sc_pos) {
             auto displace = extract<0,3>(sc_pos)-extract<0,3>(cb_pos);
             auto rvec1 = extract<3,6>(cb_pos);
             auto prob  = sc_pos[3];
@@ -37,11 +38,8 @@ namespace {
             auto displace_unitvec = inv_dist*displace;
 
             // read parameters then transpose
-            Float4 r0(p[0]);
-            Float4 r_sharpness(p[1]);
-            Float4 dot0(p[2]);
-            Float4 dot_sharpness(p[3]);
-            transpose4(r0,r_sharpness,dot0,dot_sharpness);
+            FloatLanes<W> r0, r_sharpness, dot0, dot_sharpness;
+            load_transposed4(p, r0,r_sharpness,dot0,dot_sharpness);
 
             auto dp = dot(displace_unitvec,rvec1);
             auto radial_sig  = compact_sigmoid(dist-r0, r_sharpness);
@@ -85,7 +83,7 @@ struct EnvironmentCoverage : public CoordNode {
     virtual void compute_value(ComputeMode mode) override {
         Timer timer(string("environment_coverage"));
 
-        igraph.compute_edges();
+        igraph.compute_edges(mode, n_threads);
 
         fill(output, 0.f);
         for(int ne=0; ne<igraph.n_edge; ++ne)  // accumulate for each cb
@@ -97,7 +95,7 @@ struct EnvironmentCoverage : public CoordNode {
 
         for(int ne: range(igraph.n_edge))
             igraph.edge_sensitivity[ne] = sens(0,igraph.edge_indices1[ne]);
-        igraph.propagate_derivatives();
+        igraph.propagate_derivatives(n_threads);
     }
 
     virtual std::vector<float> get_param() const override {return igraph.get_param();}
@@ -105,6 +103,9 @@ struct EnvironmentCoverage : public CoordNode {
     virtual std::vector<float> get_param_deriv() override {return igraph.get_param_deriv();}
 #endif
     virtual void set_param(const std::vector<float>& new_param) override {igraph.set_param(new_param);}
+    virtual void connect_shared(SharedResources& shared) override {igraph.connect_shared(shared);}
+    virtual std::vector<char> get_checkpoint_state() const override {return igraph.get_checkpoint_state();}
+    virtual void set_checkpoint_state(const std::vector<char>& state) override {igraph.set_checkpoint_state(state);}
 };
 static RegisterNodeType<EnvironmentCoverage,2> environment_coverage_node("environment_coverage");
 
@@ -160,8 +161,8 @@ struct UniformTransform : public CoordNode {
     int n_coeff;
     float spline_offset;
     float spline_inv_dx;
-    unique_ptr<float[]> bspline_coeff;
-    unique_ptr<float[]> jac;
+    aligned_ptr<float> bspline_coeff;
+    aligned_ptr<float> jac;
 
 
     UniformTransform(hid_t grp, CoordNode& input_):
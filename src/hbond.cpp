@@ -21,7 +21,7 @@ struct Infer_H_O : public CoordNode
     CoordNode& pos;
     int n_donor, n_acceptor, n_virtual;
     vector<Params> params;
-    unique_ptr<float[]> data_for_deriv;
+    aligned_ptr<float> data_for_deriv;
 
     Infer_H_O(hid_t grp, CoordNode& pos_):
         CoordNode(
@@ -238,14 +238,15 @@ namespace {
     };
 
 
+    template <typename BK>
     struct HBondCoverageInteraction {
         // radius scale angular_width angular_scale
         // first group is hb; second group is sc
 
         constexpr static bool  symmetric = false;
-        constexpr static int   n_knot = N_KNOT_SC_BB, n_knot_angular=N_KNOT_ANGULAR;
+        constexpr static int   n_knot = BK::n_knot_sc_bb, n_knot_angular=BK::n_knot_angular;
         constexpr static int   n_param=2*n_knot_angular+2*n_knot, n_dim1=7, n_dim2=6, simd_width=1;
-        constexpr static float inv_dx = 1.f/KNOT_SPACING, inv_dtheta = (n_knot_angular-3)/2.f;
+        constexpr static float inv_dx = 1.f/BK::knot_spacing, inv_dtheta = (n_knot_angular-3)/2.f;
 
         static float cutoff(const float* p) {
             return (n_knot-2-1e-6)/inv_dx;  // 1e-6 insulates from roundoff
@@ -292,7 +293,7 @@ struct ProteinHBond : public CoordNode
     CoordNode& infer;
     InteractionGraph<ProteinHBondInteraction> igraph;
     int n_donor, n_acceptor, n_virtual;
-    unique_ptr<float[]> sens_scaled;
+    aligned_ptr<float> sens_scaled;
 
     ProteinHBond(hid_t grp, CoordNode& infer_):
         CoordNode(get_dset_size(1,grp,"index1")[0]+get_dset_size(1,grp,"index2")[0], 7),
@@ -310,6 +311,10 @@ struct ProteinHBond : public CoordNode
         }
     }
 
+    virtual void connect_shared(SharedResources& shared) override {igraph.connect_shared(shared);}
+    virtual std::vector<char> get_checkpoint_state() const override {return igraph.get_checkpoint_state();}
+    virtual void set_checkpoint_state(const std::vector<char>& state) override {igraph.set_checkpoint_state(state);}
+
     virtual void compute_value(ComputeMode mode) override {
         Timer timer(string("protein_hbond"));
 
@@ -323,7 +328,7 @@ struct ProteinHBond : public CoordNode
         }
 
         // Compute protein hbonding score and its derivative
-        igraph.compute_edges();
+        igraph.compute_edges(mode, n_threads);
         for(int ne=0; ne<igraph.n_edge; ++ne) {
             int nd = igraph.edge_indices1[ne];
             int na = igraph.edge_indices2[ne];
@@ -350,7 +355,7 @@ struct ProteinHBond : public CoordNode
 
             igraph.edge_sensitivity[ne] = don_sens + acc_sens;
         }
-        igraph.propagate_derivatives();
+        igraph.propagate_derivatives(n_threads);
 
         // pass through derivatives on all other components
         VecArray pd1 = igraph.pos_node1->sens;
@@ -368,8 +373,9 @@ struct ProteinHBond : public CoordNode
 static RegisterNodeType<ProteinHBond,1> hbond_node("protein_hbond");
 
 
+template <typename BK>
 struct HBondCoverage : public CoordNode {
-    InteractionGraph<HBondCoverageInteraction> igraph;
+    InteractionGraph<HBondCoverageInteraction<BK>> igraph;
     int n_sc;
 
     HBondCoverage(hid_t grp, CoordNode& infer_, CoordNode& sidechains_):
@@ -381,7 +387,7 @@ struct HBondCoverage : public CoordNode {
         Timer timer(string("hbond_coverage"));
 
         // Compute coverage and its derivative
-        igraph.compute_edges();
+        igraph.compute_edges(mode, n_threads);
 
         fill(output, 0.f);
         for(int ne=0; ne<igraph.n_edge; ++ne) {
@@ -394,7 +400,7 @@ struct HBondCoverage : public CoordNode {
 
         for(int ne: range(igraph.n_edge))
             igraph.edge_sensitivity[ne] = sens(0,igraph.edge_indices2[ne]);
-        igraph.propagate_derivatives();
+        igraph.propagate_derivatives(n_threads);
     }
 
     virtual std::vector<float> get_param() const override {return igraph.get_param();}
@@ -402,6 +408,9 @@ struct HBondCoverage : public CoordNode {
     virtual std::vector<float> get_param_deriv() override {return igraph.get_param_deriv();}
 #endif
     virtual void set_param(const std::vector<float>& new_param) override {igraph.set_param(new_param);}
+    virtual void connect_shared(SharedResources& shared) override {igraph.connect_shared(shared);}
+    virtual std::vector<char> get_checkpoint_state() const override {return igraph.get_checkpoint_state();}
+    virtual void set_checkpoint_state(const std::vector<char>& state) override {igraph.set_checkpoint_state(state);}
 
     virtual vector<float> get_value_by_name(const char* log_name) override {
         if(!strcmp(log_name, "count_edges_by_type")) {
@@ -411,7 +420,23 @@ struct HBondCoverage : public CoordNode {
         }
     }
 };
-static RegisterNodeType<HBondCoverage,2> coverage_node("hbond_coverage");
+
+template <typename BK>
+struct CreateHBondCoverage {
+    static DerivComputation* create(hid_t grp, CoordNode& infer, CoordNode& sidechains) {
+        return new HBondCoverage<BK>(grp, infer, sidechains);
+    }
+};
+
+struct RegisterHBondCoverage {
+    RegisterHBondCoverage(string name_prefix) {
+        NodeCreationFunction f = [](hid_t grp, const ArgList& args) {
+            check_arguments_length(args,2);
+            return create_for_bead_knots<CreateHBondCoverage>(grp, false, grp, *args[0], *args[1]);};
+        add_node_creation_function(name_prefix, f);
+    }
+};
+static RegisterHBondCoverage coverage_node("hbond_coverage");
 
 
 struct HBondEnergy : public HBondCounter
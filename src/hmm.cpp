@@ -128,7 +128,7 @@ struct FixedHMM : public PotentialNode
             // now put minimum in all elements of e_min Float4
             e_min = min(shuffle<0,1,0,1>(e_min), shuffle<2,3,2,3>(e_min));
             e_min = min(e_min.broadcast<0>(), e_min.broadcast<1>());
-            if(mode==PotentialAndDerivMode) pot += e_min.x();
+            if(mode!=DerivMode) pot += e_min.x();
 
             // write emmision probabilities
             float* p = &emission_prob(0,nr);
@@ -144,11 +144,11 @@ struct FixedHMM : public PotentialNode
             if(nr) forward = forward*transition_matrix;
             forward.array() *= Map<RowVectorXf>(&emission_prob(0,nr), n_state).array();
             float norm = forward.sum();
-            if(mode==PotentialAndDerivMode) pot -= logf(norm);
+            if(mode!=DerivMode) pot -= logf(norm);
             forward *= rcp(norm);
             Map<RowVectorXf>(&forward_belief(0,nr), n_state) = forward;
         }
-        if(mode==PotentialAndDerivMode) potential = pot;
+        if(mode!=DerivMode) potential = pot;
         // tforw.stop();
 
         // Timer tback("hmm_backward");
@@ -165,7 +165,7 @@ struct FixedHMM : public PotentialNode
             marginal *= rcp(marginal.sum());
             Map<VectorXf>(&sens(0,nr), n_state) += marginal;
 
-            if(mode==PotentialAndDerivMode) {
+            if(mode!=DerivMode) {
                 Map<VectorXf> en(&n1b(0,params[nr].index), n_state);
                 auto avg_energy_1body = marginal.dot(en);
                 auto entropy_1body =  marginal.dot((marginal+1e-8f*VectorXf::Ones(n_state)).array().log().matrix());
@@ -6,18 +6,24 @@
 #include "vector_math.h"
 #include "h5_support.h"
 #include "timing.h"
+#include "state_logger.h"
 #include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include <type_traits>
 #include "Float4.h"
 
 
-template <typename T>
-inline T* operator+(const std::unique_ptr<T[]>& ptr, int i) {
+template <typename T, typename D>
+inline T* operator+(const std::unique_ptr<T[],D>& ptr, int i) {
     // little function to make unique_ptr for an array do pointer arithmetic
     return ptr.get()+i;
 }
 
-template <typename T>
-void fill_n(std::unique_ptr<T[]> &ptr, int n_elem, const T& value) {
+template <typename T, typename D>
+void fill_n(std::unique_ptr<T[],D> &ptr, int n_elem, const T& value) {
     std::fill_n(ptr.get(), n_elem, value);
 }
 
@@ -28,208 +34,882 @@ static T&& message(const std::string& s, T&& x) {
 }
 
 
+typedef Int4(*acceptable_id_pair_t)(const Int4&,const Int4&);
+
+//! \brief Verlet cache of candidate pairs, which may be shared by several PairlistComputation's
+//!
+//! The cache holds all pairs within cache_cutoff at the positions of the last rebuild that
+//! are acceptable to at least one consumer.  Each consumer registers its cutoff, buffer, and
+//! acceptable_id_pair, and the cache is rebuilt at the largest cutoff plus buffer of its
+//! consumers.  Consumers sharing a cache must pass the same positions and ids (see
+//! PairlistComputation::share_cache).  If their filters differ, each consumer applies its
+//! own filter again when refining the cache edges.
 template <bool symmetric>
-struct PairlistComputation {
-    typedef Int4(*acceptable_id_pair_t)(const Int4&,const Int4&);
-    public:
-        const int n_elem1, n_elem2;
-        std::unique_ptr<int32_t[]>  edge_indices1, edge_indices2;
-        std::unique_ptr<int32_t[]>  edge_id1,      edge_id2;
-        int n_edge;
+struct PairlistCache {
+    // Number of lanes used to refine the cache edges.  Edge buffers have room for
+    // an extra group of this many lanes, since full groups are stored past the last edge.
+    constexpr static const int refine_width = max_simd_width;
+
+    const int n_elem1, n_elem2;
+    int max_n_edge;
+
+    bool valid;
+    float cache_cutoff;
+    aligned_ptr<float>    pos1, pos2;
+    aligned_ptr<int32_t>  id1,  id2;
+    aligned_ptr<int32_t>  edge_indices1, edge_indices2;
+    aligned_ptr<int32_t>  edge_id1,      edge_id2;
+    int n_edge;
 
-    protected:
-        bool cache_valid;
-        float cache_buffer;
-        float cache_cutoff;
-        std::unique_ptr<float[]>    cache_pos1, cache_pos2;
-        std::unique_ptr<int32_t[]>  cache_id1,  cache_id2;
-        std::unique_ptr<int32_t[]>  cache_edge_indices1, cache_edge_indices2;
-        std::unique_ptr<int32_t[]>  cache_edge_id1,      cache_edge_id2;
-        int cache_n_edge;
+    std::vector<float> consumer_cutoff, consumer_buffer;
+    // null for a consumer that did not register a filter, which then uses the filter passed
+    // to ensure_valid (only possible for a private cache)
+    std::vector<acceptable_id_pair_t> consumer_filter;
+    bool mixed_filter;  // true if the consumers do not all use the same filter
+
+    // A check at the largest consumer cutoff is valid for every consumer until the inputs
+    // change, which cannot happen within a single DerivEngine::compute.
+    const SharedResources* shared;  // null if the cache is private
+    uint64_t checked_compute;
+    float    checked_cutoff;
+    std::mutex mutex;
+
+    // The buffers of the consumers are scaled by buffer_scale, which is tuned after every
+    // tune_window rebuilds to minimize the cost per check.  The cost is counted in pair
+    // distance evaluations (cache edges refined by each consumer plus candidate pairs
+    // examined by rebuilds) rather than time, so that it does not depend on the machine.
+    constexpr static const int tune_window = 4;
+    bool   adaptive_buffer;
+    float  buffer_scale;
+    float  tune_direction;
+    double window_cost, last_window_cost;
+    long   window_check;
+    int    window_rebuild;
+
+    // Statistics since construction
+    long   n_check, n_rebuild;
+    double rebuild_work;
+
+    // Every reorder_interval rebuilds (never if 0), the elements are renumbered in Morton
+    // order of their positions so that neighbors are close in memory.  Positions, ids, and
+    // edge indices refer to slots, and order1[slot] (order2 for the second set of elements)
+    // is the original index of the element in that slot.  Users must pack
+    // their inputs in slot order; order_version changes whenever the order does.
+    int reorder_interval;
+    int order_version;
+    std::vector<int32_t> order1, order2;
+
+    PairlistCache(int n_elem1_, int n_elem2_, int max_n_edge_):
+        n_elem1(n_elem1_), n_elem2(n_elem2_), max_n_edge(0),
+        valid(false),
+        cache_cutoff(0.f),
+        pos1(new_aligned<float>(round_up(n_elem1,16)*4,             4)),
+        pos2(new_aligned<float>(round_up(symmetric?16:n_elem2,16)*4,4)),
+        id1(new_aligned<int32_t>(round_up(n_elem1,16),4)),
+        id2(new_aligned<int32_t>(round_up(n_elem2,16),4)),
+        n_edge(0),
+        mixed_filter(false),
+        shared(nullptr),
+        checked_compute(0),
+        checked_cutoff(0.f),
+        adaptive_buffer(true),
+        buffer_scale(1.f),
+        tune_direction(1.f),
+        window_cost(0.), last_window_cost(-1.),
+        window_check(0), window_rebuild(0),
+        n_check(0), n_rebuild(0), rebuild_work(0.),
+        reorder_interval(0),
+        order_version(0)
+    {
+        for(int i=0; i<n_elem1; ++i) order1.push_back(i);
+        if(!symmetric) for(int i=0; i<n_elem2; ++i) order2.push_back(i);
+        for(int i=0; i<n_elem1; i+=4)
+            for(int j=0; j<4; ++j) Float4(1e10f).store(pos1+4*(i+j));
+        if(!symmetric)
+            for(int i=0; i<n_elem2; i+=4)
+                for(int j=0; j<4; ++j) Float4(1e10f).store(pos2+4*(i+j));
+        reserve_edges(std::max(16, max_n_edge_));
+    }
 
-        template<acceptable_id_pair_t acceptable_id_pair>
-        void ensure_cache_valid(
-                float cutoff,
-                const float* aligned_pos1, const int pos1_stride, int* id1, 
-                const float* aligned_pos2, const int pos2_stride, int* id2)
-        {
-            Timer t1("pairlist_cache_check");
-            // Find maximum deviation from cached positions to determine if cache must be rebuilt
-            auto max_dist_exceeded = Float4();
-            auto id_changed = Int4();
-            auto max_cache_dist2 = Float4(sqr(0.5f*(cache_cutoff - cutoff)));
-
-            for(int i=0; i<n_elem1; i+=4) {
-                auto x = Float4(aligned_pos1+pos1_stride*(i+0)) - Float4(cache_pos1+4*(i+0));
-                auto y = Float4(aligned_pos1+pos1_stride*(i+1)) - Float4(cache_pos1+4*(i+1));
-                auto z = Float4(aligned_pos1+pos1_stride*(i+2)) - Float4(cache_pos1+4*(i+2));
-                auto w = Float4(aligned_pos1+pos1_stride*(i+3)) - Float4(cache_pos1+4*(i+3));
+    // Ensure room for at least n_needed cache edges, keeping the first n_keep.  The edge
+    // arrays grow geometrically during rebuilds, so the copying is amortized.
+    void reserve_edges(int n_needed, int n_keep=0) {
+        if(n_needed <= max_n_edge) return;
+        int new_max_n_edge = round_up(std::max(n_needed, max_n_edge + max_n_edge/2), 16);
+        grow_aligned(edge_indices1, n_keep, new_max_n_edge+refine_width, 4);
+        grow_aligned(edge_indices2, n_keep, new_max_n_edge+refine_width, 4);
+        grow_aligned(edge_id1,      n_keep, new_max_n_edge+refine_width, 4);
+        grow_aligned(edge_id2,      n_keep, new_max_n_edge+refine_width, 4);
+        max_n_edge = new_max_n_edge;
+    }
+
+    int add_consumer(float cutoff, float buffer, int consumer_max_n_edge,
+            acceptable_id_pair_t filter=nullptr) {
+        reserve_edges(consumer_max_n_edge);
+        valid = false;
+        consumer_cutoff.push_back(cutoff);
+        consumer_buffer.push_back(buffer);
+        consumer_filter.push_back(filter);
+        for(auto f: consumer_filter) mixed_filter |= f != consumer_filter[0];
+        return int(consumer_cutoff.size())-1;
+    }
+
+    // Mask of the pairs acceptable to any consumer
+    template<acceptable_id_pair_t acceptable_id_pair>
+    Int4 acceptable_to_any(const Int4& my_id1, const Int4& my_id2) const {
+        if(!mixed_filter) return acceptable_id_pair(my_id1,my_id2);
+        Int4 any;
+        for(auto f: consumer_filter) if(f) any |= f(my_id1,my_id2);
+        return any;
+    }
+
+    template<acceptable_id_pair_t acceptable_id_pair>
+    void ensure_valid(
+            int consumer, float cutoff,
+            const float* aligned_pos1, const int pos1_stride, int* id1_, 
+            const float* aligned_pos2, const int pos2_stride, int* id2_)
+    {
+        consumer_cutoff[consumer] = cutoff;
+        float max_cutoff = 0.f, build_cutoff = 0.f;
+        for(size_t i=0; i<consumer_cutoff.size(); ++i) {
+            max_cutoff   = std::max(max_cutoff,   consumer_cutoff[i]);
+            build_cutoff = std::max(build_cutoff, consumer_cutoff[i]+buffer_scale*consumer_buffer[i]);
+        }
+
+        if(valid && shared && shared->computing && checked_compute==shared->n_compute && cutoff<=checked_cutoff)
+            return;
+
+        Timer t1("pairlist_cache_check");
+        // Find maximum deviation from cached positions to determine if cache must be rebuilt
+        auto max_dist_exceeded = Float4();
+        auto id_changed = Int4();
+        auto max_cache_dist2 = Float4(sqr(0.5f*(cache_cutoff - max_cutoff)));
+
+        for(int i=0; i<n_elem1; i+=4) {
+            auto x = Float4(aligned_pos1+pos1_stride*(i+0)) - Float4(pos1+4*(i+0));
+            auto y = Float4(aligned_pos1+pos1_stride*(i+1)) - Float4(pos1+4*(i+1));
+            auto z = Float4(aligned_pos1+pos1_stride*(i+2)) - Float4(pos1+4*(i+2));
+            auto w = Float4(aligned_pos1+pos1_stride*(i+3)) - Float4(pos1+4*(i+3));
+
+            transpose4(x,y,z,w);
+            max_dist_exceeded |= max_cache_dist2 < x*x+y*y+z*z;
+
+            // To ensure the caching is completely transparent, we must also ensure that the id's have not 
+            // changed.  Hopefully, this check is quite quick.
+            id_changed |= Int4(id1_+i)!=Int4(id1+i);
+        }
+        if(!symmetric) {
+            for(int i=0; i<n_elem2; i+=4) {
+                auto x = Float4(aligned_pos2+pos2_stride*(i+0)) - Float4(pos2+4*(i+0));
+                auto y = Float4(aligned_pos2+pos2_stride*(i+1)) - Float4(pos2+4*(i+1));
+                auto z = Float4(aligned_pos2+pos2_stride*(i+2)) - Float4(pos2+4*(i+2));
+                auto w = Float4(aligned_pos2+pos2_stride*(i+3)) - Float4(pos2+4*(i+3));
 
                 transpose4(x,y,z,w);
                 max_dist_exceeded |= max_cache_dist2 < x*x+y*y+z*z;
-
-                // To ensure the caching is completely transparent, we must also ensure that the id's have not 
-                // changed.  Hopefully, this check is quite quick.
-                id_changed |= Int4(id1+i)!=Int4(cache_id1+i);
+                id_changed |= Int4(id2_+i)!=Int4(id2+i);
             }
-            if(!symmetric) {
-                for(int i=0; i<n_elem2; i+=4) {
-                    auto x = Float4(aligned_pos2+pos2_stride*(i+0)) - Float4(cache_pos2+4*(i+0));
-                    auto y = Float4(aligned_pos2+pos2_stride*(i+1)) - Float4(cache_pos2+4*(i+1));
-                    auto z = Float4(aligned_pos2+pos2_stride*(i+2)) - Float4(cache_pos2+4*(i+2));
-                    auto w = Float4(aligned_pos2+pos2_stride*(i+3)) - Float4(cache_pos2+4*(i+3));
-
-                    transpose4(x,y,z,w);
-                    max_dist_exceeded |= max_cache_dist2 < x*x+y*y+z*z;
-                    id_changed |= Int4(id2+i)!=Int4(cache_id2+i);
-                }
+        }
+        t1.stop();
+
+        checked_compute = shared ? shared->n_compute : 0;
+        checked_cutoff  = max_cutoff;
+
+        // We don't do early bailout since the cache should be valid most of the time
+        if(valid && max_cutoff<cache_cutoff && max_dist_exceeded.none() && id_changed.none()) {
+            record_check();
+            return;
+        }
+        // printf("cache rebuild\n");
+
+        // If we reach here, we must rebuild the cache
+
+        Timer t2("pairlist_cache_rebuild");
+        // Store the new cache positions
+        cache_cutoff = build_cutoff;
+
+        if(reorder_interval>0 && n_rebuild%reorder_interval==0) {
+            // The positions are stored in the new slot order, so that the pairs found below
+            // refer to the new slots
+            store_reordered(order1, n_elem1, aligned_pos1, pos1_stride, id1_, pos1.get(), id1.get());
+            if(!symmetric)
+                store_reordered(order2, n_elem2, aligned_pos2, pos2_stride, id2_, pos2.get(), id2.get());
+            order_version++;
+        } else {
+            store_positions(n_elem1, aligned_pos1, pos1_stride, id1_, pos1.get(), id1.get());
+            if(!symmetric)
+                store_positions(n_elem2, aligned_pos2, pos2_stride, id2_, pos2.get(), id2.get());
+        }
+
+        // Find all cache pairs
+        alignas(16) int32_t offset_v[4] = {0,1,2,3};
+        Int4 offset(offset_v);
+        auto cutoff2 = Float4(sqr(cache_cutoff));
+
+        const int      n_elem_grid = symmetric ? n_elem1 : n_elem2;
+        const float*   grid_pos    = symmetric ? pos1.get() : pos2.get();
+        const int32_t* grid_id     = symmetric ? id1.get()  : id2.get();
+        // The cell list skips i2 that cannot be within the cutoff, so both paths produce the same
+        // set of cache edges in the same format.  Only the order of i2 within each i1 block
+        // differs, and the path is fixed by the system size so results remain reproducible.
+        bool use_cell_list = n_elem_grid >= cell_list_min_elem && build_cell_list(n_elem_grid, grid_pos);
+
+        int ne = 0;
+        long n_candidate = 0;
+        for(int32_t i1=0; i1<n_elem1; i1+=4) {
+            Float4 v0(pos1+(i1+0)*4), // aligned_pos1 size was rounded up
+                   v1(pos1+(i1+1)*4), 
+                   v2(pos1+(i1+2)*4), 
+                   v3(pos1+(i1+3)*4);
+            transpose4(v0,v1,v2,v3); // v3 will be unused at the end
+            auto  x1 = make_vec3(v0,v1,v2);
+
+            auto  my_id1 = Int4(id1+i1);
+            auto  i1_vec = Int4(i1) + offset;
+
+            auto add_pairs = [&](int32_t i2) {
+                ++n_candidate;
+                const float* p = grid_pos+i2*4;
+                auto  x2 = make_vec3(Float4(p[0]), Float4(p[1]),  Float4(p[2]));
+                auto near = mag2(x1-x2)<cutoff2;
+                if(near.none()) return;
+                reserve_edges(ne+4, ne);
+
+                auto my_id2 = Int4(grid_id[i2]);
+                auto i2_vec = Int4(i2);
+
+                Int4 is_hit = acceptable_to_any<acceptable_id_pair>(my_id1,my_id2) & (symmetric 
+                    ? (i1_vec<i2_vec) & near.cast_int()
+                    :                   near.cast_int());
+                int is_hit_bits = is_hit.movemask();
+
+                // i2_vec and my_id2 is constant, so we don't have to left pack
+                // left_pack requires a read, so do before the writes
+
+                // write out pairs
+                int n_hit = popcnt_nibble(is_hit_bits);
+                i1_vec.left_pack(is_hit_bits).store(edge_indices1+ne, Alignment::unaligned);
+                my_id1.left_pack(is_hit_bits).store(edge_id1     +ne, Alignment::unaligned);
+                i2_vec                       .store(edge_indices2+ne, Alignment::unaligned);
+                my_id2                       .store(edge_id2     +ne, Alignment::unaligned);
+                ne += n_hit;
+            };
+
+            if(use_cell_list) {
+                for_each_cell_candidate(i1, symmetric?i1+1:0, add_pairs);
+            } else {
+                for(int32_t i2=symmetric?i1+1:0; i2<n_elem2; ++i2) add_pairs(i2);
             }
-            t1.stop();
+        }
+        n_edge = ne;
+        for(int i=ne; i<round_up(ne,refine_width); ++i) {
+            // we need something sane to fill out the last group for refine_edges so just
+            // duplicate an interaction.  These edges are discarded after the refinement.
+            edge_indices1[i] = edge_indices1[0];
+            edge_indices2[i] = edge_indices2[0]; // just put something sane here
+        }
+        valid = true;
+        // printf("found %i cache edges\n", n_edge);
+
+        n_rebuild++;
+        rebuild_work += 4.*n_candidate;
+        window_cost  += 4.*n_candidate;
+        window_rebuild++;
+        record_check();
+        if(window_rebuild == tune_window) tune_buffer();
+    }
 
-            // We don't do early bailout since the cache should be valid most of the time
-            if(cache_valid && max_dist_exceeded.none() && id_changed.none()) return;
-            // printf("cache rebuild\n");
+    // Dynamical state for checkpoints: the cached pairs, the buffer tuning, and the element
+    // order.  Restoring it lets a restarted simulation rebuild, retune, and reorder at the
+    // same steps as the original run, so that its edges are summed in the same order.
+    std::vector<char> get_state() const {
+        std::vector<char> state;
+        const int n_pos2 = round_up(symmetric?16:n_elem2,16)*4;
+        const int n_stored_edge = valid ? round_up(n_edge,refine_width) : 0;
+        write_checkpoint_vector(state, std::vector<int32_t>{
+                int32_t(valid), n_edge, order_version, window_rebuild});
+        write_checkpoint_vector(state, std::vector<int64_t>{n_check, n_rebuild, window_check});
+        write_checkpoint_vector(state, std::vector<double>{
+                cache_cutoff, buffer_scale, tune_direction, window_cost, last_window_cost, rebuild_work});
+        write_checkpoint_vector(state, order1);
+        write_checkpoint_vector(state, order2);
+        write_checkpoint_vector(state, std::vector<float>  (pos1.get(), pos1.get()+round_up(n_elem1,16)*4));
+        write_checkpoint_vector(state, std::vector<float>  (pos2.get(), pos2.get()+n_pos2));
+        write_checkpoint_vector(state, std::vector<int32_t>(id1.get(),  id1.get() +round_up(n_elem1,16)));
+        write_checkpoint_vector(state, std::vector<int32_t>(id2.get(),  id2.get() +round_up(n_elem2,16)));
+        for(auto& a: {&edge_indices1, &edge_indices2, &edge_id1, &edge_id2})
+            write_checkpoint_vector(state, std::vector<int32_t>(a->get(), a->get()+n_stored_edge));
+        return state;
+    }
 
-            // If we reach here, we must rebuild the cache
+    void set_state(const std::vector<char>& state) {
+        size_t pos = 0;
+        std::vector<int32_t> ints;
+        std::vector<int64_t> counts;
+        std::vector<double>  reals;
+        read_checkpoint_vector(state, pos, ints);
+        read_checkpoint_vector(state, pos, counts);
+        read_checkpoint_vector(state, pos, reals);
+        if(ints.size()!=4u || counts.size()!=3u || reals.size()!=6u)
+            throw std::string("invalid checkpoint state for pairlist");
+
+        std::vector<int32_t> new_order1, new_order2;
+        read_checkpoint_vector(state, pos, new_order1);
+        read_checkpoint_vector(state, pos, new_order2);
+        if(new_order1.size()!=order1.size() || new_order2.size()!=order2.size())
+            throw std::string("invalid checkpoint state for pairlist");
+
+        auto read_array = [&](int32_t* dest, size_t n) {
+            std::vector<int32_t> v;
+            read_checkpoint_vector(state, pos, v);
+            if(v.size()!=n) throw std::string("invalid checkpoint state for pairlist");
+            std::memcpy(dest, v.data(), n*sizeof(int32_t));
+        };
+        const int n_pos2 = round_up(symmetric?16:n_elem2,16)*4;
+        const int n_stored_edge = ints[0] ? round_up(ints[1],refine_width) : 0;
+        reserve_edges(n_stored_edge);
+        // positions are read as int32_t to copy their bits exactly
+        read_array(reinterpret_cast<int32_t*>(pos1.get()), round_up(n_elem1,16)*4);
+        read_array(reinterpret_cast<int32_t*>(pos2.get()), n_pos2);
+        read_array(id1.get(), round_up(n_elem1,16));
+        read_array(id2.get(), round_up(n_elem2,16));
+        for(auto& a: {&edge_indices1, &edge_indices2, &edge_id1, &edge_id2})
+            read_array(a->get(), n_stored_edge);
+        if(pos != state.size()) throw std::string("invalid checkpoint state for pairlist");
+
+        valid            = ints[0];
+        n_edge           = ints[1];
+        order_version    = ints[2];
+        window_rebuild   = ints[3];
+        n_check          = counts[0];
+        n_rebuild        = counts[1];
+        window_check     = counts[2];
+        cache_cutoff     = reals[0];
+        buffer_scale     = reals[1];
+        tune_direction   = reals[2];
+        window_cost      = reals[3];
+        last_window_cost = reals[4];
+        rebuild_work     = reals[5];
+        order1.swap(new_order1);
+        order2.swap(new_order2);
+        checked_compute  = ~uint64_t(0);  // check again at the next compute
+    }
 
-            Timer t2("pairlist_cache_rebuild");
-            // Store the new cache positions
-            cache_cutoff = cutoff + cache_buffer;
+    void record_check() {
+        n_check++;
+        window_check++;
+        window_cost += double(n_edge)*consumer_cutoff.size();
+    }
 
-            for(int i=0; i<n_elem1; i+=4) {
-                Float4(aligned_pos1+pos1_stride*(i+0)).store(cache_pos1+4*(i+0));
-                Float4(aligned_pos1+pos1_stride*(i+1)).store(cache_pos1+4*(i+1));
-                Float4(aligned_pos1+pos1_stride*(i+2)).store(cache_pos1+4*(i+2));
-                Float4(aligned_pos1+pos1_stride*(i+3)).store(cache_pos1+4*(i+3));
-                Int4(id1+i).store(cache_id1+i);
+    void tune_buffer() {
+        // Hill climb on the mean cost per check, reversing direction whenever the last
+        // change made it worse
+        double cost = window_cost/window_check;
+        if(adaptive_buffer) {
+            if(last_window_cost>=0. && cost>last_window_cost) tune_direction = -tune_direction;
+            buffer_scale = std::min(4.f, std::max(0.25f, buffer_scale*(1.f+0.1f*tune_direction)));
+        }
+        last_window_cost = cost;
+        window_cost = 0.;
+        window_check = 0;
+        window_rebuild = 0;
+    }
+
+    static void store_positions(int n_elem, const float* aligned_pos, int pos_stride, const int* id_,
+                                float* cache_pos, int32_t* cache_id) {
+        for(int i=0; i<n_elem; i+=4) {
+            Float4(aligned_pos+pos_stride*(i+0)).store(cache_pos+4*(i+0));
+            Float4(aligned_pos+pos_stride*(i+1)).store(cache_pos+4*(i+1));
+            Float4(aligned_pos+pos_stride*(i+2)).store(cache_pos+4*(i+2));
+            Float4(aligned_pos+pos_stride*(i+3)).store(cache_pos+4*(i+3));
+            Int4(id_+i).store(cache_id+i);
+        }
+    }
+
+    static uint32_t spread_bits(uint32_t x) {
+        // insert two zero bits between each of the low 10 bits of x
+        x = (x | (x<<16)) & 0x030000FFu;
+        x = (x | (x<< 8)) & 0x0300F00Fu;
+        x = (x | (x<< 4)) & 0x030C30C3u;
+        x = (x | (x<< 2)) & 0x09249249u;
+        return x;
+    }
+
+    static void store_reordered(std::vector<int32_t>& order, int n_elem, const float* aligned_pos,
+                                int pos_stride, const int* id_, float* cache_pos, int32_t* cache_id) {
+        // Sort the slots by the Morton code of their positions on a 1024^3 grid over the
+        // bounding box.  Ties keep their current order, so the result is deterministic.
+        float lo[3] = { 1e30f, 1e30f, 1e30f};
+        float hi[3] = {-1e30f,-1e30f,-1e30f};
+        for(int i=0; i<n_elem; ++i) {
+            for(int d=0; d<3; ++d) {
+                lo[d] = std::min(lo[d], aligned_pos[pos_stride*i+d]);
+                hi[d] = std::max(hi[d], aligned_pos[pos_stride*i+d]);
             }
-            if(!symmetric) {
-                for(int i=0; i<n_elem2; i+=4) {
-                    Float4(aligned_pos2+pos2_stride*(i+0)).store(cache_pos2+4*(i+0));
-                    Float4(aligned_pos2+pos2_stride*(i+1)).store(cache_pos2+4*(i+1));
-                    Float4(aligned_pos2+pos2_stride*(i+2)).store(cache_pos2+4*(i+2));
-                    Float4(aligned_pos2+pos2_stride*(i+3)).store(cache_pos2+4*(i+3));
-                    Int4(id2+i).store(cache_id2+i);
-                }
+        }
+
+        std::vector<std::pair<uint32_t,int32_t>> key(n_elem);
+        for(int i=0; i<n_elem; ++i) {
+            uint32_t code = 0u;
+            for(int d=0; d<3; ++d) {
+                float scale = hi[d]>lo[d] ? 1023.f/(hi[d]-lo[d]) : 0.f;
+                // written so that non-finite coordinates map into the grid
+                float q = std::min(1023.f, std::max(0.f, (aligned_pos[pos_stride*i+d]-lo[d])*scale));
+                code |= spread_bits(uint32_t(q)) << (2-d);
             }
+            key[i] = std::make_pair(code, int32_t(i));
+        }
+        std::sort(key.begin(), key.end());
+
+        std::vector<int32_t> new_order(n_elem);
+        for(int slot=0; slot<n_elem; ++slot) {
+            int old_slot = key[slot].second;
+            new_order[slot] = order[old_slot];
+            Float4(aligned_pos+pos_stride*old_slot).store(cache_pos+4*slot);
+            cache_id[slot] = id_[old_slot];
+        }
+        for(int slot=n_elem; slot<round_up(n_elem,4); ++slot) {  // padding stays in place
+            Float4(aligned_pos+pos_stride*slot).store(cache_pos+4*slot);
+            cache_id[slot] = id_[slot];
+        }
+        order.swap(new_order);
+    }
 
-            // Find all cache pairs
-            alignas(16) int32_t offset_v[4] = {0,1,2,3};
-            Int4 offset(offset_v);
-            auto cutoff2 = Float4(sqr(cache_cutoff));
+    // Cell list for cache rebuilds on large systems.  The second set of elements is binned
+    // into cells at least as wide as the cache cutoff, so that all partners of a point lie
+    // in the 27 cells around it.  Elements are stored in increasing index order within
+    // each cell.
+    constexpr static const int cell_list_min_elem = 2048;
+    int   n_cell[3];
+    float cell_lo[3];
+    float cell_inv_width;
+    std::vector<int32_t> cell_start, cell_elem;
+    std::vector<int32_t> cell_cursor;  // scratch space
+
+    bool build_cell_list(int n_elem_grid, const float* grid_pos) {
+        float lo[3] = { 1e30f, 1e30f, 1e30f};
+        float hi[3] = {-1e30f,-1e30f,-1e30f};
+        for(int i=0; i<n_elem_grid; ++i) {
+            for(int d=0; d<3; ++d) {
+                // std::min and std::max would skip a NaN, which could not be binned, and
+                // std::isfinite is always true under -ffast-math, so the exponent is checked
+                uint32_t bits;
+                std::memcpy(&bits, grid_pos+i*4+d, sizeof(bits));
+                if((bits & 0x7f800000u) == 0x7f800000u) return false;  // non-finite coordinate
+
+                lo[d] = std::min(lo[d], grid_pos[i*4+d]);
+                hi[d] = std::max(hi[d], grid_pos[i*4+d]);
+            }
+        }
+        for(int d=0; d<3; ++d)
+            if(!(hi[d]-lo[d] < 1e6f)) return false;  // absurd coordinates
+
+        // The small margin on the width protects against rounding when binning.  Widen the
+        // cells further if the bounding box is so sparse that the cells would outnumber the
+        // elements.
+        float width = 1.001f*cache_cutoff;
+        long  n_total;
+        do {
+            n_total = 1;
+            for(int d=0; d<3; ++d) {
+                n_cell[d] = int((hi[d]-lo[d])/width)+1;
+                n_total *= n_cell[d];
+            }
+            if(n_total > 2l*n_elem_grid) width *= 1.25f;
+        } while(n_total > 2l*n_elem_grid);
+
+        for(int d=0; d<3; ++d) cell_lo[d] = lo[d];
+        cell_inv_width = 1.f/width;
+
+        // counting sort of the elements by cell, stable so that indices increase within a cell
+        cell_start.assign(n_total+1, 0);
+        cell_elem.resize(n_elem_grid);
+        std::vector<int32_t> cell_of_elem(n_elem_grid);
+        for(int i=0; i<n_elem_grid; ++i) {
+            int c[3];
+            for(int d=0; d<3; ++d)
+                c[d] = std::min(n_cell[d]-1, int((grid_pos[i*4+d]-cell_lo[d])*cell_inv_width));
+            cell_of_elem[i] = (c[0]*n_cell[1] + c[1])*n_cell[2] + c[2];
+            cell_start[cell_of_elem[i]+1]++;
+        }
+        for(long c=0; c<n_total; ++c) cell_start[c+1] += cell_start[c];
+        cell_cursor.assign(cell_start.begin(), cell_start.end()-1);
+        for(int i=0; i<n_elem_grid; ++i) cell_elem[cell_cursor[cell_of_elem[i]]++] = i;
+        return true;
+    }
 
-            int ne = 0;
-            for(int32_t i1=0; i1<n_elem1; i1+=4) {
-                Float4 v0(cache_pos1+(i1+0)*4), // aligned_pos1 size was rounded up
-                       v1(cache_pos1+(i1+1)*4), 
-                       v2(cache_pos1+(i1+2)*4), 
-                       v3(cache_pos1+(i1+3)*4);
-                transpose4(v0,v1,v2,v3); // v3 will be unused at the end
-                auto  x1 = make_vec3(v0,v1,v2);
-
-                auto  my_id1 = Int4(cache_id1+i1);
-                auto  i1_vec = Int4(i1) + offset;
-
-                for(int32_t i2=symmetric?i1+1:0; i2<n_elem2; ++i2) {
-                    const float* p = (symmetric?cache_pos1:cache_pos2)+i2*4;
-                    auto  x2 = make_vec3(Float4(p[0]), Float4(p[1]),  Float4(p[2]));
-                    auto near = mag2(x1-x2)<cutoff2;
-                    if(near.none()) continue;
-
-                    auto my_id2 = Int4((symmetric?cache_id1:cache_id2)[i2]);
-                    auto i2_vec = Int4(i2);
-
-                    Int4 is_hit = acceptable_id_pair(my_id1,my_id2) & (symmetric 
-                        ? (i1_vec<i2_vec) & near.cast_int()
-                        :                   near.cast_int());
-                    int is_hit_bits = is_hit.movemask();
-
-                    // i2_vec and my_id2 is constant, so we don't have to left pack
-                    // left_pack requires a read, so do before the writes
-
-                    // write out pairs
-                    int n_hit = popcnt_nibble(is_hit_bits);
-                    i1_vec.left_pack(is_hit_bits).store(cache_edge_indices1+ne, Alignment::unaligned);
-                    my_id1.left_pack(is_hit_bits).store(cache_edge_id1     +ne, Alignment::unaligned);
-                    i2_vec                       .store(cache_edge_indices2+ne, Alignment::unaligned);
-                    my_id2                       .store(cache_edge_id2     +ne, Alignment::unaligned);
-                    ne += n_hit;
-                }
+    template <typename F>
+    void for_each_cell_candidate(int32_t i1, int32_t i2_start, F&& f) {
+        // Visit the elements in the block of cells covering the neighborhoods of the 4 elements
+        // starting at i1.  These elements are usually close together, so a single block is
+        // barely larger than the 27 cells around each one.  Padding elements are far from the
+        // grid and contribute nothing.
+        int c_lo[3] = {n_cell[0], n_cell[1], n_cell[2]};
+        int c_hi[3] = {-1, -1, -1};
+        for(int j=0; j<4; ++j) {
+            const float* p = pos1+(i1+j)*4;
+            float c[3];
+            bool in_range = true;
+            for(int d=0; d<3; ++d) {
+                c[d] = floorf((p[d]-cell_lo[d])*cell_inv_width);
+                in_range &= -1.f<=c[d] && c[d]<=float(n_cell[d]);
             }
-            cache_n_edge = ne;
-            for(int i=ne; i<round_up(ne,4); ++i) {
-                // we need something sane to fill out the last group of 4 so just duplicate the interactions
-                // with sensitivity 0.
-                cache_edge_indices1[i] = cache_edge_indices1[i-i%4];
-                cache_edge_indices2[i] = cache_edge_indices2[i-i%4]; // just put something sane here
+            if(!in_range) continue;
+            for(int d=0; d<3; ++d) {
+                c_lo[d] = std::min(c_lo[d], std::max(0,           int(c[d])-1));
+                c_hi[d] = std::max(c_hi[d], std::min(n_cell[d]-1, int(c[d])+1));
             }
-            cache_valid = true;
-            // printf("found %i cache edges\n", cache_n_edge);
         }
 
+        for(int cx=c_lo[0]; cx<=c_hi[0]; ++cx) {
+            for(int cy=c_lo[1]; cy<=c_hi[1]; ++cy) {
+                int c = (cx*n_cell[1] + cy)*n_cell[2];
+                for(int k=cell_start[c+c_lo[2]]; k<cell_start[c+c_hi[2]+1]; ++k)
+                    if(cell_elem[k]>=i2_start) f(cell_elem[k]);
+            }
+        }
+    }
+};
+
+
+template <bool symmetric>
+struct PairlistComputation {
+    constexpr static const int refine_width = PairlistCache<symmetric>::refine_width;
+    public:
+        const int n_elem1, n_elem2;
+        int max_n_edge;  // capacity of the edge arrays, which grow as needed
+        aligned_ptr<int32_t>  edge_indices1, edge_indices2;
+        aligned_ptr<int32_t>  edge_id1,      edge_id2;
+        int n_edge;
+
+    protected:
+        float cutoff;
+        float cache_buffer;
+        std::shared_ptr<PairlistCache<symmetric>> cache;
+        int consumer;  // index of this computation among the users of the cache
+        bool adaptive_buffer;
+        int  reorder_interval;
+        int  order_version;  // version of the cache element order that the inputs are packed in
+
+        long   n_find;
+        double sum_cache_edge, sum_edge;
+
     public:
-        void change_cache_buffer(float new_buffer) {cache_buffer=new_buffer;}
-        PairlistComputation(int n_elem1_, int n_elem2_, int max_n_edge):
-            n_elem1(n_elem1_), n_elem2(n_elem2_),
+        PairlistComputation(int n_elem1_, int n_elem2_, int max_n_edge_):
+            n_elem1(n_elem1_), n_elem2(n_elem2_), max_n_edge(max_n_edge_),
 
-            edge_indices1(new_aligned<int32_t>(max_n_edge, 16)),
-            edge_indices2(new_aligned<int32_t>(max_n_edge, 16)),
-            edge_id1     (new_aligned<int32_t>(max_n_edge, 16)),
-            edge_id2     (new_aligned<int32_t>(max_n_edge, 16)),
+            edge_indices1(new_aligned<int32_t>(max_n_edge+refine_width, 16)),
+            edge_indices2(new_aligned<int32_t>(max_n_edge+refine_width, 16)),
+            edge_id1     (new_aligned<int32_t>(max_n_edge+refine_width, 16)),
+            edge_id2     (new_aligned<int32_t>(max_n_edge+refine_width, 16)),
 
             n_edge(0),
 
-            cache_valid(false),
+            cutoff(0.f),
             cache_buffer(1.f), // reasonable value that the user can modify
-            cache_pos1(new_aligned<float>(round_up(n_elem1,16)*4,             4)),
-            cache_pos2(new_aligned<float>(round_up(symmetric?16:n_elem2,16)*4,4)),
-            cache_id1(new_aligned<int32_t>(round_up(n_elem1,16),4)),
-            cache_id2(new_aligned<int32_t>(round_up(n_elem2,16),4)),
-            cache_edge_indices1(new_aligned<int32_t>(max_n_edge, 4)),
-            cache_edge_indices2(new_aligned<int32_t>(max_n_edge, 4)),
-            cache_edge_id1     (new_aligned<int32_t>(max_n_edge, 4)),
-            cache_edge_id2     (new_aligned<int32_t>(max_n_edge, 4)),
-            cache_n_edge(0)
-        {
-            for(int i=0; i<n_elem1; i+=4)
-                for(int j=0; j<4; ++j) Float4(1e10f).store(cache_pos1+4*(i+j));
-            if(!symmetric)
-                for(int i=0; i<n_elem2; i+=4)
-                    for(int j=0; j<4; ++j) Float4(1e10f).store(cache_pos2+4*(i+j));
+            cache(std::make_shared<PairlistCache<symmetric>>(n_elem1,n_elem2,max_n_edge)),
+            consumer(cache->add_consumer(cutoff, cache_buffer, max_n_edge)),
+            adaptive_buffer(true),
+            reorder_interval(0),
+            order_version(0),
+            n_find(0), sum_cache_edge(0.), sum_edge(0.)
+        {}
+
+        void change_cache_buffer(float new_buffer) {change_cutoff(cutoff, new_buffer);}
+
+        //! \brief Register the cutoff and buffer that will be used for find_edges
+        void change_cutoff(float new_cutoff, float new_buffer) {
+            std::lock_guard<std::mutex> lock(cache->mutex);
+            cutoff       = new_cutoff;
+            cache_buffer = new_buffer;
+            cache->consumer_cutoff[consumer] = cutoff;
+            cache->consumer_buffer[consumer] = cache_buffer;
+        }
+
+        //! \brief Enable or disable tuning of the cache buffer (enabled by default)
+        //!
+        //! A shared cache is tuned only if all of its users allow it.
+        void set_adaptive_buffer(bool adaptive) {
+            adaptive_buffer = adaptive;
+            cache->adaptive_buffer = adaptive;
+        }
+
+        //! \brief Renumber the elements in Morton order every reorder_interval cache rebuilds
+        //!
+        //! Disabled (0) by default.  When enabled, the positions and ids passed to find_edges
+        //! must be packed in slot order (see order1 and order2), and the edge indices refer to
+        //! slots.  find_edges calls back when the order changes so that the inputs can be repacked.
+        //! A shared cache is reordered if any of its users asks for it.
+        void set_reorder_interval(int interval) {
+            reorder_interval = interval;
+            cache->reorder_interval = std::max(cache->reorder_interval, interval);
+        }
+
+        //! \brief Element in each slot of the first set of elements
+        const std::vector<int32_t>& order1() const {return cache->order1;}
+        //! \brief Element in each slot of the second set of elements
+        const std::vector<int32_t>& order2() const {return symmetric ? cache->order1 : cache->order2;}
+
+        //! \brief Pairlist statistics since construction
+        //!
+        //! Returns the number of cache rebuilds, the mean number of cache checks between
+        //! rebuilds, the ratio of cache edges to accepted edges, the mean number of cache edges
+        //! refined per find_edges, the mean number of candidate pairs examined per rebuild, and
+        //! the current buffer beyond the largest cutoff.
+        std::vector<float> get_stats() const {
+            auto& c = *cache;
+            return {float(c.n_rebuild),
+                    float(double(c.n_check)/std::max(1l,c.n_rebuild)),
+                    float(sum_cache_edge/std::max(1.,sum_edge)),
+                    float(sum_cache_edge/std::max(1l,n_find)),
+                    float(c.rebuild_work/std::max(1l,c.n_rebuild)),
+                    c.valid ? c.cache_cutoff-*std::max_element(c.consumer_cutoff.begin(), c.consumer_cutoff.end()) : 0.f};
+        }
+
+        //! \brief Use the cache registered under key, creating it if needed
+        //!
+        //! All PairlistComputation's sharing a key must read the same positions and ids, and
+        //! filter must be the acceptable_id_pair that this user passes to find_edges.  The
+        //! cache is built at the largest cutoff plus buffer of its users from the pairs that
+        //! any of them accepts, and each user refines it at its own cutoff and filter.
+        void share_cache(SharedResources& shared, const std::string& key, acceptable_id_pair_t filter) {
+            cache = shared.get<PairlistCache<symmetric>>(key, [&]() {
+                    return std::make_shared<PairlistCache<symmetric>>(n_elem1,n_elem2,max_n_edge);});
+            if(cache->n_elem1 != n_elem1 || cache->n_elem2 != n_elem2)
+                throw std::string("inconsistent sizes for shared pairlist");
+            cache->shared = &shared;
+            if(!adaptive_buffer) cache->adaptive_buffer = false;
+            cache->reorder_interval = std::max(cache->reorder_interval, reorder_interval);
+            consumer = cache->add_consumer(cutoff, cache_buffer, max_n_edge, filter);
+            order_version = -1;  // the new cache may have a different order
+        }
+
+        //! \brief Cache state for checkpoints, which only the first user of a shared cache saves
+        std::vector<char> get_checkpoint_state() const {
+            return consumer==0 ? cache->get_state() : std::vector<char>();
+        }
+
+        //! \brief Restore the state from get_checkpoint_state
+        void set_checkpoint_state(const std::vector<char>& state) {
+            std::lock_guard<std::mutex> lock(cache->mutex);
+            if(state.size()) cache->set_state(state);
+            order_version = -1;  // the inputs must be packed in the restored order
         }
 
+        //! \brief Number of users of the cache (1 if the cache is not shared)
+        int n_cache_consumer() const {return cache->consumer_cutoff.size();}
+
         template<acceptable_id_pair_t acceptable_id_pair>
-        void find_edges(float cutoff,
+        void find_edges(float cutoff_,
                         const float* aligned_pos1, const int pos1_stride, int* id1, 
                         const float* aligned_pos2, const int pos2_stride, int* id2) {
+            find_edges<acceptable_id_pair>(cutoff_,
+                    aligned_pos1, pos1_stride, id1,
+                    aligned_pos2, pos2_stride, id2, [&]() {
+                        if(cache->order_version)
+                            throw std::string("pairlist reordered without a repack function");});
+        }
+
+        //! \brief Find edges, calling repack() to pack the inputs again if the slot order changes
+        //!
+        //! repack must refill the arrays passed to find_edges in the order of order1 and order2.
+        template<acceptable_id_pair_t acceptable_id_pair, typename Repack>
+        void find_edges(float cutoff_,
+                        const float* aligned_pos1, const int pos1_stride, int* id1, 
+                        const float* aligned_pos2, const int pos2_stride, int* id2,
+                        Repack&& repack) {
             // Timer timer_total("find_edges");
-            ensure_cache_valid<acceptable_id_pair>(cutoff,
+            ensure_cache_valid<acceptable_id_pair>(cutoff_,
                     aligned_pos1, pos1_stride, id1,
-                    aligned_pos2, pos2_stride, id2);
+                    aligned_pos2, pos2_stride, id2, repack);
             // Timer timer("pairlist_refine");
+            refine_edges<refine_width,acceptable_id_pair>(cutoff,
+                    aligned_pos1, pos1_stride,
+                    symmetric?aligned_pos1:aligned_pos2, pos2_stride);
+            record_find();
+        }
+
+        //! \brief First half of find_edges, which checks the cache and rebuilds it if needed
+        //!
+        //! Afterward, the edge arrays have room for every cache edge (see n_cache_edge), and
+        //! either refine_and_evaluate_edges or the refinement in find_edges may follow.
+        template<acceptable_id_pair_t acceptable_id_pair, typename Repack>
+        void ensure_cache_valid(float cutoff_,
+                        const float* aligned_pos1, const int pos1_stride, int* id1, 
+                        const float* aligned_pos2, const int pos2_stride, int* id2,
+                        Repack&& repack) {
+            {
+                // Users of a shared cache may run concurrently, but after the first check of a
+                // compute, the cache is only read.
+                std::lock_guard<std::mutex> lock(cache->mutex);
+                cutoff = cutoff_;
+                // The cache may have been reordered since this user last packed its inputs
+                if(order_version != cache->order_version) {order_version = cache->order_version; repack();}
+                cache->template ensure_valid<acceptable_id_pair>(consumer, cutoff,
+                        aligned_pos1, pos1_stride, id1,
+                        aligned_pos2, pos2_stride, id2);
+                if(order_version != cache->order_version) {order_version = cache->order_version; repack();}
+            }
+            // Every cache edge may be accepted
+            if(cache->n_edge > max_n_edge) {
+                max_n_edge = round_up(std::max(cache->n_edge, max_n_edge + max_n_edge/2), 16);
+                edge_indices1 = new_aligned<int32_t>(max_n_edge+refine_width, 16);
+                edge_indices2 = new_aligned<int32_t>(max_n_edge+refine_width, 16);
+                edge_id1      = new_aligned<int32_t>(max_n_edge+refine_width, 16);
+                edge_id2      = new_aligned<int32_t>(max_n_edge+refine_width, 16);
+            }
+        }
+
+        //! \brief Number of edges in the cache, which bounds the number of edges found
+        int n_cache_edge() const {return cache->n_edge;}
+
+        //! \brief Second half of find_edges that also evaluates the edges
+        //!
+        //! Instead of storing the accepted edges and leaving the caller to gather their positions
+        //! again, the transposed positions of accepted edges are kept and passed, refine_width
+        //! edges at a time, to evaluate(ne, i1, i2, x1, x2).  Here ne is the index of the first of
+        //! the edges, which have already been stored, and x1 and x2 hold the first n_dim1 and
+        //! n_dim2 components of their input rows.  The edges are found in the same order as by
+        //! find_edges, and the last group is padded with copies of its first edge.
+        template<acceptable_id_pair_t acceptable_id_pair, int n_dim1, int n_dim2, typename F>
+        void refine_and_evaluate_edges(const float* aligned_pos1, const int pos1_stride,
+                                       const float* aligned_pos2, const int pos2_stride,
+                                       F&& evaluate) {
+            constexpr int W = refine_width;
+            typedef FloatLanes<W> FloatW;
+            typedef IntLanes<W>   IntW;
+
+            const int cache_n_edge = cache->n_edge;
+            const int32_t* cache_edge_indices1 = cache->edge_indices1.get();
+            const int32_t* cache_edge_indices2 = cache->edge_indices2.get();
+            const int32_t* cache_edge_id1      = cache->edge_id1.get();
+            const int32_t* cache_edge_id2      = cache->edge_id2.get();
+            const bool mixed_filter = cache->mixed_filter;
+            if(symmetric) aligned_pos2 = aligned_pos1;
+
+            // Accepted edges wait here until there are W of them
+            alignas(32) float   stage1[n_dim1][2*W];
+            alignas(32) float   stage2[n_dim2][2*W];
+            alignas(32) int32_t stage_i1[2*W], stage_i2[2*W], stage_id1[2*W], stage_id2[2*W];
+            int n_stage = 0;
+            int ne = 0;
+
+            auto flush = [&]() {
+                Vec<n_dim1,FloatW> x1;
+                Vec<n_dim2,FloatW> x2;
+                for(int d=0; d<n_dim1; ++d) x1[d] = FloatW(stage1[d]);
+                for(int d=0; d<n_dim2; ++d) x2[d] = FloatW(stage2[d]);
+                auto i1 = IntW(stage_i1);
+                auto i2 = IntW(stage_i2);
+                i1              .store(edge_indices1+ne, Alignment::unaligned);
+                i2              .store(edge_indices2+ne, Alignment::unaligned);
+                IntW(stage_id1) .store(edge_id1     +ne, Alignment::unaligned);
+                IntW(stage_id2) .store(edge_id2     +ne, Alignment::unaligned);
+                evaluate(ne, i1, i2, x1, x2);
+                ne += W;
+
+                for(int d=0; d<n_dim1; ++d) FloatW(stage1[d]+W).store(stage1[d]);
+                for(int d=0; d<n_dim2; ++d) FloatW(stage2[d]+W).store(stage2[d]);
+                IntW(stage_i1 +W).store(stage_i1);
+                IntW(stage_i2 +W).store(stage_i2);
+                IntW(stage_id1+W).store(stage_id1);
+                IntW(stage_id2+W).store(stage_id2);
+                n_stage -= W;
+            };
+
+            auto cutoff2 = FloatW(sqr(cutoff));
+            for(int i_edge=0; i_edge<cache_n_edge; i_edge+=W) {
+                auto x1 = load_transposed_vec<n_dim1,FloatW>(aligned_pos1, pos1_stride, cache_edge_indices1+i_edge);
+                auto x2 = load_transposed_vec<n_dim2,FloatW>(aligned_pos2, pos2_stride, cache_edge_indices2+i_edge);
+                auto dist2 = sqr(x1[0]-x2[0])+sqr(x1[1]-x2[1])+sqr(x1[2]-x2[2]);
+
+                // lanes past the end of the cache edges are padding
+                int n_lane = std::min(W, cache_n_edge-i_edge);
+                int acceptable = (dist2<cutoff2).movemask() & ((1<<n_lane)-1);
+                if(acceptable && mixed_filter) {
+                    int accepted_ids = 0;
+                    for(int j=0; j<W; j+=4)
+                        accepted_ids |= acceptable_id_pair(Int4(cache_edge_id1+i_edge+j, Alignment::unaligned),
+                                                           Int4(cache_edge_id2+i_edge+j, Alignment::unaligned)).movemask() << j;
+                    acceptable &= accepted_ids;
+                }
+                if(!acceptable) continue;
+
+                for(int d=0; d<n_dim1; ++d) x1[d].left_pack(acceptable).store(stage1[d]+n_stage, Alignment::unaligned);
+                for(int d=0; d<n_dim2; ++d) x2[d].left_pack(acceptable).store(stage2[d]+n_stage, Alignment::unaligned);
+                IntW(cache_edge_indices1+i_edge, Alignment::unaligned).left_pack(acceptable)
+                    .store(stage_i1+n_stage, Alignment::unaligned);
+                IntW(cache_edge_indices2+i_edge, Alignment::unaligned).left_pack(acceptable)
+                    .store(stage_i2+n_stage, Alignment::unaligned);
+                IntW(cache_edge_id1+i_edge, Alignment::unaligned).left_pack(acceptable)
+                    .store(stage_id1+n_stage, Alignment::unaligned);
+                IntW(cache_edge_id2+i_edge, Alignment::unaligned).left_pack(acceptable)
+                    .store(stage_id2+n_stage, Alignment::unaligned);
+                n_stage += popcnt_nibble(acceptable);
+
+                if(n_stage>=W) flush();
+            }
+
+            n_edge = ne + n_stage;
+            if(n_stage) {
+                for(int j=n_stage; j<W; ++j) {
+                    for(int d=0; d<n_dim1; ++d) stage1[d][j] = stage1[d][0];
+                    for(int d=0; d<n_dim2; ++d) stage2[d][j] = stage2[d][0];
+                    stage_i1 [j] = stage_i1 [0];
+                    stage_i2 [j] = stage_i2 [0];
+                    stage_id1[j] = stage_id1[0];
+                    stage_id2[j] = stage_id2[0];
+                }
+                flush();
+            }
+            record_find();
+        }
+
+    protected:
+        void record_find() {
+            n_find++;
+            sum_cache_edge += cache->n_edge;
+            sum_edge       += n_edge;
+        }
+
+        template<int W, acceptable_id_pair_t acceptable_id_pair>
+        void refine_edges(float cutoff,
+                          const float* aligned_pos1, const int pos1_stride,
+                          const float* aligned_pos2, const int pos2_stride) {
+            typedef typename SimdLanes<W>::Float FloatW;
+            typedef typename SimdLanes<W>::Int   IntW;
+
+            const int cache_n_edge = cache->n_edge;
+            const int32_t* cache_edge_indices1 = cache->edge_indices1.get();
+            const int32_t* cache_edge_indices2 = cache->edge_indices2.get();
+            const int32_t* cache_edge_id1      = cache->edge_id1.get();
+            const int32_t* cache_edge_id2      = cache->edge_id2.get();
+            const bool mixed_filter = cache->mixed_filter;
 
             int ne=0;
-            alignas(16) int32_t offset_v[4] = {0,1,2,3};
-            Int4 offset(offset_v);
-            Float4 cutoff2(sqr(cutoff));
+            FloatW cutoff2(sqr(cutoff));
 
             int acceptable = 0;
-            for(int i_edge=0; i_edge<cache_n_edge; i_edge+=4) {
-                auto i1 = Int4(cache_edge_indices1+i_edge);
-                auto i2 = Int4(cache_edge_indices2+i_edge);
-                auto eid1 = Int4(cache_edge_id1+i_edge);
-                auto eid2 = Int4(cache_edge_id2+i_edge);
-
-                Float4 x_diff[4];
-                #pragma unroll
-                for(int j=0; j<4; ++j)
-                    x_diff[j] = 
-                        Float4(aligned_pos1                         +pos1_stride*cache_edge_indices1[i_edge+j]) -
-                        Float4((symmetric?aligned_pos1:aligned_pos2)+pos2_stride*cache_edge_indices2[i_edge+j]);
-                transpose4(x_diff[0],x_diff[1],x_diff[2],x_diff[3]);
-                auto dist2 = sqr(x_diff[0])+sqr(x_diff[1])+sqr(x_diff[2]);
+            for(int i_edge=0; i_edge<cache_n_edge; i_edge+=W) {
+                auto i1 = IntW(cache_edge_indices1+i_edge, Alignment::unaligned);
+                auto i2 = IntW(cache_edge_indices2+i_edge, Alignment::unaligned);
+                auto eid1 = IntW(cache_edge_id1+i_edge, Alignment::unaligned);
+                auto eid2 = IntW(cache_edge_id2+i_edge, Alignment::unaligned);
+
+                FloatW x1[4], x2[4];
+                load_transposed4(aligned_pos1, pos1_stride, cache_edge_indices1+i_edge, x1[0],x1[1],x1[2],x1[3]);
+                load_transposed4(aligned_pos2, pos2_stride, cache_edge_indices2+i_edge, x2[0],x2[1],x2[2],x2[3]);
+                auto dist2 = sqr(x1[0]-x2[0])+sqr(x1[1]-x2[1])+sqr(x1[2]-x2[2]);
                     
                 acceptable = (dist2<cutoff2).movemask();
+                if(mixed_filter) {
+                    // the cache also holds edges that only other users accept
+                    int accepted_ids = 0;
+                    for(int j=0; j<W; j+=4)
+                        accepted_ids |= acceptable_id_pair(Int4(cache_edge_id1+i_edge+j, Alignment::unaligned),
+                                                           Int4(cache_edge_id2+i_edge+j, Alignment::unaligned)).movemask() << j;
+                    acceptable &= accepted_ids;
+                }
 
                 i1  .left_pack_inplace(acceptable);
                 i2  .left_pack_inplace(acceptable);
@@ -245,19 +925,98 @@ struct PairlistComputation {
                 // FIXME it would nice to store the transposed positions for later
             }
             // It is possible that some edges were inappropriately declared acceptable even though
-            // they were outside cache_n_edge due to the padding for SSE of 4.  Let's fix that.
-            int n_extra = round_up(cache_n_edge,4)-cache_n_edge;
-            int invalid_mask = ((1<<4)-1) & ~((1<<(4-n_extra))-1);
-            n_edge = ne-popcnt_nibble(acceptable&invalid_mask);;
-
-            for(int i=n_edge; i<round_up(n_edge,4); ++i) {
-                edge_indices1[i] = edge_indices1[i-i%4];
-                edge_indices2[i] = edge_indices2[i-i%4]; // just put something sane here
+            // they were outside cache_n_edge due to the padding for the SIMD width.  Let's fix that.
+            int n_extra = round_up(cache_n_edge,W)-cache_n_edge;
+            int invalid_mask = ((1<<W)-1) & ~((1<<(W-n_extra))-1);
+            n_edge = ne-popcnt_nibble(acceptable&invalid_mask);
+
+            for(int i=n_edge; i<round_up(n_edge,W); ++i) {
+                edge_indices1[i] = edge_indices1[i-i%W];
+                edge_indices2[i] = edge_indices2[i-i%W]; // just put something sane here
             }
         }
 };
 
 
+//! \brief Optional evaluation of an interaction from tables
+//!
+//! An IType may define n_table, tabulate(table, param) and compute_edge_tabulated to be
+//! evaluated from per-type-pair tables of n_table floats rather than from its parameters
+//! (see the tabulate attribute of InteractionGraph).  n_table is 0 for other ITypes.
+template<typename IType, typename Enable=void>
+struct Tabulation {
+    constexpr static const int n_table = 0;
+    static void tabulate(float* table, const float* p) {}
+
+    template<int n_dim1, int n_dim2>
+    static Float4 compute_edge(Vec<n_dim1,Float4> &d1, Vec<n_dim2,Float4> &d2, const float* t[4],
+            const Vec<n_dim1,Float4> &x1, const Vec<n_dim2,Float4> &x2) {return Float4();}
+};
+
+template<typename IType>
+struct Tabulation<IType, typename std::enable_if<(IType::n_table>0)>::type> {
+    constexpr static const int n_table = IType::n_table;
+    static void tabulate(float* table, const float* p) {IType::tabulate(table,p);}
+
+    template<int n_dim1, int n_dim2>
+    static Float4 compute_edge(Vec<n_dim1,Float4> &d1, Vec<n_dim2,Float4> &d2, const float* t[4],
+            const Vec<n_dim1,Float4> &x1, const Vec<n_dim2,Float4> &x2) {
+        return IType::compute_edge_tabulated(d1,d2, t, x1,x2);
+    }
+};
+
+
+//! \brief Evaluate W lanes of edges as W/4 groups of 4 lanes
+//!
+//! f(d1,d2,k,x1,x2) is the 4-wide evaluation of group k.  This is the evaluation for
+//! interactions that have no W-wide compute_edge (see EdgeLanes).
+template<int W, int n_dim1, int n_dim2, typename F>
+inline FloatLanes<W> evaluate_quads(Vec<n_dim1,FloatLanes<W>> &d1, Vec<n_dim2,FloatLanes<W>> &d2,
+        const Vec<n_dim1,FloatLanes<W>> &x1, const Vec<n_dim2,FloatLanes<W>> &x2, F&& f) {
+    typedef SimdLanes<W> L;
+    Float4 value[W/4], quad_d1[n_dim1][W/4], quad_d2[n_dim2][W/4];
+    for(int k=0; k<W/4; ++k) {
+        Vec<n_dim1,Float4> q1, qd1;
+        Vec<n_dim2,Float4> q2, qd2;
+        for(int d=0; d<n_dim1; ++d) q1[d] = L::quad(x1[d],k);
+        for(int d=0; d<n_dim2; ++d) q2[d] = L::quad(x2[d],k);
+        value[k] = f(qd1,qd2, k, q1,q2);
+        for(int d=0; d<n_dim1; ++d) quad_d1[d][k] = qd1[d];
+        for(int d=0; d<n_dim2; ++d) quad_d2[d][k] = qd2[d];
+    }
+    for(int d=0; d<n_dim1; ++d) d1[d] = L::join(quad_d1[d]);
+    for(int d=0; d<n_dim2; ++d) d2[d] = L::join(quad_d2[d]);
+    return L::join(value);
+}
+
+
+//! \brief Evaluation of an interaction W edges at a time
+//!
+//! An IType that sets wide_lanes provides compute_edge as a template on the lane width W, with
+//! p holding the parameters of each of the W edges.  Other ITypes, including the spline
+//! interactions, only provide the 4-wide compute_edge and are evaluated 4 lanes at a time.
+template<typename IType, typename Enable=void>
+struct EdgeLanes {
+    template<int W, int n_dim1, int n_dim2>
+    static FloatLanes<W> compute_edge(Vec<n_dim1,FloatLanes<W>> &d1, Vec<n_dim2,FloatLanes<W>> &d2,
+            const float** p, const Vec<n_dim1,FloatLanes<W>> &x1, const Vec<n_dim2,FloatLanes<W>> &x2) {
+        return evaluate_quads<W,n_dim1,n_dim2>(d1,d2, x1,x2,
+                [&](Vec<n_dim1,Float4> &qd1, Vec<n_dim2,Float4> &qd2, int k,
+                    const Vec<n_dim1,Float4> &q1, const Vec<n_dim2,Float4> &q2) {
+                    return IType::compute_edge(qd1,qd2, p+4*k, q1,q2);});
+    }
+};
+
+template<typename IType>
+struct EdgeLanes<IType, typename std::enable_if<IType::wide_lanes>::type> {
+    template<int W, int n_dim1, int n_dim2>
+    static FloatLanes<W> compute_edge(Vec<n_dim1,FloatLanes<W>> &d1, Vec<n_dim2,FloatLanes<W>> &d2,
+            const float** p, const Vec<n_dim1,FloatLanes<W>> &x1, const Vec<n_dim2,FloatLanes<W>> &x2) {
+        return IType::template compute_edge<W>(d1,d2, p, x1,x2);
+    }
+};
+
+
 template<typename IType>
 struct InteractionGraph{
     constexpr static const bool symmetric  = IType::symmetric;
@@ -267,6 +1026,13 @@ struct InteractionGraph{
     constexpr static const int  n_dim1     = IType::n_dim1, n_dim1a = round_up(n_dim1, align);
     constexpr static const int  n_dim2     = IType::n_dim2, n_dim2a = round_up(n_dim2, align);
     constexpr static const int  n_param    = IType::n_param;
+    constexpr static const int  n_table    = Tabulation<IType>::n_table;
+    // Edges are evaluated and their derivatives scattered edge_width at a time, with the lanes of
+    // ITypes that are not wide_lanes evaluated 4 at a time (see EdgeLanes).  Edge arrays are
+    // padded to a multiple of edge_width.
+    constexpr static const int  edge_width = max_simd_width;
+    static_assert(edge_width == PairlistComputation<symmetric>::refine_width,
+            "the fused refine and evaluate pass requires the refine and edge widths to match");
 
     CoordNode* pos_node1;
     CoordNode* pos_node2;
@@ -274,34 +1040,56 @@ struct InteractionGraph{
 
     int   n_elem1, n_elem2;
     int   n_type1, n_type2;
-    int   max_n_edge;
+    int   max_n_edge;  // capacity of the per-edge arrays, which grow as needed
     float cutoff;
 
     int n_edge;
 
-    std::unique_ptr<int32_t[]>  types1, types2; // pair type is type[0]*n_types2 + type[1]
-    std::unique_ptr<int32_t[]>  id1,    id2;    // used to avoid self-interaction
+    aligned_ptr<int32_t>  types1, types2; // pair type is type[0]*n_types2 + type[1]
+    aligned_ptr<int32_t>  id1,    id2;    // used to avoid self-interaction
+
+    // The packed arrays below are in the slot order of the pairlist, which is the element order
+    // unless the reorder_interval attribute is set (see PairlistComputation::set_reorder_interval).
+    // order1[slot] is the element in each slot.
+    bool reordered;  // true if any element is not in its own slot
+    std::vector<int32_t> order1, order2;
+    std::vector<index_t> slot_loc1, slot_loc2;
+    aligned_ptr<int32_t> slot_types1, slot_types2;
+    aligned_ptr<int32_t> slot_id1,    slot_id2;
 
     // buffers to copy position data to ensure contiguity
-    std::unique_ptr<float[]> pos1, pos2;
+    aligned_ptr<float> pos1, pos2;
 
     // per edge data
     PairlistComputation<IType::symmetric> pairlist;
-    int32_t* edge_indices1; // pointers to pairlist-maintained arrays
+    int32_t* edge_indices1; // element indices of the edges, in the pairlist arrays unless reordered
     int32_t* edge_indices2;  
+    int32_t* edge_slots1;   // slot indices of the edges, pointers to pairlist-maintained arrays
+    int32_t* edge_slots2;
     int32_t* edge_id1;
     int32_t* edge_id2;
-    std::unique_ptr<float[]>    edge_value;
-    std::unique_ptr<float[]>    edge_deriv;  // this may become a SIMD-type vector
-    std::unique_ptr<float[]>    edge_sensitivity; // must be filled by user of this class
+    aligned_ptr<int32_t>  reordered_indices1, reordered_indices2; // storage for edge_indices if reordered
+    aligned_ptr<float>    edge_value;
+    aligned_ptr<float>    edge_deriv;  // this may become a SIMD-type vector
+    aligned_ptr<float>    edge_sensitivity; // must be filled by user of this class
+
+    aligned_ptr<float> interaction_param;
 
-    std::unique_ptr<float[]> interaction_param;
+    // Tables of each type pair, rebuilt by set_param, which approximate the interaction for faster
+    // evaluation when the tabulate attribute is set.  Parameter derivatives are always exact.
+    bool use_table;
+    aligned_ptr<float> interaction_table;
 
-    std::unique_ptr<float[]> pos1_deriv, pos2_deriv;
+    aligned_ptr<float> pos1_deriv, pos2_deriv;
 
     std::vector<Vec<n_param>> edge_param_deriv;
     VecArrayStorage           interaction_param_deriv;
 
+    // map from changed elements of the input nodes to interaction elements (see update_changed_edges)
+    ChangeMap changed_map1, changed_map2;
+    std::vector<index_t> changed1, changed2;
+    std::vector<bool>    is_changed1, is_changed2;
+
     InteractionGraph(hid_t grp, CoordNode* pos_node1_, CoordNode* pos_node2_ = nullptr):
         pos_node1(pos_node1_), pos_node2(pos_node2_),
 
@@ -311,20 +1099,27 @@ struct InteractionGraph{
         n_type1(h5::get_dset_size(3,grp,"interaction_param")[0]),
         n_type2(h5::get_dset_size(3,grp,"interaction_param")[1]),
 
+        // The optional max_n_edge attribute is only the initial capacity.  Elements have a
+        // bounded number of neighbors, so the default is linear in the number of elements.
         max_n_edge(round_up(
-                    h5::read_attribute<int>(grp, ".", "max_n_edge", 
-                        n_elem1*n_elem2/(symmetric?2:1)),
+                    h5::read_attribute<int>(grp, ".", "max_n_edge", 4*(n_elem1+n_elem2)),
                         16)),
 
         types1(new_aligned<int32_t>(n_elem1,16)), types2(new_aligned<int32_t>(n_elem2,16)),
         id1   (new_aligned<int32_t>(n_elem1,16)), id2   (new_aligned<int32_t>(n_elem2,16)),
 
+        reordered(false),
+        slot_types1(new_aligned<int32_t>(n_elem1,16)), slot_types2(new_aligned<int32_t>(n_elem2,16)),
+        slot_id1   (new_aligned<int32_t>(n_elem1,16)), slot_id2   (new_aligned<int32_t>(n_elem2,16)),
+
         pos1(new_aligned<float>(round_up(n_elem1,16)*n_dim1a,             align_bytes)),
         pos2(new_aligned<float>(round_up(symmetric?16:n_elem2,16)*n_dim2a, align_bytes)),
 
         pairlist(n_elem1,n_elem2,max_n_edge),
         edge_indices1(pairlist.edge_indices1.get()),
         edge_indices2(pairlist.edge_indices2.get()),
+        edge_slots1  (pairlist.edge_indices1.get()),
+        edge_slots2  (pairlist.edge_indices2.get()),
         edge_id1      (pairlist.edge_id1.get()),
         edge_id2      (pairlist.edge_id2.get()),
 
@@ -333,6 +1128,7 @@ struct InteractionGraph{
         edge_sensitivity(new_aligned<float>  (max_n_edge,                 align_bytes)),
 
         interaction_param(new_aligned<float>(n_type1*n_type2*n_param, 4)),
+        use_table(h5::read_attribute<int>(grp, ".", "tabulate", 0)),
 
         pos1_deriv(new_aligned<float>(round_up(n_elem1,16)*n_dim1a,             maxint(4,simd_width))),
         pos2_deriv(new_aligned<float>(round_up(symmetric?16:n_elem2,16)*n_dim2a, maxint(4,simd_width)))
@@ -360,6 +1156,12 @@ struct InteractionGraph{
                 interaction_param[(nt1*n_type2+nt2)*n_param+np] = x;});
         update_cutoffs();
 
+        if(use_table) {
+            if(!n_table) throw std::string("tabulate is not supported for this interaction");
+            interaction_table = new_aligned<float>(n_type1*n_type2*n_table, 64);
+            update_table();
+        }
+
         check_size(grp, suffix1("index").c_str(), n_elem1); if(!s) check_size(grp, "index2", n_elem2);
         check_size(grp, suffix1("type").c_str(),  n_elem1); if(!s) check_size(grp, "type2",  n_elem2);
         check_size(grp, suffix1("id").c_str(),    n_elem1); if(!s) check_size(grp, "id2",    n_elem2);
@@ -378,6 +1180,106 @@ struct InteractionGraph{
             for(int nr: range(n_elem2)) types2[nr] = types1[nr];
             for(int nr: range(n_elem2)) id2   [nr] = id1   [nr];
         }
+
+        is_changed1.assign(n_elem1, false);
+        if(!s) is_changed2.assign(n_elem2, false);
+
+        for(int i=0; i<round_up(n_elem1,16); ++i) slot_id1[i] = 0;  // padding
+        for(int i=0; i<round_up(n_elem2,16); ++i) slot_id2[i] = 0;
+        apply_order();
+
+        pairlist.set_adaptive_buffer(read_attribute<int>(grp, ".", "adaptive_cache_buffer", 1));
+        // Renumbering the elements in Morton order at cache rebuilds improves the locality of the
+        // edge loops for large systems
+        pairlist.set_reorder_interval(read_attribute<int>(grp, ".", "reorder_interval", 0));
+        if(logging(LOG_DETAILED)) {
+            // named after the node, since each node has at most one InteractionGraph
+            char grp_name[1024] = "";
+            H5Iget_name(grp, grp_name, sizeof(grp_name));
+            const char* node_name = strrchr(grp_name, '/');
+            auto log_name = std::string("pairlist_") + (node_name ? node_name+1 : grp_name);
+            default_logger->add_logger<float>(log_name.c_str(), {6}, [&](float* buffer) {
+                    auto stats = pairlist.get_stats();
+                    std::copy(begin(stats), end(stats), buffer);});
+        }
+    }
+
+    // Grow the per-edge arrays to hold at least n_needed edges, keeping their contents
+    void reserve_edges(int n_needed) {
+        int new_max_n_edge = round_up(std::max(n_needed, max_n_edge + max_n_edge/2), 16);
+        grow_aligned(edge_value,       max_n_edge,                 new_max_n_edge,                 align_bytes);
+        grow_aligned(edge_deriv,       max_n_edge*(n_dim1+n_dim2), new_max_n_edge*(n_dim1+n_dim2), align_bytes);
+        grow_aligned(edge_sensitivity, max_n_edge,                 new_max_n_edge,                 align_bytes);
+        scaled_deriv.reset();  // scratch space, reallocated on demand
+        reordered_indices1.reset();  // refilled from the slots after every change to the edges
+        reordered_indices2.reset();
+        max_n_edge = new_max_n_edge;
+    }
+
+    // Copy the element data into the current slot order of the pairlist
+    void apply_order() {
+        order1 = pairlist.order1();
+        order2 = pairlist.order2();
+        reordered = false;
+        for(int i=0; i<n_elem1; ++i) reordered |= order1[i]!=i;
+        for(int i=0; i<n_elem2; ++i) reordered |= order2[i]!=i;
+
+        slot_loc1.resize(n_elem1);
+        for(int i=0; i<n_elem1; ++i) {
+            slot_loc1  [i] = loc1  [order1[i]];
+            slot_types1[i] = types1[order1[i]];
+            slot_id1   [i] = id1   [order1[i]];
+        }
+        if(!symmetric) {
+            slot_loc2.resize(n_elem2);
+            for(int i=0; i<n_elem2; ++i) {
+                slot_loc2  [i] = loc2  [order2[i]];
+                slot_types2[i] = types2[order2[i]];
+                slot_id2   [i] = id2   [order2[i]];
+            }
+        } else {
+            for(int nr: range(n_elem2)) slot_types2[nr] = slot_types1[nr];
+            for(int nr: range(n_elem2)) slot_id2   [nr] = slot_id1   [nr];
+        }
+
+        changed_map1 = ChangeMap(pos_node1->n_elem);
+        for(int ne: range(n_elem1)) changed_map1.add(slot_loc1[ne], ne);
+        if(!symmetric) {
+            changed_map2 = ChangeMap(pos_node2->n_elem);
+            for(int ne: range(n_elem2)) changed_map2.add(slot_loc2[ne], ne);
+        }
+    }
+
+    // Set edge_indices to the elements of the edge slots
+    void update_edge_indices() {
+        if(!reordered) {
+            edge_indices1 = edge_slots1;
+            edge_indices2 = edge_slots2;
+            return;
+        }
+        if(!reordered_indices1) {
+            reordered_indices1 = new_aligned<int32_t>(max_n_edge, align_bytes);
+            reordered_indices2 = new_aligned<int32_t>(max_n_edge, align_bytes);
+        }
+        for(int ne=0; ne<round_up(n_edge,edge_width); ++ne) {
+            reordered_indices1[ne] = order1[edge_slots1[ne]];
+            reordered_indices2[ne] = order2[edge_slots2[ne]];
+        }
+        edge_indices1 = reordered_indices1.get();
+        edge_indices2 = reordered_indices2.get();
+    }
+
+    void pack_positions() {
+        {
+            VecArray posv = pos_node1->output;
+            for(int ne=0; ne<n_elem1; ++ne) 
+                store_vec(pos1.get()+ne*n_dim1a, load_vec<n_dim1>(posv, slot_loc1[ne]));
+        }
+        if(!symmetric) {
+            VecArray posv = pos_node2->output;
+            for(int ne=0; ne<n_elem2; ++ne) 
+                store_vec(pos2.get()+ne*n_dim2a, load_vec<n_dim2>(posv, slot_loc2[ne]));
+        }
     }
 
     void update_cutoffs() {
@@ -392,11 +1294,44 @@ struct InteractionGraph{
                 }
             }
         }
-        float new_buffer = 1.0f + 0.2f*cutoff;
-        pairlist.change_cache_buffer(new_buffer);
+        float new_buffer = 1.0f + 0.2f*cutoff;  // rescaled by the pairlist unless adaptive_cache_buffer=0
+        pairlist.change_cutoff(cutoff, new_buffer);
         // printf("using cache_buffer %.2f for %i %i %i\n", new_buffer, n_dim1, n_dim2, int(symmetric));
     }
 
+    void update_table() {
+        if(!use_table) return;
+        for(int i: range(n_type1*n_type2))
+            Tabulation<IType>::tabulate(interaction_table+i*n_table, interaction_param+i*n_param);
+    }
+
+    // The pairlist is the only state of the graph that persists between computes
+    std::vector<char> get_checkpoint_state() const {return pairlist.get_checkpoint_state();}
+    void set_checkpoint_state(const std::vector<char>& state) {pairlist.set_checkpoint_state(state);}
+
+    void connect_shared(SharedResources& shared) {
+        // InteractionGraph's that read the same elements of the same nodes with the same ids share
+        // a pairlist cache, so that it is checked and rebuilt once per compute.  ITypes with
+        // different id filters may share, since each applies its own filter when refining.
+        // Cutoffs are grouped into 2A classes so that no user refines far more cache edges
+        // than it needs.
+        std::string key("pairlist");
+        auto append = [&](const void* data, size_t n_bytes) {
+            key.append(static_cast<const char*>(data), n_bytes);};
+
+        int cutoff_class = int(cutoff*0.5f);
+        int header[4] = {int(symmetric), n_elem1, n_elem2, cutoff_class};
+        append(header,     sizeof(header));
+        append(&pos_node1, sizeof(pos_node1));
+        append(&pos_node2, sizeof(pos_node2));
+        append(loc1.data(), loc1.size()*sizeof(index_t));
+        append(loc2.data(), loc2.size()*sizeof(index_t));
+        append(id1.get(), n_elem1*sizeof(int32_t));
+        if(!symmetric) append(id2.get(), n_elem2*sizeof(int32_t));
+
+        pairlist.share_cache(shared, key, &IType::acceptable_id_pair);
+    }
+
     std::vector<float> get_param() const {
         return {interaction_param.get(), interaction_param.get()+n_type1*n_type2*n_param};
     }
@@ -422,6 +1357,7 @@ struct InteractionGraph{
                 std::to_string(IType::n_param)+")";
         std::copy(begin(new_param), end(new_param), interaction_param.get());
         update_cutoffs();
+        update_table();
     }
 
     std::vector<float> count_edges_by_type() {
@@ -440,26 +1376,61 @@ struct InteractionGraph{
         return retval;
     }
 
-    template<bool param_deriv=false>
-    void compute_edges() {
+    // Compute edge values in the mode of the calling node.  In PotentialOnlyMode,
+    // edge_deriv is not stored and propagate_derivatives must not be called.
+    // The edges are divided among n_threads OpenMP threads.  Results do not depend on n_threads.
+    void compute_edges(ComputeMode mode, int n_threads=1) {
+        if(mode==PotentialOnlyMode) compute_edges<false,false>(n_threads);
+        else                        compute_edges<false,true >(n_threads);
+    }
+
+    template<bool param_deriv=false, bool store_deriv=true>
+    void compute_edges(int n_threads=1) {
         // Copy in the data to packed arrays to ensure contiguity
-        {
-            VecArray posv = pos_node1->output;
-            for(int ne=0; ne<n_elem1; ++ne) 
-                store_vec(pos1.get()+ne*n_dim1a, load_vec<n_dim1>(posv, loc1[ne]));
-        }
-        if(!symmetric) {
-            VecArray posv = pos_node2->output;
-            for(int ne=0; ne<n_elem2; ++ne) 
-                store_vec(pos2.get()+ne*n_dim2a, load_vec<n_dim2>(posv, loc2[ne]));
+        pack_positions();
+        auto repack = [&]() {apply_order(); pack_positions();};
+
+        if(!param_deriv && n_threads<=1) {
+            // Evaluate the edges as the pairlist accepts them, while their positions are still
+            // in registers.  The pairlist writes directly into its edge arrays.
+            pairlist.template ensure_cache_valid<IType::acceptable_id_pair>(cutoff,
+                                pos1.get(), n_dim1a, slot_id1.get(),
+                                (symmetric?pos1:pos2).get(), n_dim2a, slot_id2.get(),
+                                repack);
+            int max_n_found = round_up(pairlist.n_cache_edge(),edge_width);
+            if(max_n_found > max_n_edge) reserve_edges(max_n_found);
+
+            pairlist.template refine_and_evaluate_edges<IType::acceptable_id_pair,n_dim1,n_dim2>(
+                    pos1.get(), n_dim1a, (symmetric?pos1:pos2).get(), n_dim2a,
+                    [&](int ne, const IntLanes<edge_width>& i1, const IntLanes<edge_width>& i2,
+                            const Vec<n_dim1,FloatLanes<edge_width>>& coord1,
+                            const Vec<n_dim2,FloatLanes<edge_width>>& coord2) {
+                        evaluate_edge_group<edge_width,false,store_deriv>(ne, i1, i2, coord1, coord2);});
+            n_edge = pairlist.n_edge;
+
+            edge_slots1 = pairlist.edge_indices1.get();
+            edge_slots2 = pairlist.edge_indices2.get();
+            edge_id1    = pairlist.edge_id1.get();
+            edge_id2    = pairlist.edge_id2.get();
+            update_edge_indices();
+            return;
         }
 
         // First find all the edges
         {
             pairlist.template find_edges<IType::acceptable_id_pair>(cutoff,
-                                pos1.get(), n_dim1a, id1.get(),
-                                (symmetric?pos1:pos2).get(), n_dim2a, (symmetric?id1:id2).get());
+                                pos1.get(), n_dim1a, slot_id1.get(),
+                                (symmetric?pos1:pos2).get(), n_dim2a, slot_id2.get(),
+                                repack);
             n_edge = pairlist.n_edge;
+
+            // the pairlist may have reallocated its edge arrays
+            edge_slots1 = pairlist.edge_indices1.get();
+            edge_slots2 = pairlist.edge_indices2.get();
+            edge_id1    = pairlist.edge_id1.get();
+            edge_id2    = pairlist.edge_id2.get();
+            if(round_up(n_edge,edge_width) > max_n_edge) reserve_edges(round_up(n_edge,edge_width));
+            update_edge_indices();
         }
         // printf("n_edge for n_dim1 %i n_dim2 %i n_elem1 %i n_elem2 %i is %i\n", n_dim1, n_dim2, n_elem1, n_elem2, n_edge);
 
@@ -467,45 +1438,309 @@ struct InteractionGraph{
         if(param_deriv)
             edge_param_deriv.clear();
 
-        for(int ne=0; ne<n_edge; ne+=4) {
-            auto i1 = Int4(edge_indices1+ne);
-            auto i2 = Int4(edge_indices2+ne);
+        // edge_param_deriv is filled in edge order, so parameter derivatives are computed serially
+        constexpr int W = edge_width;
+        #pragma omp parallel for schedule(static) num_threads(n_threads) if(n_threads>1 && !param_deriv)
+        for(int ne=0; ne<n_edge; ne+=W) {
+            auto coord1 = load_transposed_vec<n_dim1,FloatLanes<W>>(pos1.get(),                  n_dim1a, edge_slots1+ne);
+            auto coord2 = load_transposed_vec<n_dim2,FloatLanes<W>>((symmetric?pos1:pos2).get(), n_dim2a, edge_slots2+ne);
 
-            auto t1 = Int4(types1.get(),i1);
-            auto t2 = Int4(types2.get(),i2);
+            evaluate_edge_group<W,param_deriv,store_deriv>(ne, IntLanes<W>(edge_slots1+ne), IntLanes<W>(edge_slots2+ne),
+                    coord1, coord2);
+        }
+    }
+
+    // Evaluate the W edges starting at ne, whose slots are i1 and i2 and whose
+    // positions are coord1 and coord2
+    template<int W, bool param_deriv, bool store_deriv>
+    void evaluate_edge_group(int ne, const IntLanes<W>& i1, const IntLanes<W>& i2,
+            const Vec<n_dim1,FloatLanes<W>>& coord1, const Vec<n_dim2,FloatLanes<W>>& coord2) {
+        typedef IntLanes<W> IntW;
+        auto pair = IntW(slot_types1.get(),i1)*IntW(n_type2) + IntW(slot_types2.get(),i2);
+
+        Vec<n_dim1,FloatLanes<W>> d1;
+        Vec<n_dim2,FloatLanes<W>> d2;
+
+        // parameter derivatives are computed with the exact interaction
+        compute_edge<W,param_deriv>(d1,d2, pair, coord1,coord2).store(edge_value+ne);
+        if(store_deriv) store_edge_deriv<W>(ne, d1,d2);
+
+        if(param_deriv) {
+            alignas(32) int32_t interaction_offset[W];
+            alignas(32) float   c1_lanes[n_dim1][W], c2_lanes[n_dim2][W];
+            (pair*IntW(n_param)).store(interaction_offset);
+            for(int d: range(n_dim1)) coord1[d].store(c1_lanes[d]);
+            for(int d: range(n_dim2)) coord2[d].store(c2_lanes[d]);
+
+            for(int i: range(W)) {
+                Vec<n_dim1> c1; for(int d: range(n_dim1)) c1[d] = c1_lanes[d][i];
+                Vec<n_dim2> c2; for(int d: range(n_dim2)) c2[d] = c2_lanes[d][i];
+
+                edge_param_deriv.push_back(make_zero<n_param>());
+                IType::param_deriv(edge_param_deriv.back(), interaction_param+interaction_offset[i], c1,c2);
+            }
+        }
+    }
+
+    // Evaluate the W edges of type pairs pair, from interaction_table unless exact is set or
+    // the tabulate attribute is not set
+    template<int W, bool exact=false>
+    FloatLanes<W> compute_edge(Vec<n_dim1,FloatLanes<W>>& d1, Vec<n_dim2,FloatLanes<W>>& d2, const IntLanes<W>& pair,
+            const Vec<n_dim1,FloatLanes<W>>& coord1, const Vec<n_dim2,FloatLanes<W>>& coord2) {
+        alignas(32) int32_t offset[W];
+        const float* ptr[W];
+        if(n_table && use_table && !exact) {
+            (pair*IntLanes<W>(n_table)).store(offset);
+            for(int i=0; i<W; ++i) ptr[i] = interaction_table+offset[i];
+            return evaluate_quads<W,n_dim1,n_dim2>(d1,d2, coord1,coord2,
+                    [&](Vec<n_dim1,Float4>& qd1, Vec<n_dim2,Float4>& qd2, int k,
+                        const Vec<n_dim1,Float4>& q1, const Vec<n_dim2,Float4>& q2) {
+                        return Tabulation<IType>::compute_edge(qd1,qd2, ptr+4*k, q1,q2);});
+        }
+
+        (pair*IntLanes<W>(n_param)).store(offset);
+        for(int i=0; i<W; ++i) ptr[i] = interaction_param+offset[i];
+        return EdgeLanes<IType>::template compute_edge<W,n_dim1,n_dim2>(d1,d2, ptr, coord1,coord2);
+    }
+
+    // edge_deriv holds each group of 4 edges as n_dim1 rows of 4 lanes for the first element,
+    // followed by n_dim2 rows for the second, so that its layout does not depend on W
+    template<int W>
+    void store_edge_deriv(int ne, const Vec<n_dim1,FloatLanes<W>>& d1, const Vec<n_dim2,FloatLanes<W>>& d2) {
+        for(int k=0; k<W/4; ++k) {
+            float* group = edge_deriv + (ne+4*k)*(n_dim1+n_dim2);
+            for(int d=0; d<n_dim1; ++d) SimdLanes<W>::quad(d1[d],k).store(group+4*d);
+            for(int d=0; d<n_dim2; ++d) SimdLanes<W>::quad(d2[d],k).store(group+4*(n_dim1+d));
+        }
+    }
+
+    template<int W>
+    void load_edge_deriv(int ne, Vec<n_dim1,FloatLanes<W>>& d1, Vec<n_dim2,FloatLanes<W>>& d2) const {
+        Float4 q[W/4];
+        for(int d=0; d<n_dim1; ++d) {
+            for(int k=0; k<W/4; ++k) q[k] = Float4(edge_deriv + (ne+4*k)*(n_dim1+n_dim2)+4*d);
+            d1[d] = SimdLanes<W>::join(q);
+        }
+        for(int d=0; d<n_dim2; ++d) {
+            for(int k=0; k<W/4; ++k) q[k] = Float4(edge_deriv + (ne+4*k)*(n_dim1+n_dim2)+4*(n_dim1+d));
+            d2[d] = SimdLanes<W>::join(q);
+        }
+    }
+
+
+    // Update the edges that involve changed elements of the input nodes (see
+    // DerivEngine::compute_incremental) without rebuilding the pairlist.  The
+    // changed elements are checked against all other elements, and delta_value
+    // is set to the resulting change in the sum of edge_value.  Only edge_value,
+    // the edge indices, and the edge ids are updated, so compute_edges must be
+    // called before propagate_derivatives.  Returns false if every input element
+    // may have changed or the edge buffers are too small, in which case
+    // compute_edges must be called.
+    bool update_changed_edges(float& delta_value) {
+        if(pos_node1->all_changed || (!symmetric && pos_node2->all_changed)) return false;
+
+        changed1.clear();
+        changed_map1.collect(changed1, *pos_node1);
+        if(!symmetric) {
+            changed2.clear();
+            changed_map2.collect(changed2, *pos_node2);
+        }
+        auto& is_ch2 = symmetric ? is_changed1 : is_changed2;
+        float* p2    = (symmetric?pos1:pos2).get();
+
+        {
+            VecArray posv = pos_node1->output;
+            for(auto ne: changed1) {
+                store_vec(pos1.get()+ne*n_dim1a, load_vec<n_dim1>(posv, slot_loc1[ne]));
+                is_changed1[ne] = true;
+            }
+        }
+        if(!symmetric) {
+            VecArray posv = pos_node2->output;
+            for(auto ne: changed2) {
+                store_vec(pos2.get()+ne*n_dim2a, load_vec<n_dim2>(posv, slot_loc2[ne]));
+                is_changed2[ne] = true;
+            }
+        }
+
+        // remove old edges that involve changed elements
+        delta_value = 0.f;
+        int ne_new = 0;
+        for(int ne=0; ne<n_edge; ++ne) {
+            if(is_changed1[edge_slots1[ne]] || is_ch2[edge_slots2[ne]]) {
+                delta_value -= edge_value[ne];
+                continue;
+            }
+            edge_slots1  [ne_new] = edge_slots1  [ne];
+            edge_slots2  [ne_new] = edge_slots2  [ne];
+            edge_id1     [ne_new] = edge_id1     [ne];
+            edge_id2     [ne_new] = edge_id2     [ne];
+            edge_value   [ne_new] = edge_value   [ne];
+            ++ne_new;
+        }
+
+        // find new edges involving changed elements, counting edges between
+        // two changed elements only once
+        bool overflow = false;
+        auto add_edge = [&](int i1, int i2) {
+            if(round_up(ne_new+1,edge_width) > std::min(max_n_edge, pairlist.max_n_edge)) {overflow = true; return;}
+            edge_slots1  [ne_new] = i1;
+            edge_slots2  [ne_new] = i2;
+            edge_id1     [ne_new] = slot_id1[i1];
+            edge_id2     [ne_new] = slot_id2[i2];
+            ++ne_new;
+        };
+
+        // scan all partners of a changed element 4 at a time
+        auto Float4_cutoff2 = Float4(sqr(cutoff));
+        auto find_partners = [&](const float* x_pos, int x_id, const float* other_pos, int other_stride,
+                                 const int32_t* other_id, int n_other, const std::function<void(int)>& f) {
+            auto x  = Float4(x_pos);
+            auto xx = Float4(x.x()), xy = Float4(x.y()), xz = Float4(x.z());
+            for(int i=0; i<n_other; i+=4) {
+                auto a = Float4(other_pos+other_stride*(i+0));
+                auto b = Float4(other_pos+other_stride*(i+1));
+                auto c = Float4(other_pos+other_stride*(i+2));
+                auto d = Float4(other_pos+other_stride*(i+3));
+                transpose4(a,b,c,d);
+                auto near = (sqr(a-xx)+sqr(b-xy)+sqr(c-xz)) < Float4_cutoff2;
+                if(near.none()) continue;
+                int hits = (near.cast_int() & IType::acceptable_id_pair(Int4(x_id), Int4(other_id+i, Alignment::unaligned))).movemask();
+                for(int j=0; j<4; ++j) if((hits>>j)&1 && i+j<n_other) f(i+j);
+            }
+        };
+
+        int first_new_edge = ne_new;
+        for(auto i1: changed1) {
+            find_partners(pos1.get()+i1*n_dim1a, slot_id1[i1], p2, n_dim2a, slot_id2.get(), n_elem2, [&](int i2) {
+                if(symmetric) {
+                    if(i2==i1 || (is_ch2[i2] && i2<i1)) return;
+                    add_edge(std::min(int(i1),i2), std::max(int(i1),i2));
+                } else {
+                    add_edge(i1,i2);
+                }});
+        }
+        if(!symmetric) {
+            for(auto i2: changed2) {
+                find_partners(p2+i2*n_dim2a, slot_id2[i2], pos1.get(), n_dim1a, slot_id1.get(), n_elem1, [&](int i1) {
+                    if(!is_changed1[i1]) add_edge(i1,i2);});
+            }
+        }
+
+        for(auto ne: changed1) is_changed1[ne] = false;
+        if(!symmetric) for(auto ne: changed2) is_changed2[ne] = false;
+        if(overflow) return false;
+
+        // compute values for the new edges in groups of 4
+        for(int ne=first_new_edge; ne<ne_new; ne+=4) {
+            alignas(16) int32_t i1v[4], i2v[4];
+            for(int j: range(4)) {
+                int k = ne+j<ne_new ? ne+j : ne;  // pad with a duplicate edge
+                i1v[j] = edge_slots1[k];
+                i2v[j] = edge_slots2[k];
+            }
+            auto i1 = Int4(i1v);
+            auto i2 = Int4(i2v);
 
-            auto interaction_offset = (t1*Int4(n_type2) + t2)*Int4(n_param);
-            const float* interaction_ptr[4] = {
-                interaction_param+interaction_offset.x(),
-                interaction_param+interaction_offset.y(),
-                interaction_param+interaction_offset.z(),
-                interaction_param+interaction_offset.w()};
+            auto pair = Int4(slot_types1.get(),i1)*Int4(n_type2) + Int4(slot_types2.get(),i2);
 
-            auto coord1 = aligned_gather_vec<n_dim1>(pos1.get(),                 i1*Int4(n_dim1a));
-            auto coord2 = aligned_gather_vec<n_dim2>((symmetric?pos1:pos2).get(),i2*Int4(n_dim2a));
+            auto coord1 = aligned_gather_vec<n_dim1>(pos1.get(), i1*Int4(n_dim1a));
+            auto coord2 = aligned_gather_vec<n_dim2>(p2,         i2*Int4(n_dim2a));
 
             Vec<n_dim1,Float4> d1;
             Vec<n_dim2,Float4> d2;
 
-            IType::compute_edge(d1,d2, interaction_ptr, coord1,coord2).store(edge_value+ne);
-            store_vec(edge_deriv + ne*(n_dim1+n_dim2),          d1);
-            store_vec(edge_deriv + ne*(n_dim1+n_dim2)+4*n_dim1, d2);
+            alignas(16) float value[4];
+            compute_edge<4>(d1,d2, pair, coord1,coord2).store(value);
+            for(int j=0; j<4 && ne+j<ne_new; ++j) {
+                edge_value[ne+j] = value[j];
+                delta_value += value[j];
+            }
+        }
+
+        n_edge = ne_new;
+        for(int i=n_edge; i<round_up(n_edge,edge_width); ++i) {
+            edge_slots1[i] = edge_slots1[i-i%edge_width];
+            edge_slots2[i] = edge_slots2[i-i%edge_width];
+        }
+        update_edge_indices();
+        return true;
+    }
 
-            if(param_deriv) {
-                for(int i: range(4)) {
-                    Vec<n_dim1> c1; for(int d: range(n_dim1)) c1[d] = extract_float(coord1[d],i);
-                    Vec<n_dim2> c2; for(int d: range(n_dim2)) c2[d] = extract_float(coord2[d],i);
 
-                    edge_param_deriv.push_back(make_zero<n_param>());
-                    IType::param_deriv(edge_param_deriv.back(), interaction_ptr[i], c1,c2);
-                }
-            }
+    // Per-element lists of edge contributions for gather_derivatives, in scatter order.
+    // Entries are 2*edge+side, where side is 0 for the first element of an edge and 1 for the
+    // second.  For symmetric interactions both sides are in the first list.
+    std::vector<int32_t> contrib_start1, contrib_start2;
+    std::vector<int32_t> contrib_entry1, contrib_entry2;
+    aligned_ptr<float>   scaled_deriv;  // edge_deriv times edge_sensitivity, one row per edge side
+
+    void build_contributions(std::vector<int32_t>& start, std::vector<int32_t>& entry, int n_elem,
+            const int32_t* indices_side0, const int32_t* indices_side1) {
+        // either set of indices may be null to skip that side
+        start.assign(n_elem+1, 0);
+        for(int ne=0; ne<n_edge; ++ne) {
+            if(indices_side0) start[indices_side0[ne]+1]++;
+            if(indices_side1) start[indices_side1[ne]+1]++;
+        }
+        for(int i=0; i<n_elem; ++i) start[i+1] += start[i];
+        entry.resize(start[n_elem]);
+
+        // match the order of the serial scatter, which handles each group of 4 edges
+        // first side 0 and then side 1
+        std::vector<int32_t> cursor(start.begin(), start.end()-1);
+        for(int ne0=0; ne0<n_edge; ne0+=4) {
+            int ne1 = std::min(ne0+4, n_edge);
+            if(indices_side0) for(int ne=ne0; ne<ne1; ++ne) entry[cursor[indices_side0[ne]]++] = 2*ne+0;
+            if(indices_side1) for(int ne=ne0; ne<ne1; ++ne) entry[cursor[indices_side1[ne]]++] = 2*ne+1;
         }
     }
 
+    void gather_derivatives(int n_threads) {
+        // Parallel replacement for the scatter loop in propagate_derivatives.  Instead of
+        // scattering each edge, every element sums its contributions in the order of the
+        // serial scatter, which performs exactly the same additions.  The result is therefore
+        // identical for any number of threads.
+        constexpr int row = n_dim1a+n_dim2a;
+        if(!scaled_deriv) scaled_deriv = new_aligned<float>(max_n_edge*row, align_bytes);
+
+        #pragma omp parallel for schedule(static) num_threads(n_threads)
+        for(int ne=0; ne<n_edge; ++ne) {
+            const float* d = edge_deriv + (ne-ne%4)*(n_dim1+n_dim2) + ne%4;
+            float sens = edge_sensitivity[ne];
+            float* r1 = scaled_deriv + ne*row;
+            float* r2 = r1 + n_dim1a;
+            for(int i=0; i<n_dim1a; ++i) r1[i] = i<n_dim1 ? sens*d[4*i]          : 0.f;
+            for(int i=0; i<n_dim2a; ++i) r2[i] = i<n_dim2 ? sens*d[4*(n_dim1+i)] : 0.f;
+        }
+
+        if(symmetric) {
+            build_contributions(contrib_start1, contrib_entry1, n_elem1, edge_slots1, edge_slots2);
+        } else {
+            build_contributions(contrib_start1, contrib_entry1, n_elem1, edge_slots1, nullptr);
+            build_contributions(contrib_start2, contrib_entry2, n_elem2, nullptr, edge_slots2);
+        }
+
+        auto sum_rows = [&](float* deriv, int n_dim_a, const std::vector<int32_t>& start,
+                            const std::vector<int32_t>& entry, int n_elem) {
+            #pragma omp parallel for schedule(static) num_threads(n_threads)
+            for(int i=0; i<n_elem; ++i) {
+                for(int d=0; d<n_dim_a; d+=4) {
+                    auto acc = Float4();
+                    for(int k=start[i]; k<start[i+1]; ++k) {
+                        int e = entry[k];
+                        acc += Float4(scaled_deriv + (e>>1)*row + (e&1)*n_dim1a + d);
+                    }
+                    acc.store(deriv + i*n_dim_a + d);
+                }
+            }
+        };
+        sum_rows(pos1_deriv.get(), n_dim1a, contrib_start1, contrib_entry1, n_elem1);
+        if(!symmetric) sum_rows(pos2_deriv.get(), n_dim2a, contrib_start2, contrib_entry2, n_elem2);
+    }
 
     template<bool param_deriv=false>
-    void propagate_derivatives() {
+    void propagate_derivatives(int n_threads=1) {
         // Finally put the data where it is needed.
         // This function must be called after the user sets edge_sensitivity
 
@@ -513,7 +1748,7 @@ struct InteractionGraph{
         // be zero since these are not real edges.  This is an implementation detail
         // that the user does not know about, so we will set these edge sensistitivies to 
         // zero ourselves.
-        for(int ne=n_edge; ne<round_up(n_edge,4); ++ne) edge_sensitivity[ne] = 0.f;
+        for(int ne=n_edge; ne<round_up(n_edge,edge_width); ++ne) edge_sensitivity[ne] = 0.f;
 
         // Zero accumulation buffers
         fill_n(pos1_deriv, n_elem1*n_dim1a, 0.f);
@@ -522,36 +1757,48 @@ struct InteractionGraph{
             fill(interaction_param_deriv, 0.f);
 
         // Accumulate derivatives
-        for(int ne=0; ne<n_edge; ne+=4) {
-            auto i1 = Int4(edge_indices1+ne);
-            auto i2 = Int4(edge_indices2+ne);
-            auto sens = Float4(edge_sensitivity+ne);
-
-            auto d1 = sens*load_vec<n_dim1>(edge_deriv + ne*(n_dim1+n_dim2), Alignment::aligned);
-            auto d2 = sens*load_vec<n_dim2>(edge_deriv + ne*(n_dim1+n_dim2)+4*n_dim1, Alignment::aligned);
-
-            aligned_scatter_update_vec_destructive(pos1_deriv.get(),                       i1*Int4(n_dim1a), d1);
-            aligned_scatter_update_vec_destructive((symmetric?pos1_deriv:pos2_deriv).get(),i2*Int4(n_dim2a), d2);
-
-            if(param_deriv) {
-                for(int i: range(4)) {
-                    int t1 = types1[edge_indices1[ne+i]];
-                    int t2 = types2[edge_indices2[ne+i]];
-                    update_vec(interaction_param_deriv, t1*n_type2+t2, extract_float(sens,i)*edge_param_deriv[ne+i]);
+        if(n_threads>1) {
+            gather_derivatives(n_threads);
+        } else {
+            constexpr int W = edge_width;
+            for(int ne=0; ne<n_edge; ne+=W) {
+                auto sens = FloatLanes<W>(edge_sensitivity+ne);
+                Vec<n_dim1,FloatLanes<W>> d1;
+                Vec<n_dim2,FloatLanes<W>> d2;
+                load_edge_deriv<W>(ne, d1,d2);
+                d1 *= sens;
+                d2 *= sens;
+
+                // The rows are updated 4 edges at a time, in the order of build_contributions
+                for(int k=0; k<W/4 && ne+4*k<n_edge; ++k) {
+                    Vec<n_dim1,Float4> q1; for(int d=0; d<n_dim1; ++d) q1[d] = SimdLanes<W>::quad(d1[d],k);
+                    Vec<n_dim2,Float4> q2; for(int d=0; d<n_dim2; ++d) q2[d] = SimdLanes<W>::quad(d2[d],k);
+                    aligned_scatter_update_vec_destructive(pos1_deriv.get(),
+                            Int4(edge_slots1+ne+4*k)*Int4(n_dim1a), q1);
+                    aligned_scatter_update_vec_destructive((symmetric?pos1_deriv:pos2_deriv).get(),
+                            Int4(edge_slots2+ne+4*k)*Int4(n_dim2a), q2);
                 }
             }
         }
 
+        if(param_deriv) {
+            for(int ne=0; ne<n_edge; ++ne) {
+                int t1 = types1[edge_indices1[ne]];
+                int t2 = types2[edge_indices2[ne]];
+                update_vec(interaction_param_deriv, t1*n_type2+t2, edge_sensitivity[ne]*edge_param_deriv[ne]);
+            }
+        }
+
         // Push derivatives to slots
         {
             VecArray pos1_sens = pos_node1->sens;
             for(int i1=0; i1<n_elem1; ++i1)
-                update_vec(pos1_sens, loc1[i1], load_vec<n_dim1>(pos1_deriv+i1*n_dim1a));
+                update_vec(pos1_sens, slot_loc1[i1], load_vec<n_dim1>(pos1_deriv+i1*n_dim1a));
         }
         if(!symmetric) {
             VecArray pos2_sens = pos_node2->sens;
             for(int i2=0; i2<n_elem2; ++i2)
-                update_vec(pos2_sens, loc2[i2], load_vec<n_dim2>(pos2_deriv+i2*n_dim2a));
+                update_vec(pos2_sens, slot_loc2[i2], load_vec<n_dim2>(pos2_deriv+i2*n_dim2a));
         }
     }
 };
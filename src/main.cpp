@@ -234,7 +234,7 @@ struct ReplicaExchange {
         auto compute_log_boltzmann = [&]() {
             vector<float> result(n_system);
             for(int i=0; i<n_system; ++i) {
-                systems[i].engine.compute(PotentialAndDerivMode);
+                systems[i].engine.compute(PotentialOnlyMode);
                 result[i] = -beta[i]*systems[i].engine.potential;
             }
             return result;
@@ -276,6 +276,171 @@ struct ReplicaExchange {
 };
 
 
+// Binary checkpoint of the dynamical state of all systems.  The potential is rebuilt
+// from the configuration files on restart, so only the state that evolves during the
+// simulation is stored: positions, momenta, round numbers, thermostat and Monte Carlo
+// counters, replica exchange state, and any internal state of the nodes.
+static const char checkpoint_magic[8] = {'U','P','S','I','D','E','C','K'};
+static const uint32_t checkpoint_version = 2u;  // 2 adds the pairlist state of nodes
+
+struct CheckpointFile {
+    FILE* f;
+    string path;
+
+    CheckpointFile(const string& path_, const char* mode): f(fopen(path_.c_str(), mode)), path(path_) {
+        if(!f) throw string("unable to open checkpoint file ") + path;
+    }
+    ~CheckpointFile() {if(f) fclose(f);}
+
+    void write_bytes(const void* data, size_t n) {
+        if(n && fwrite(data, 1, n, f) != n) throw string("unable to write checkpoint file ") + path;
+    }
+    void read_bytes(void* data, size_t n) {
+        if(n && fread(data, 1, n, f) != n) throw string("truncated checkpoint file ") + path;
+    }
+
+    template <typename T> void write(const T& x) {write_bytes(&x, sizeof(T));}
+    template <typename T> T read() {T x; read_bytes(&x, sizeof(T)); return x;}
+
+    template <typename T> void write_vector(const vector<T>& v) {
+        write<uint64_t>(v.size());
+        write_bytes(v.data(), v.size()*sizeof(T));
+    }
+    template <typename T> vector<T> read_vector() {
+        vector<T> v(read<uint64_t>());
+        read_bytes(v.data(), v.size()*sizeof(T));
+        return v;
+    }
+
+    void write_array(VecArray a, int n_dim, int n_elem) {
+        vector<float> v; v.reserve(n_dim*n_elem);
+        for(int ne=0; ne<n_elem; ++ne) for(int d=0; d<n_dim; ++d) v.push_back(a(d,ne));
+        write_vector(v);
+    }
+    void read_array(VecArray a, int n_dim, int n_elem) {
+        auto v = read_vector<float>();
+        if(v.size() != size_t(n_dim*n_elem)) throw string("checkpoint array has the wrong size");
+        for(int ne=0; ne<n_elem; ++ne) for(int d=0; d<n_dim; ++d) a(d,ne) = v[ne*n_dim+d];
+    }
+};
+
+
+void write_checkpoint(const string& path, vector<System>& systems, ReplicaExchange* replex,
+        uint32_t base_random_seed, uint64_t last_start) {
+    // write to a temporary file and rename, so that an interrupted write never
+    // destroys the previous checkpoint
+    string tmp_path = path + ".tmp";
+    {
+        CheckpointFile cf(tmp_path, "wb");
+        cf.write(checkpoint_magic);
+        cf.write(checkpoint_version);
+        cf.write<uint32_t>(base_random_seed);
+        cf.write<uint64_t>(last_start);
+        cf.write<int32_t>(systems.size());
+
+        for(auto& sys: systems) {
+            cf.write<int32_t>(sys.n_atom);
+            cf.write<uint64_t>(sys.round_num);
+            cf.write<uint32_t>(sys.random_seed);
+            cf.write<float>(sys.temperature);
+            cf.write<uint64_t>(sys.thermostat.get_n_invocations());
+            cf.write<int32_t>(sys.engine.respa_phase);
+            cf.write_array(sys.engine.pos->output, 3, sys.n_atom);
+            cf.write_array(sys.mom,                3, sys.n_atom);
+
+            cf.write<int32_t>(sys.mc_samplers.samplers.size());
+            for(auto& sampler: sys.mc_samplers.samplers) {
+                cf.write<uint64_t>(sampler->move_stats.n_success);
+                cf.write<uint64_t>(sampler->move_stats.n_attempt);
+            }
+
+            cf.write<int32_t>(sys.engine.nodes.size());
+            for(auto& n: sys.engine.nodes) {
+                cf.write_vector(vector<char>(begin(n.name), end(n.name)));
+                cf.write_vector(n.computation->get_checkpoint_state());
+            }
+        }
+
+        cf.write<int32_t>(replex ? 1 : 0);
+        if(replex) {
+            cf.write_vector(replex->replica_indices);
+            for(auto& ss: replex->swap_sets) {
+                for(auto& sw: ss) {
+                    cf.write<uint64_t>(sw.n_attempt);
+                    cf.write<uint64_t>(sw.n_success);
+                }
+            }
+        }
+        if(fflush(cf.f)) throw string("unable to write checkpoint file ") + tmp_path;
+    }
+    if(rename(tmp_path.c_str(), path.c_str()))
+        throw string("unable to move checkpoint file into place at ") + path;
+}
+
+
+uint64_t read_checkpoint(const string& path, vector<System>& systems, ReplicaExchange* replex,
+        uint32_t& base_random_seed) {
+    // returns the round number of the last replica exchange synchronization
+    CheckpointFile cf(path, "rb");
+    char magic[sizeof(checkpoint_magic)];
+    cf.read_bytes(magic, sizeof(magic));
+    if(!equal(begin(checkpoint_magic), end(checkpoint_magic), begin(magic)))
+        throw path + " is not an Upside checkpoint";
+    if(cf.read<uint32_t>() != checkpoint_version) throw string("unsupported checkpoint version in ") + path;
+
+    base_random_seed = cf.read<uint32_t>();
+    auto last_start = cf.read<uint64_t>();
+    if(cf.read<int32_t>() != int(systems.size()))
+        throw string("checkpoint has a different number of systems than the configuration files");
+
+    for(auto& sys: systems) {
+        if(cf.read<int32_t>() != sys.n_atom) throw string("checkpoint has a different number of atoms");
+        sys.round_num   = cf.read<uint64_t>();
+        sys.random_seed = cf.read<uint32_t>();
+        sys.thermostat.random_seed = sys.random_seed;
+        sys.set_temperature(cf.read<float>());
+        sys.thermostat.set_n_invocations(cf.read<uint64_t>());
+        sys.engine.respa_phase = cf.read<int32_t>();
+        cf.read_array(sys.engine.pos->output, 3, sys.n_atom);
+        cf.read_array(sys.mom,                3, sys.n_atom);
+
+        if(cf.read<int32_t>() != int(sys.mc_samplers.samplers.size()))
+            throw string("checkpoint has a different set of Monte Carlo samplers");
+        for(auto& sampler: sys.mc_samplers.samplers) {
+            sampler->move_stats.n_success = cf.read<uint64_t>();
+            sampler->move_stats.n_attempt = cf.read<uint64_t>();
+        }
+
+        if(cf.read<int32_t>() != int(sys.engine.nodes.size()))
+            throw string("checkpoint has a different number of potential nodes");
+        for(auto& n: sys.engine.nodes) {
+            auto name = cf.read_vector<char>();
+            if(string(begin(name), end(name)) != n.name)
+                throw string("checkpoint node ") + string(begin(name), end(name)) +
+                    " does not match potential node " + n.name;
+            n.computation->set_checkpoint_state(cf.read_vector<char>());
+        }
+    }
+
+    bool has_replex = cf.read<int32_t>();
+    if(has_replex != bool(replex))
+        throw string("replica exchange settings do not match the checkpoint");
+    if(replex) {
+        auto replica_indices = cf.read_vector<int>();
+        if(replica_indices.size() != replex->replica_indices.size())
+            throw string("checkpoint has a different number of replicas");
+        replex->replica_indices = replica_indices;
+        for(auto& ss: replex->swap_sets) {
+            for(auto& sw: ss) {
+                sw.n_attempt = cf.read<uint64_t>();
+                sw.n_success = cf.read<uint64_t>();
+            }
+        }
+    }
+    return last_start;
+}
+
+
 vector<float> potential_deriv_agreement(DerivEngine& engine) {
     vector<float> relative_error;
     int n_atom = engine.pos->n_elem;
@@ -370,6 +535,28 @@ try {
             "of the potential for the initial structure.  This may give strange answers for native structures "
             "(no steric clashes may given an agreement of NaN) or random structures (where bonds and angles are "
             "exactly at their equilibrium values).  Interpret these results at your own risk.", cmd, false);
+    ValueArg<int> threads_per_replica_arg("", "threads-per-replica",
+            "number of OpenMP threads used to evaluate independent potential terms within each replica "
+            "(default 1).  The number of replicas run concurrently is the OpenMP thread count divided by "
+            "this value.",
+            false, 1, "int", cmd);
+    ValueArg<int> respa_interval_arg("", "respa-interval",
+            "number of integration cycles between evaluations of potential nodes marked with the "
+            "attribute slow (default 1).  Values greater than 1 enable multiple time step integration, "
+            "where only the remaining fast nodes are evaluated within each cycle.",
+            false, 1, "int", cmd);
+    ValueArg<string> checkpoint_arg("", "checkpoint",
+            "path of a binary checkpoint file to write when the simulation stops, either at the end "
+            "or on receiving a termination signal (default is no checkpoint)",
+            false, "", "checkpoint_file", cmd);
+    ValueArg<double> checkpoint_interval_arg("", "checkpoint-interval",
+            "simulation time between periodic checkpoints (0 means checkpoint only when the simulation "
+            "stops, default 0.)",
+            false, 0., "float", cmd);
+    ValueArg<string> restart_arg("", "restart",
+            "resume the simulation from a checkpoint file written by a previous run with the same "
+            "configuration files.  Existing /output groups are preserved as /output_previous_<n>.",
+            false, "", "checkpoint_file", cmd);
     ValueArg<string> set_param_arg("", "set-param", "Developer use only", false, "", "param_arg", cmd);
     UnlabeledMultiArg<string> config_args("config_files","configuration .h5 files", true, "h5_files");
     cmd.add(config_args);
@@ -442,6 +629,24 @@ try {
             return sqr(sqrt(T0)*(1.-fraction) + sqrt(T1)*fraction);
         };
 
+        int threads_per_replica = threads_per_replica_arg.getValue();
+        if(threads_per_replica < 1) throw string("--threads-per-replica must be at least 1");
+        // each replica thread may open its own team of threads to evaluate the potential, and
+        // each node may divide its work among a further team (see DerivComputation::n_threads)
+        if(threads_per_replica > 1) omp_set_max_active_levels(3);
+        int n_replica_threads = max(1, omp_get_max_threads()/threads_per_replica);
+
+        int respa_interval = respa_interval_arg.getValue();
+        if(respa_interval < 1) throw string("--respa-interval must be at least 1");
+
+        string checkpoint_path = checkpoint_arg.getValue();
+        string restart_path    = restart_arg.getValue();
+        uint64_t checkpoint_interval = 0u;
+        if(checkpoint_interval_arg.getValue()) {
+            if(!checkpoint_path.size()) throw string("--checkpoint-interval requires --checkpoint");
+            checkpoint_interval = max(1.,round(checkpoint_interval_arg.getValue() / (3*dt)));
+        }
+
         int replica_interval = 0;
         if(replica_interval_arg.getValue())
             replica_interval = max(1.,replica_interval_arg.getValue()/(3*dt));
@@ -466,9 +671,19 @@ try {
             }
 
             if(h5_exists(sys->config.get(), "output")) {
-                // Note that it is not possible in HDF5 1.8.x to reclaim space by deleting
-                // datasets or groups.  Subsequent h5repack will reclaim space, however.
-                h5_noerr(H5Ldelete(sys->config.get(), "/output", H5P_DEFAULT));
+                if(restart_path.size()) {
+                    // keep the output of the previous runs, since the restarted output only
+                    // covers the remainder of the simulation
+                    int n_previous = 0;
+                    while(h5_exists(sys->config.get(), ("output_previous_"+to_string(n_previous)).c_str()))
+                        ++n_previous;
+                    h5_noerr(H5Lmove(sys->config.get(), "/output", sys->config.get(),
+                                ("/output_previous_"+to_string(n_previous)).c_str(), H5P_DEFAULT, H5P_DEFAULT));
+                } else {
+                    // Note that it is not possible in HDF5 1.8.x to reclaim space by deleting
+                    // datasets or groups.  Subsequent h5repack will reclaim space, however.
+                    h5_noerr(H5Ldelete(sys->config.get(), "/output", H5P_DEFAULT));
+                }
             }
 
             LogLevel log_level;
@@ -493,6 +708,8 @@ try {
 
             auto potential_group = open_group(sys->config.get(), "/input/potential");
             sys->engine = initialize_engine_from_hdf5(sys->n_atom, potential_group.get());
+            sys->engine.n_threads = threads_per_replica;
+            sys->engine.respa_interval = respa_interval;
 
             // Override parameters as instructed by users
             for(const auto& p: set_param_map)
@@ -535,7 +752,7 @@ try {
                     kin_buffer[0] = (0.5/sys->n_atom)*sum_kin;  // kinetic_energy = (1/2) * <mom^2>
                     });
             sys->logger->add_logger<double>("potential", {1}, [sys](double* pot_buffer) {
-                    sys->engine.compute(PotentialAndDerivMode);
+                    sys->engine.compute(PotentialOnlyMode);
                     pot_buffer[0] = sys->engine.potential;});
             sys->logger->add_logger<double>("time", {}, [sys,dt](double* time_buffer) {
                     *time_buffer=3*dt*sys->round_num;});
@@ -588,6 +805,13 @@ try {
                     throw string("Replica exchange requires all systems have the same number of atoms");
         }
 
+        uint64_t last_start = 0;
+        if(restart_path.size()) {
+            last_start = read_checkpoint(restart_path, systems, replex.get(), base_random_seed);
+            if(verbose) printf("restarting from %s at time %.1f\n",
+                    restart_path.c_str(), systems[0].round_num*3*double(dt));
+        }
+
         if(verbose) printf("\n");
         for(int ns: range(systems.size())) {
             if(verbose) printf("%i %.2f\n", ns, systems[ns].temperature);
@@ -597,12 +821,22 @@ try {
         }
         if(verbose) printf("\n");
 
-        if(verbose) printf("Initial potential energy:");
-        for(System& sys: systems) {
-            sys.engine.compute(PotentialAndDerivMode);
-            if(verbose) printf(" %.2f", sys.engine.potential);
+        // Re-allocate the node buffers of each system from the thread that runs
+        // it in the main loop, so that the memory is local to that thread
+        #pragma omp parallel for schedule(static,1) num_threads(n_replica_threads)
+        for(int ns=0; ns<n_system; ++ns)
+            systems[ns].engine.allocate_arena();
+
+        // A restarted simulation must continue exactly as the original run, which did not
+        // evaluate the potential at this step, so the extra evaluation is skipped
+        if(!restart_path.size()) {
+            if(verbose) printf("Initial potential energy:");
+            for(System& sys: systems) {
+                sys.engine.compute(PotentialOnlyMode);
+                if(verbose) printf(" %.2f", sys.engine.potential);
+            }
+            if(verbose) printf("\n");
         }
-        if(verbose) printf("\n");
 
         // Install signal handlers to dump state only when the simulation has really started.  This is intended to prevent
         // loss of buffered data and to present final statistics.  It is especially useful when being killed due to running 
@@ -610,12 +844,56 @@ try {
         SignalHandlerHandler sigint_handler (SIGINT,  abort_like_handler);
         SignalHandlerHandler sigterm_handler(SIGTERM, abort_like_handler);
 
+        // One round (integration cycle) of a system, together with its sampling and output
+        auto run_round = [&](System& sys, int ns) {
+            int nr = sys.round_num;
+
+            // Don't pivot at t=0 so that a partially strained system may relax before the
+            // first pivot
+            if(nr && mc_interval && !(nr%mc_interval)) 
+                sys.mc_samplers.execute(sys.random_seed, nr, sys.temperature, sys.engine);
+
+            if(!frame_interval || !(nr%frame_interval)) {
+                if(do_recenter) recenter(sys.engine.pos->output, xy_recenter_only, sys.n_atom);
+                sys.engine.compute(PotentialAndDerivMode);
+                sys.logger->collect_samples();
+
+                double Rg = 0.f;
+                float3 com = make_vec3(0.f, 0.f, 0.f);
+                for(int na=0; na<sys.n_atom; ++na)
+                    com += load_vec<3>(sys.engine.pos->output, na);
+                com *= 1.f/sys.n_atom;
+
+                for(int na=0; na<sys.n_atom; ++na) 
+                    Rg += mag2(load_vec<3>(sys.engine.pos->output,na)-com);
+                Rg = sqrtf(Rg/sys.n_atom);
+
+                if(verbose) printf(
+                        "%*.0f / %*.0f elapsed %2i system %.2f temp %5.1f hbonds, Rg %5.1f A, potential % 8.2f\n", 
+                        duration_print_width, nr*3*double(dt), 
+                        duration_print_width, duration, 
+                        ns, sys.temperature,
+                        get_n_hbond(sys.engine), Rg, sys.engine.potential);
+                fflush(stdout);
+            }
+
+            bool thermostat_now = !(nr%thermostat_interval);
+            if(thermostat_now) {
+                // Handle simulated annealing if applicable
+                if(anneal_factor != 1.)
+                    sys.set_temperature(anneal_temp(sys.initial_temperature, 3*dt*(sys.round_num+1)));
+            }
+            // the thermostat is applied in the first momentum update of the cycle
+            sys.engine.integration_cycle(sys.mom, dt, 0.f, DerivEngine::Verlet,
+                    thermostat_now ? &sys.thermostat : nullptr);
+        };
+
         // we need to run everyone until the next synchronization event
         // a little care is needed if we are multiplexing the events
         auto tstart = chrono::high_resolution_clock::now();
+        uint64_t first_round = systems[0].round_num;
         while(systems[0].round_num < n_round && received_signal==NO_SIGNAL) {
-            int last_start = systems[0].round_num;
-            #pragma omp parallel for schedule(static,1)
+            #pragma omp parallel for schedule(static,1) num_threads(n_replica_threads)
             for(int ns=0; ns<int(systems.size()); ++ns) {
                 System& sys = systems[ns];
                 for(bool do_break=false; (!do_break) && (sys.round_num<n_round); ++sys.round_num) {
@@ -625,61 +903,56 @@ try {
                     // performance cost on a NUMA machine
                     if((nr%8==ns%8) && received_signal!=NO_SIGNAL) break;
 
-                    // Don't pivot at t=0 so that a partially strained system may relax before the
-                    // first pivot
-                    if(nr && mc_interval && !(nr%mc_interval)) 
-                        sys.mc_samplers.execute(sys.random_seed, nr, sys.temperature, sys.engine);
-
-                    if(!frame_interval || !(nr%frame_interval)) {
-                        if(do_recenter) recenter(sys.engine.pos->output, xy_recenter_only, sys.n_atom);
-                        sys.engine.compute(PotentialAndDerivMode);
-                        sys.logger->collect_samples();
-
-                        double Rg = 0.f;
-                        float3 com = make_vec3(0.f, 0.f, 0.f);
-                        for(int na=0; na<sys.n_atom; ++na)
-                            com += load_vec<3>(sys.engine.pos->output, na);
-                        com *= 1.f/sys.n_atom;
-
-                        for(int na=0; na<sys.n_atom; ++na) 
-                            Rg += mag2(load_vec<3>(sys.engine.pos->output,na)-com);
-                        Rg = sqrtf(Rg/sys.n_atom);
-
-                        if(verbose) printf(
-                                "%*.0f / %*.0f elapsed %2i system %.2f temp %5.1f hbonds, Rg %5.1f A, potential % 8.2f\n", 
-                                duration_print_width, nr*3*double(dt), 
-                                duration_print_width, duration, 
-                                ns, sys.temperature,
-                                get_n_hbond(sys.engine), Rg, sys.engine.potential);
-                        fflush(stdout);
-                    }
-
-                    if(!(nr%thermostat_interval)) {
-                        // Handle simulated annealing if applicable
-                        if(anneal_factor != 1.)
-                            sys.set_temperature(anneal_temp(sys.initial_temperature, 3*dt*(sys.round_num+1)));
-                        sys.thermostat.apply(sys.mom, sys.n_atom);
-                    }
-                    sys.engine.integration_cycle(sys.mom, dt, 0.f, DerivEngine::Verlet);
-
-                    do_break = nr>last_start && replica_interval && !((nr+1)%replica_interval);
+                    run_round(sys, ns);
+
+                    do_break = (sys.round_num>last_start && replica_interval && !((nr+1)%replica_interval)) ||
+                               (checkpoint_interval && !((nr+1)%checkpoint_interval));
                 }
             }
             // Here we are running in serial again
-            if(received_signal!=NO_SIGNAL) break;
 
-            if(replica_interval && !(systems[0].round_num % replica_interval))
+            if(received_signal!=NO_SIGNAL) {
+                // The systems notice the signal at different rounds, but none passes the next
+                // synchronization event.  Bring them all to the latest stopped round so that the
+                // final checkpoint is a consistent state of the uninterrupted run.
+                uint64_t stop_round = 0;
+                for(auto& sys: systems) stop_round = max(stop_round, sys.round_num);
+
+                #pragma omp parallel for schedule(static,1) num_threads(n_replica_threads)
+                for(int ns=0; ns<int(systems.size()); ++ns) {
+                    System& sys = systems[ns];
+                    for(; sys.round_num<stop_round; ++sys.round_num) run_round(sys, ns);
+                }
+            }
+
+            // after an early termination the systems may still be at the round of the last swap
+            if(replica_interval && !(systems[0].round_num % replica_interval) &&
+                    systems[0].round_num > last_start) {
                 replex->attempt_swaps(base_random_seed, systems[0].round_num, systems);
+                last_start = systems[0].round_num;
+            }
+
+            if(checkpoint_interval && !(systems[0].round_num % checkpoint_interval)) {
+                // flush the loggers so that the output on disk is consistent with the checkpoint
+                for(auto& sys: systems) sys.logger->flush();
+                write_checkpoint(checkpoint_path, systems, replex.get(), base_random_seed, last_start);
+            }
+
+            if(received_signal!=NO_SIGNAL) break;
         }
         if(received_signal!=NO_SIGNAL) {fprintf(stderr, "Received early termination signal\n");}
+        if(checkpoint_path.size()) {
+            // all systems are at the same round here, even after an early termination
+            write_checkpoint(checkpoint_path, systems, replex.get(), base_random_seed, last_start);
+        }
         for(auto& sys: systems) sys.logger = shared_ptr<H5Logger>(); // release shared_ptr, which also flushes data during destructor
 
         auto elapsed = chrono::duration<double>(std::chrono::high_resolution_clock::now() - tstart).count();
         if(verbose)
             printf("\n\nfinished in %.1f seconds (%.2f us/systems/step, %.1e simulation_time_unit/hour)\n",
                 elapsed,
-                elapsed*1e6/systems.size()/systems[0].round_num/3, 
-                systems[0].round_num*3*dt/elapsed * 3600.);
+                elapsed*1e6/systems.size()/(systems[0].round_num-first_round)/3, 
+                (systems[0].round_num-first_round)*3*dt/elapsed * 3600.);
 
         if(verbose) printf("\navg_kinetic_energy/1.5kT");
         for(auto& sys: systems) {
@@ -22,7 +22,7 @@ struct PivotSampler : public MonteCarloSampler {
 
     PivotSampler(const std::string& grp_name, hid_t grp, H5Logger& logger); // Constructor declaration
 
-    void propose_random_move(float* delta_lprob, 
+    void propose_random_move(float* delta_lprob, std::vector<index_t>& moved_atoms,
         RandomGenerator& random, VecArray pos) const;
 };
 
@@ -77,7 +77,7 @@ PivotSampler::PivotSampler(const std::string& name, hid_t grp, H5Logger& logger)
     }
 }
 
-void PivotSampler::propose_random_move(float* delta_lprob, 
+void PivotSampler::propose_random_move(float* delta_lprob, std::vector<index_t>& moved_atoms,
     	RandomGenerator& random, VecArray pos) const {
     Timer timer(std::string("random_pivot"));
     float4 random_values = random.uniform_open_closed();
@@ -135,6 +135,7 @@ void PivotSampler::propose_random_move(float* delta_lprob,
         float3 after_psi = psi_origin + apply_rotation(psi_U, y        -psi_origin); // unnecessary but harmless
         float3 after_phi = phi_origin + apply_rotation(phi_U, after_psi-phi_origin);
         store_vec(pos, p.rama_atom[3], after_phi);
+        moved_atoms.push_back(p.rama_atom[3]);
     }
 
     {
@@ -142,6 +143,7 @@ void PivotSampler::propose_random_move(float* delta_lprob,
         float3 after_psi = psi_origin + apply_rotation(psi_U, y        -psi_origin);
         float3 after_phi = phi_origin + apply_rotation(phi_U, after_psi-phi_origin);
         store_vec(pos, p.rama_atom[4], after_phi);
+        moved_atoms.push_back(p.rama_atom[4]);
     }
 
     for(int na=p.pivot_range[0]; na<p.pivot_range[1]; ++na) {
@@ -149,6 +151,7 @@ void PivotSampler::propose_random_move(float* delta_lprob,
         float3 after_psi = psi_origin + apply_rotation(psi_U, y        -psi_origin);
         float3 after_phi = phi_origin + apply_rotation(phi_U, after_psi-phi_origin);
         store_vec(pos, na, after_phi);
+        moved_atoms.push_back(na);
     }
 
     *delta_lprob = new_lprob - old_lprob;
@@ -168,7 +171,7 @@ struct JumpSampler : public MonteCarloSampler {
 
     JumpSampler(const std::string& grp_name, hid_t grp, H5Logger& logger); // Constructor declaration
 
-    void propose_random_move(float* delta_lprob, 
+    void propose_random_move(float* delta_lprob, std::vector<index_t>& moved_atoms,
         RandomGenerator& random, VecArray pos) const;
 };
 
@@ -200,7 +203,7 @@ JumpSampler::JumpSampler(const std::string& name, hid_t grp, H5Logger& logger):
         jump_chains[ns].sigma_rot = x; });
 }
 
-void JumpSampler::propose_random_move(float* delta_lprob, 
+void JumpSampler::propose_random_move(float* delta_lprob, std::vector<index_t>& moved_atoms,
         RandomGenerator& random, VecArray pos) const {
     Timer timer(std::string("random_jump"));
 
@@ -212,6 +215,7 @@ void JumpSampler::propose_random_move(float* delta_lprob,
     int chain = int(n_jump_chains * rand_type_val.w());
     if(chain == n_jump_chains) chain--;  // this may occur due to rounding
     const auto& j = jump_chains[chain];
+    for(int na=j.first_atom; na<j.next_first; ++na) moved_atoms.push_back(na);
 
     if (jump_move_type == 0) { // translation
         // pick a random jump translation
@@ -263,13 +267,14 @@ void MonteCarloSampler::monte_carlo_step(
     auto &pos = engine.pos->output;
     VecArrayStorage pos_copy(pos);
     float delta_lprob;
+    std::vector<index_t> moved_atoms;
 
-    engine.compute(PotentialAndDerivMode);
     float old_potential = engine.potential;
 
-    propose_random_move(&delta_lprob, random, pos);
+    propose_random_move(&delta_lprob, moved_atoms, random, pos);
 
-    engine.compute(PotentialAndDerivMode);
+    // only the nodes that depend on the moved atoms are re-evaluated
+    engine.compute_incremental(moved_atoms);
     float new_potential = engine.potential;
 
     float lboltz_diff = delta_lprob - (1.f/temperature) * (new_potential-old_potential);
@@ -280,12 +285,15 @@ void MonteCarloSampler::monte_carlo_step(
     } else {
         // If we reject the move, we must reverse it
         copy(pos_copy, pos);
+        engine.compute_incremental(moved_atoms);
     }
 }
 
 // ===[Multiple Monte Carlo Sampler Definitions]===
 
 void MultipleMonteCarloSampler::execute(uint32_t seed, uint64_t round, const float temperature, DerivEngine& engine) {
+    if(!samplers.size()) return;
+    engine.compute(PotentialOnlyMode);  // monte_carlo_step requires a current potential
     for (auto& s: samplers) s->monte_carlo_step(seed, round, temperature, engine);
 }
 
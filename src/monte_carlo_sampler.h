@@ -36,8 +36,12 @@ struct MonteCarloSampler {
                 });
     }
 
-    virtual void propose_random_move(float* delta_lprob, RandomGenerator& random, VecArray pos) const = 0;
+    // moved_atoms must be filled with the indices of all atoms changed by the move
+    virtual void propose_random_move(float* delta_lprob, std::vector<index_t>& moved_atoms,
+            RandomGenerator& random, VecArray pos) const = 0;
 
+    // engine.potential must be current for the engine positions before the call,
+    // and it remains current afterward
     void monte_carlo_step(uint32_t seed, uint64_t round, const float temperature,
             DerivEngine& engine);
 };
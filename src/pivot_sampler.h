@@ -177,12 +177,12 @@ struct PivotSampler {
         VecArrayStorage pos_copy(pos);
         float delta_lprob;
 
-        engine.compute(PotentialAndDerivMode);
+        engine.compute(PotentialOnlyMode);
         float old_potential = engine.potential;
 
         execute_random_pivot(&delta_lprob, seed, round, pos);
 
-        engine.compute(PotentialAndDerivMode);
+        engine.compute(PotentialOnlyMode);
         float new_potential = engine.potential;
 
         float lboltz_diff = delta_lprob - (1.f/temperature) * (new_potential-old_potential);
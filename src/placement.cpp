@@ -29,6 +29,7 @@ struct RamaPlacement {
     vector<Params> params;
     LayeredPeriodicSpline2D<n_pos_dim> spline;
     VecArrayStorage rama_deriv;
+    ChangeMap rama_to_elem;
 
     RamaPlacement(hid_t grp, CoordNode& rama_):
         rama(rama_),
@@ -38,7 +39,8 @@ struct RamaPlacement {
                 get_dset_size(4, grp, "placement_data")[0],
                 get_dset_size(4, grp, "placement_data")[1],
                 get_dset_size(4, grp, "placement_data")[2]),
-        rama_deriv(2*n_pos_dim, n_elem) // first is all phi deriv then all psi deriv
+        rama_deriv(2*n_pos_dim, n_elem), // first is all phi deriv then all psi deriv
+        rama_to_elem(rama.n_elem)
     {
         check_size(grp, "layer_index",    n_elem);
         check_size(grp, "rama_residue",   n_elem);
@@ -46,6 +48,7 @@ struct RamaPlacement {
 
         traverse_dset<1,int>(grp, "layer_index",    [&](size_t np, int x){params[np].layer_idx  = x;});
         traverse_dset<1,int>(grp, "rama_residue",   [&](size_t np, int x){params[np].rama_residue  = x;});
+        for(int ne: range(n_elem)) rama_to_elem.add(params[ne].rama_residue, ne);
 
         {
             vector<double> all_data_to_fit;
@@ -57,6 +60,13 @@ struct RamaPlacement {
 
     void reset() {}
 
+    // add elements whose placement changed to elems, or return false if all may have changed
+    bool collect_changed(std::vector<index_t>& elems) {
+        if(rama.all_changed) return false;
+        rama_to_elem.collect(elems, rama);
+        return true;
+    }
+
     Vec<n_pos_dim> evaluate(int ne) {
         const float scale_x = spline.nx * (0.5f/M_PI_F - 1e-7f);
         const float scale_y = spline.ny * (0.5f/M_PI_F - 1e-7f);
@@ -136,6 +146,8 @@ struct FixedPlacement {
         #endif
     }
 
+    bool collect_changed(std::vector<index_t>& elems) {return true;}
+
     Vec<n_pos_dim> evaluate(int ne) {
         return load_vec<n_pos_dim>(data, params[ne].layer_idx);
     }
@@ -239,17 +251,20 @@ struct PlacementNode: public CoordNode
     CoordNode& alignment;
 
     vector<index_t> affine_residue;
+    ChangeMap affine_to_elem;
 
     template<typename ... Args>
     PlacementNode(hid_t grp, CoordNode& alignment_, Args& ... placement_arguments):
         CoordNode(get_dset_size(1,grp,"layer_index")[0], n_pos_dim),
         placement_data(grp, placement_arguments...),
         alignment(alignment_),
-        affine_residue(n_elem)
+        affine_residue(n_elem),
+        affine_to_elem(alignment.n_elem)
     {
         // static_assert(n_pos_dim == decltype(placement_data.evaluate(0)), "inconsistent n_pos_dim");
         check_size(grp, "affine_residue", n_elem);
         traverse_dset<1,int>(grp, "affine_residue", [&](size_t np, int x){affine_residue[np] = x;});
+        for(int ne: range(n_elem)) affine_to_elem.add(affine_residue[ne], ne);
 
         if(logging(LOG_EXTENSIVE)) {
             // FIXME prepend the logging with the class name for disambiguation
@@ -261,23 +276,31 @@ struct PlacementNode: public CoordNode
         }
     }
 
-    virtual void compute_value(ComputeMode mode) {
-        Timer timer(string("placement"));
-
+    void place(int ne) {
         VecArray affine_pos = alignment.output;
         VecArray pos        = output;
 
-        placement_data.reset();
+        auto aff = load_vec<7>(affine_pos, affine_residue[ne]);
+        auto t   = extract<0,3>(aff);
+        float U[9]; quat_to_rot(U, aff.v+3);
 
-        for(int ne: range(n_elem)) {
-            auto aff = load_vec<7>(affine_pos, affine_residue[ne]);
-            auto t   = extract<0,3>(aff);
-            float U[9]; quat_to_rot(U, aff.v+3);
+        Vec<n_pos_dim> val = placement_data.evaluate(ne);
 
-            Vec<n_pos_dim> val = placement_data.evaluate(ne);
+        do_transformations<0, signature...>(U,t, val.v, &pos(0,ne));
+    }
 
-            do_transformations<0, signature...>(U,t, val.v, &pos(0,ne));
-        }
+    virtual void compute_value(ComputeMode mode) {
+        Timer timer(string("placement"));
+
+        placement_data.reset();
+        for(int ne: range(n_elem)) place(ne);
+    }
+
+    virtual bool compute_value_incremental() override {
+        if(alignment.all_changed || !placement_data.collect_changed(changed_elems)) return false;
+        affine_to_elem.collect(changed_elems, alignment);
+        for(auto ne: changed_elems) place(ne);
+        return true;
     }
 
     virtual void propagate_deriv() {
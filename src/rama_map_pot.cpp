@@ -20,6 +20,8 @@ struct RamaMapPot : public PotentialNode
     LayeredPeriodicSpline2D<1> rama_map_data;
     vector<float> residue_potential;
     bool log_pot; // if false, never log potential
+    ChangeMap rama_to_residue;
+    vector<index_t> changed_residues;
 
     RamaMapPot(hid_t grp, CoordNode& rama_):
         PotentialNode(),
@@ -31,7 +33,8 @@ struct RamaMapPot : public PotentialNode
                 get_dset_size(3, grp, "rama_pot")[1], 
                 get_dset_size(3, grp, "rama_pot")[2]),
         residue_potential(n_residue),
-        log_pot(read_attribute<int>(grp,".","log_pot",1))
+        log_pot(read_attribute<int>(grp,".","log_pot",1)),
+        rama_to_residue(rama.n_elem)
     {
         auto& r = rama_map_data;
         check_size(grp, "residue_id",     n_residue);
@@ -46,6 +49,7 @@ struct RamaMapPot : public PotentialNode
         traverse_dset<3,double>(grp, "rama_pot",    [&](size_t il, size_t ix, size_t iy, double x) {
                 raw_data[(il*r.nx + ix)*r.ny + iy] = x;});
         r.fit_spline(raw_data.data());
+        for(int nr=0; nr<n_residue; ++nr) rama_to_residue.add(params[nr].residue, nr);
 
         if(log_pot && logging(LOG_DETAILED))
             default_logger->add_logger<float>("rama_map_potential", {n_residue}, [&](float* buffer) {
@@ -54,33 +58,49 @@ struct RamaMapPot : public PotentialNode
                     });
     }
 
+    float compute_residue(int nr, VecArray ramac, VecArray rama_sens) {
+        // add a litte paranoia to make sure there are no rounding problems
+        const float scale = rama_map_data.nx * (0.5f/M_PI_F - 1e-7f);
+        const float shift = M_PI_F;
+
+        const auto& p = params[nr];
+        auto r = load_vec<2>(ramac, p.residue);
+
+        float value,dx,dy;
+        rama_map_data.evaluate_value_and_deriv(&value,&dx,&dy, p.rama_map_id, 
+                (r.v[0]+shift)*scale, (r.v[1]+shift)*scale);
+
+        rama_sens(0,p.residue) += dx * scale;
+        rama_sens(1,p.residue) += dy * scale;
+        return value;
+    }
+
     virtual void compute_value(ComputeMode mode) override {
         Timer timer(string("rama_map_pot"));
 
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = mode!=DerivMode ? &potential : nullptr;
         VecArray ramac     = rama.output;
         VecArray rama_sens = rama.sens;
-        if(pot) *pot = 0.f;
-
-        // add a litte paranoia to make sure there are no rounding problems
-        const float scale = rama_map_data.nx * (0.5f/M_PI_F - 1e-7f);
-        const float shift = M_PI_F;
 
         if(pot) *pot = 0.f;
         for(int nr=0; nr<n_residue; ++nr) {
-            const auto& p = params[nr];
-            auto r = load_vec<2>(ramac, p.residue);
-
-            float value,dx,dy;
-            rama_map_data.evaluate_value_and_deriv(&value,&dx,&dy, p.rama_map_id, 
-                    (r.v[0]+shift)*scale, (r.v[1]+shift)*scale);
-
+            float value = compute_residue(nr, ramac, rama_sens);
             if(pot) {*pot += value; residue_potential[nr] = value;}
-            rama_sens(0,p.residue) += dx * scale;
-            rama_sens(1,p.residue) += dy * scale;
         }
     }
 
+    virtual bool compute_value_incremental() override {
+        if(rama.all_changed) return false;
+        changed_residues.clear();
+        rama_to_residue.collect(changed_residues, rama);
+        for(auto nr: changed_residues) {
+            potential -= residue_potential[nr];
+            residue_potential[nr] = compute_residue(nr, rama.output, rama.sens);
+            potential += residue_potential[nr];
+        }
+        return true;
+    }
+
 #ifdef PARAM_DERIV
     virtual void set_param(const std::vector<float>& new_param) override {
         auto& r = rama_map_data;
@@ -6,6 +6,7 @@
 
 #include "uniform.hpp"
 #include "boxmuller.hpp"
+#include "Float4.h"
 
 // if you want random numbers, you need to add a new entry so that no one else
 // overlaps your random stream
@@ -66,4 +67,73 @@ struct RandomGenerator
         };
 };
 
+template <int N, typename I>
+inline I rotate_left32(const I& x) {return x.sll(N) | x.srl(32-N);}
+
+// even rounds of Threefry-4x32 mix words (0,1) and (2,3), odd rounds mix (0,3) and (2,1)
+template <int R0, int R1, typename I>
+inline void threefry4x32_mix_even(I x[4]) {
+    x[0] = x[0] + x[1]; x[1] = rotate_left32<R0>(x[1]) ^ x[0];
+    x[2] = x[2] + x[3]; x[3] = rotate_left32<R1>(x[3]) ^ x[2];
+}
+
+template <int R0, int R1, typename I>
+inline void threefry4x32_mix_odd(I x[4]) {
+    x[0] = x[0] + x[3]; x[3] = rotate_left32<R0>(x[3]) ^ x[0];
+    x[2] = x[2] + x[1]; x[1] = rotate_left32<R1>(x[1]) ^ x[2];
+}
+
+// Threefry-4x32-20 for one counter per SIMD lane under a shared key.  Each lane gives
+// exactly threefry4x32(ctr,key), so random streams do not depend on the lane width.
+template <typename I>
+inline void threefry4x32_lanes(I x[4], const threefry4x32_key_t& k)
+{
+    uint32_t ks[5];
+    ks[4] = 0x1BD11BDA;
+    for(int i=0; i<4; ++i) {ks[i] = k.v[i]; ks[4] ^= k.v[i];}
+    for(int i=0; i<4; ++i) x[i] = x[i] + I(int(ks[i]));
+
+    // key injection after every 4 rounds, with the rotation constants alternating
+    // between two sets of 4 rounds
+    for(int s=1; s<=5; ++s) {
+        if(s%2) {
+            threefry4x32_mix_even<10,26>(x); threefry4x32_mix_odd<11,21>(x);
+            threefry4x32_mix_even<13,27>(x); threefry4x32_mix_odd<23, 5>(x);
+        } else {
+            threefry4x32_mix_even< 6,20>(x); threefry4x32_mix_odd<17,11>(x);
+            threefry4x32_mix_even<25,10>(x); threefry4x32_mix_odd<18,20>(x);
+        }
+        for(int i=0; i<4; ++i) x[i] = x[i] + I(int(ks[(s+i)%5]));
+        x[3] = x[3] + I(s);
+    }
+}
+
+// Same values as RandomGenerator(seed, generator_id, first_atom+i, timestep).normal3()
+// for each lane i<W.  Only the counters are vectorized; the Box-Muller transform is
+// the scalar one so that the normals are bitwise identical.
+template <int W>
+inline void normal3_lanes(float3* result, uint32_t seed, uint32_t generator_id,
+        uint32_t first_atom, uint64_t timestep)
+{
+    typedef typename SimdLanes<W>::Int I;
+
+    threefry4x32_key_t k = {{seed, generator_id, 0u, 0u}};
+
+    alignas(32) int32_t atom[W];
+    for(int i=0; i<W; ++i) atom[i] = first_atom+i;
+
+    uint64_t mask = 0xffffffff;
+    I x[4] = {I(int(timestep & mask)), I(int((timestep>>32) & mask)), I(atom), I(0)};
+    threefry4x32_lanes(x, k);
+
+    alignas(32) uint32_t bits[4][W];
+    for(int j=0; j<4; ++j) x[j].store((int32_t*)bits[j]);
+
+    for(int i=0; i<W; ++i) {
+        r123::float2 n1 = r123::boxmuller(bits[0][i], bits[1][i]);
+        r123::float2 n2 = r123::boxmuller(bits[2][i], bits[3][i]);
+        result[i] = make_vec3(n1.x, n1.y, n2.x);
+    }
+}
+
 #endif
@@ -12,6 +12,7 @@
 #include <set>
 #include "Float4.h"
 #include <functional>
+#include <numeric>
 
 using namespace std;
 using namespace h5;
@@ -134,10 +135,10 @@ struct PaddedMatrix {
 struct EdgeLocator {
     protected:
         int data_size;   // 2*max_partners, must be divisible by 8
-        unique_ptr<int32_t[]> locs;
+        aligned_ptr<int32_t> locs;
 
         void resize(int new_data_size) {
-            auto new_locs = unique_ptr<int32_t[]>(new_aligned<int32_t>(n_elem1*new_data_size,4));
+            auto new_locs = new_aligned<int32_t>(n_elem1*new_data_size,4);
 
             int copy_size = min(data_size, new_data_size);
             for(int ne=0; ne<n_elem1; ++ne) {
@@ -203,6 +204,25 @@ struct EdgeLocator {
             resize(2*data_size);
             return find_or_insert(result, i1,i2);
         }
+
+        bool find(int32_t &result, int32_t i1, int32_t i2) const {
+            // return value is false if there is no edge between i1 and i2
+            const int* partner_array = locs + int(i1*data_size);
+            auto constant_i2   = Int4(i2);
+            auto constant_umax = Int4(-1);
+
+            for(int j=0; j<data_size; j+=8) {
+                auto candidate_i2 = Int4(partner_array+j);
+                auto hits = (constant_i2==candidate_i2);
+                if(hits.any()) {
+                    auto hit_loc = Int4(partner_array+j+4) & hits;
+                    result = hit_loc.sum_in_all_entries().x();
+                    return true;
+                }
+                if((constant_umax == candidate_i2).movemask()) return false;
+            }
+            return false;
+        }
 };
 
 
@@ -216,7 +236,19 @@ struct NodeHolder {
     VecArrayStorage cur_belief;
     VecArrayStorage old_belief;
 
-    unique_ptr<float[]> energy_offset;
+    aligned_ptr<float> energy_offset;
+
+    // Incoming edge messages of each node for the parallel belief update (see
+    // RotamerSidechain::calculate_new_beliefs), in the order that EdgeHolder::update_beliefs
+    // multiplies them into the node belief.  The offset is into the rows of belief.
+    struct Message {const VecArrayStorage* belief; int offset;};
+    vector<int32_t> inbox_start;
+    vector<Message> inbox;
+    vector<int32_t> inbox_msg;  // message number of each inbox entry for the residual schedule
+
+    // Converged beliefs of the last solve that updated the warm start (see
+    // RotamerSidechain::solve_for_marginals)
+    vector<float> warm_belief;
 
     NodeHolder(int n_rot_, int n_elem_):
         n_rot(n_rot_),
@@ -236,6 +268,15 @@ struct NodeHolder {
     void reset() { fill(prob, 0.f); } // prob array initially contains energy
     void swap_beliefs() { swap(cur_belief, old_belief); }
 
+    void save_warm_start() {
+        warm_belief.assign(cur_belief.x.get(), cur_belief.x.get()+n_elem*cur_belief.row_width);
+    }
+
+    void load_warm_start() {
+        if(warm_belief.size() == size_t(n_elem*old_belief.row_width))
+            copy(begin(warm_belief), end(warm_belief), old_belief.x.get());
+    }
+
     void convert_energy_to_prob(float e_cap, float e_cap_width) {
         // prob array should initially contain energy
         // prob array is not normalized at the end (one of the entries will be 1.),
@@ -257,19 +298,31 @@ struct NodeHolder {
 
     template <int N_ROT>
         void standardize_belief_update(float damping) {
+            for(int ne: range(n_elem)) standardize_belief_update<N_ROT>(damping, ne);
+        }
+
+    template <int N_ROT>
+        void standardize_belief_update(float damping, int ne) {
+            auto b = load_vec<N_ROT>(cur_belief, ne);
             if(damping != 0.f) {
-                for(int ne: range(n_elem)) {
-                    auto b = load_vec<N_ROT>(cur_belief, ne);
-                    b = (1.f-damping)*rcp(max(b))*b + damping*load_vec<N_ROT>(old_belief, ne);
-                    store_vec(cur_belief, ne, b);
-                }
+                b = (1.f-damping)*rcp(max(b))*b + damping*load_vec<N_ROT>(old_belief, ne);
             } else {  // zero damping should not keep any info, even NaN from previous iteration
-                for(int ne: range(n_elem)) {
-                    auto b = load_vec<N_ROT>(cur_belief, ne);
-                    b = rcp(max(b))*b;
-                    store_vec(cur_belief, ne, b);
-                }
+                b = rcp(max(b))*b;
             }
+            store_vec(cur_belief, ne, b);
+        }
+
+    // Node half of EdgeHolder::update_beliefs for node nn, after the edges have computed their
+    // messages with compute_message.  Each node is independent, so this may run in parallel.
+    template <int N_ROT>
+        void accumulate_messages(int nn) {
+            constexpr const int w = (N_ROT+3)/4;
+            auto b = read4vec<w>(prob.x + nn*4*w);
+            for(int i=inbox_start[nn]; i<inbox_start[nn+1]; ++i) {
+                b = read4vec<w>(inbox[i].belief->x + inbox[i].offset) * b;
+                b *= rcp(sum(b).sum_in_all_entries());
+            }
+            store4vec<w>(cur_belief.x + nn*4*w, b);
         }
 
     float max_deviation() {
@@ -303,6 +356,8 @@ struct NodeHolder {
 };
 
 constexpr static int simd_width = 4;
+// edges per batch of the message kernels (see EdgeHolder::compute_message_lanes)
+constexpr static int message_lanes = max_simd_width;
 
 struct EdgeHolder {
     public:
@@ -319,27 +374,37 @@ struct EdgeHolder {
         VecArrayStorage old_belief;
         VecArrayStorage marginal;
 
-        unique_ptr<int[]> edge_indices1;
-        unique_ptr<int[]> edge_indices2;
+        aligned_ptr<int> edge_indices1;
+        aligned_ptr<int> edge_indices2;
+        int max_n_edge;  // capacity of the edge arrays, which grow as needed
         // unordered_map<unsigned,unsigned> nodes_to_edge;
         EdgeLocator nodes_to_edge;
         vector<EdgeLoc> edge_loc;
 
-        EdgeHolder(NodeHolder &nodes1_, NodeHolder &nodes2_, int max_n_edge):
+        // Converged messages of the last solve that updated the warm start, keyed by the node
+        // pair of the edge since edge numbers change at every fill
+        vector<int32_t> warm_indices1;
+        vector<int32_t> warm_indices2;
+        vector<float>   warm_belief;
+        EdgeLocator     warm_nodes_to_edge;
+
+        EdgeHolder(NodeHolder &nodes1_, NodeHolder &nodes2_, int max_n_edge_):
             n_rot1(nodes1_.n_rot), n_rot2(nodes2_.n_rot),
             nodes1(nodes1_), nodes2(nodes2_),
-            prob      (n_rot1*ru(n_rot2),     max_n_edge+3),
-            cur_belief(ru(n_rot1)+ru(n_rot2), max_n_edge+3),
-            old_belief(ru(n_rot1)+ru(n_rot2), max_n_edge+3),
-            marginal(n_rot1*n_rot2,           max_n_edge+3), // the +1 ensures we can write past the end
+            prob      (n_rot1*ru(n_rot2),     max_n_edge_+3),
+            cur_belief(ru(n_rot1)+ru(n_rot2), max_n_edge_+3),
+            old_belief(ru(n_rot1)+ru(n_rot2), max_n_edge_+3),
+            marginal(n_rot1*n_rot2,           max_n_edge_+3), // the +1 ensures we can write past the end
 
-            edge_indices1(new_aligned<int>(max_n_edge,simd_width)),
-            edge_indices2(new_aligned<int>(max_n_edge,simd_width)),
+            edge_indices1(new_aligned<int>(max_n_edge_,simd_width)),
+            edge_indices2(new_aligned<int>(max_n_edge_,simd_width)),
+            max_n_edge(max_n_edge_),
 
-            nodes_to_edge(nodes1.n_elem)
+            nodes_to_edge(nodes1.n_elem),
+            warm_nodes_to_edge(nodes1.n_elem)
         {
 
-            edge_loc.reserve(n_rot1*n_rot2*max_n_edge);
+            edge_loc.reserve(max_n_edge);
             fill(cur_belief, 0.f);
             fill(old_belief, 0.f);
             fill_n(edge_indices1, round_up(max_n_edge,simd_width), 0);
@@ -360,12 +425,67 @@ struct EdgeHolder {
         }
         void swap_beliefs() { swap(cur_belief, old_belief); }
 
+        void save_warm_start() {
+            int n_edge = nodes_to_edge.n_edge;
+            warm_indices1.assign(edge_indices1.get(), edge_indices1.get()+n_edge);
+            warm_indices2.assign(edge_indices2.get(), edge_indices2.get()+n_edge);
+            warm_belief.assign(cur_belief.x.get(), cur_belief.x.get()+n_edge*cur_belief.row_width);
+            index_warm_start();
+        }
+
+        void index_warm_start() {
+            // warm edge numbers are the insertion order, matching the rows of warm_belief
+            warm_nodes_to_edge.clear();
+            int32_t idx;
+            for(int ne: range(int(warm_indices1.size())))
+                warm_nodes_to_edge.find_or_insert(idx, warm_indices1[ne], warm_indices2[ne]);
+        }
+
+        int load_warm_start() {
+            // Edges that were not present at the last save keep their cold start messages.
+            // Returns the number of edges that were warm started.
+            int w = old_belief.row_width;
+            int n_found = 0;
+            for(int ne: range(nodes_to_edge.n_edge)) {
+                int32_t idx;
+                if(warm_nodes_to_edge.find(idx, edge_indices1[ne], edge_indices2[ne])) {
+                    copy_n(warm_belief.data()+idx*w, w, old_belief.x+ne*w);
+                    ++n_found;
+                }
+            }
+            return n_found;
+        }
+
+        void grow(int new_max_n_edge) {
+            // Existing edges are kept.  New edges are zeroed, as at construction, and
+            // their probabilities are set to 1 (the padding between rows must stay 0).
+            auto extend = [&](VecArrayStorage& v) {
+                VecArrayStorage new_v(v.row_width, new_max_n_edge+3);
+                std::copy_n(v.x.get(), max_n_edge*v.row_width, new_v.x.get());
+                v.n_elem = new_v.n_elem;
+                v.x = std::move(new_v.x);
+            };
+            extend(prob);
+            extend(cur_belief);
+            extend(old_belief);
+            extend(marginal);
+            for(int idx=max_n_edge; idx<new_max_n_edge; ++idx)
+                for(int i: range(n_rot1))
+                    for(int j: range(n_rot2))
+                        prob(i*ru(n_rot2)+j,idx) = 1.f;
+
+            grow_aligned(edge_indices1, max_n_edge, new_max_n_edge, simd_width);
+            grow_aligned(edge_indices2, max_n_edge, new_max_n_edge, simd_width);
+            max_n_edge = new_max_n_edge;
+        }
+
         void add_to_edge(
                 int ne, float prob_val,
                 unsigned id1, unsigned rot1, 
                 unsigned id2, unsigned rot2) {
             int32_t idx;
             if(nodes_to_edge.find_or_insert(idx,id1,id2)){
+                if(idx >= max_n_edge) grow(round_up(2*max_n_edge, simd_width));
                 edge_indices1[idx] = id1;
                 edge_indices2[idx] = id2;
             }
@@ -457,31 +577,21 @@ struct EdgeHolder {
                 constexpr const int ws = w1+w2;
                 // horizontal SIMD implementation of update_beliefs for N_ROT1==N_ROT2==3
 
-                float* vec_old_node_belief1 = nodes1.old_belief.x.get();
                 float* vec_cur_node_belief1 = nodes1.cur_belief.x.get();
-
-                float* vec_old_node_belief2 = nodes2.old_belief.x.get();
                 float* vec_cur_node_belief2 = nodes2.cur_belief.x.get();
 
                 int n_edge = nodes_to_edge.n_edge;
 
+                // The messages only depend on the old beliefs, so they are all computed first with
+                // the multi-edge kernel
+                for(int ne=0; ne<n_edge; ne+=message_lanes) compute_message_batch<N_ROT1,N_ROT2>(ne);
+
                 for(int ne=0; ne<n_edge; ++ne) {
                     int i1 = edge_indices1[ne]*4*w1;
                     int i2 = edge_indices2[ne]*4*w2;
 
-                    auto old_edge_belief1 = read4vec<w1>(old_belief.x + ne*4*ws + 0);
-                    auto old_edge_belief2 = read4vec<w2>(old_belief.x + ne*4*ws + 4*w1);
-
-                    auto old_node_belief1 = read4vec<w1>(vec_old_node_belief1 + i1);
-                    auto old_node_belief2 = read4vec<w2>(vec_old_node_belief2 + i2);
-
-                    auto v1 = old_node_belief1 * vec_rcp(Float4(1e-10f) + old_edge_belief1);
-                    auto v2 = old_node_belief2 * vec_rcp(Float4(1e-10f) + old_edge_belief2);
-
-                    // load the edge probability matrix
-                    auto eprob = PaddedMatrix<N_ROT1,N_ROT2>(prob.x + ne*N_ROT1*4*w2);
-                    auto cur_edge_belief1 = eprob.apply_left (v2);
-                    auto cur_edge_belief2 = eprob.apply_right(v1);
+                    auto cur_edge_belief1 = read4vec<w1>(cur_belief.x + ne*4*ws + 0);
+                    auto cur_edge_belief2 = read4vec<w2>(cur_belief.x + ne*4*ws + 4*w1);
 
                     auto cur_node_belief1 = cur_edge_belief1 * read4vec<w1>(vec_cur_node_belief1 + i1);
                     auto cur_node_belief2 = cur_edge_belief2 * read4vec<w2>(vec_cur_node_belief2 + i2);
@@ -492,8 +602,6 @@ struct EdgeHolder {
                     cur_node_belief1 *= rcp(sum(cur_node_belief1).sum_in_all_entries());
                     cur_node_belief2 *= rcp(sum(cur_node_belief2).sum_in_all_entries());
 
-                    store4vec<w1>(cur_belief.x + ne*4*ws + 0,    cur_edge_belief1);
-                    store4vec<w2>(cur_belief.x + ne*4*ws + 4*w1, cur_edge_belief2);
                     store4vec<w1>(vec_cur_node_belief1 + i1,     cur_node_belief1);
                     store4vec<w2>(vec_cur_node_belief2 + i2,     cur_node_belief2);
                 }
@@ -503,23 +611,260 @@ struct EdgeHolder {
                 // middle of the algorithm.  The hope is that the processor will expose much more instruction
                 // parallelism in this loop.  The loop process 2 edges at a time to fully utilize the horizontal
                 // adds.
-                for(int ne=0; ne<n_edge; ne+=2) {
-                    auto cb11 = read4vec<w1>(cur_belief.x + ne*4*ws + 0);
-                    auto cb12 = read4vec<w2>(cur_belief.x + ne*4*ws + 4*w1);
-                    auto cb21 = read4vec<w1>(cur_belief.x + ne*4*ws + 4*ws);
-                    auto cb22 = read4vec<w2>(cur_belief.x + ne*4*ws + 4*(ws+w1));
-
-                    // let's approximately l1 normalize everything edges to avoid any numerical problems later
-                    Float4 scales_for_unit_l1 = approx_rcp(horizontal_add(
-                                horizontal_add(sum(cb11), sum(cb12)),
-                                horizontal_add(sum(cb21), sum(cb22))));
-
-                    store4vec<w1>(cur_belief.x + ne*4*ws + 0,         cb11*scales_for_unit_l1.broadcast<0>());
-                    store4vec<w2>(cur_belief.x + ne*4*ws + 4*w1,      cb12*scales_for_unit_l1.broadcast<1>());
-                    store4vec<w1>(cur_belief.x + ne*4*ws + 4*ws,      cb21*scales_for_unit_l1.broadcast<2>());
-                    store4vec<w2>(cur_belief.x + ne*4*ws + 4*(ws+w1), cb22*scales_for_unit_l1.broadcast<3>());
+                for(int ne=0; ne<n_edge; ne+=2) normalize_message_pair<N_ROT1,N_ROT2>(ne);
+            }
+
+        // Messages of edge ne to its two nodes from the old beliefs
+        template <int N_ROT1, int N_ROT2>
+            void compute_message(int ne,
+                    Vec<(N_ROT1+3)/4,Float4>& cur_edge_belief1, Vec<(N_ROT2+3)/4,Float4>& cur_edge_belief2) {
+                constexpr const int w1 = (N_ROT1+3)/4;
+                constexpr const int w2 = (N_ROT2+3)/4;
+                constexpr const int ws = w1+w2;
+
+                int i1 = edge_indices1[ne]*4*w1;
+                int i2 = edge_indices2[ne]*4*w2;
+
+                auto old_edge_belief1 = read4vec<w1>(old_belief.x + ne*4*ws + 0);
+                auto old_edge_belief2 = read4vec<w2>(old_belief.x + ne*4*ws + 4*w1);
+
+                auto old_node_belief1 = read4vec<w1>(nodes1.old_belief.x + i1);
+                auto old_node_belief2 = read4vec<w2>(nodes2.old_belief.x + i2);
+
+                auto v1 = old_node_belief1 * vec_rcp(Float4(1e-10f) + old_edge_belief1);
+                auto v2 = old_node_belief2 * vec_rcp(Float4(1e-10f) + old_edge_belief2);
+
+                // load the edge probability matrix
+                auto eprob = PaddedMatrix<N_ROT1,N_ROT2>(prob.x + ne*N_ROT1*4*w2);
+                cur_edge_belief1 = eprob.apply_left (v2);
+                cur_edge_belief2 = eprob.apply_right(v1);
+            }
+
+        // Edge half of update_beliefs for edge ne, which stores the messages for
+        // NodeHolder::accumulate_messages.  Each edge is independent, so this may run in parallel.
+        template <int N_ROT1, int N_ROT2>
+            void compute_message(int ne) {
+                constexpr const int w1 = (N_ROT1+3)/4;
+                constexpr const int w2 = (N_ROT2+3)/4;
+                constexpr const int ws = w1+w2;
+
+                Vec<w1,Float4> cur_edge_belief1;
+                Vec<w2,Float4> cur_edge_belief2;
+                compute_message<N_ROT1,N_ROT2>(ne, cur_edge_belief1, cur_edge_belief2);
+                store4vec<w1>(cur_belief.x + ne*4*ws + 0,    cur_edge_belief1);
+                store4vec<w2>(cur_belief.x + ne*4*ws + 4*w1, cur_edge_belief2);
+            }
+
+        // Messages of the edges ne..ne+message_lanes-1 that exist, as compute_message(ne) for each edge
+        template <int N_ROT1, int N_ROT2>
+            void compute_message_batch(int ne) {
+                if(ne+message_lanes <= nodes_to_edge.n_edge) {
+                    compute_message_lanes<N_ROT1,N_ROT2,message_lanes>(ne);
+                } else {
+                    for(; ne<nodes_to_edge.n_edge; ++ne) compute_message<N_ROT1,N_ROT2>(ne);
                 }
             }
+
+        // Messages of the W edges starting at ne with one edge per SIMD lane, so that the products
+        // with the edge probability matrix are multiply-adds rather than the horizontal dot products of
+        // PaddedMatrix.  The rows of the beliefs and probabilities are transposed on load and store.
+        template <int N_ROT1, int N_ROT2, int W>
+            void compute_message_lanes(int ne) {
+                typedef typename SimdLanes<W>::Float F;
+                constexpr const int w1 = (N_ROT1+3)/4;
+                constexpr const int w2 = (N_ROT2+3)/4;
+                constexpr const int ws = w1+w2;
+
+                alignas(32) int32_t edge_idx[W];
+                for(int i=0; i<W; ++i) edge_idx[i] = ne+i;
+
+                F old_edge_belief1[4*w1], old_edge_belief2[4*w2];
+                F old_node_belief1[4*w1], old_node_belief2[4*w2];
+                for(int k=0; k<w1; ++k) {
+                    F* e = old_edge_belief1+4*k; F* n = old_node_belief1+4*k;
+                    load_transposed4(old_belief.x + 4*k, 4*ws, edge_idx, e[0],e[1],e[2],e[3]);
+                    load_transposed4(nodes1.old_belief.x + 4*k, 4*w1, edge_indices1+ne, n[0],n[1],n[2],n[3]);
+                }
+                for(int k=0; k<w2; ++k) {
+                    F* e = old_edge_belief2+4*k; F* n = old_node_belief2+4*k;
+                    load_transposed4(old_belief.x + 4*(w1+k), 4*ws, edge_idx, e[0],e[1],e[2],e[3]);
+                    load_transposed4(nodes2.old_belief.x + 4*k, 4*w2, edge_indices2+ne, n[0],n[1],n[2],n[3]);
+                }
+
+                F v1[N_ROT1], v2[N_ROT2];
+                for(int i=0; i<N_ROT1; ++i) v1[i] = old_node_belief1[i] * rcp(F(1e-10f) + old_edge_belief1[i]);
+                for(int j=0; j<N_ROT2; ++j) v2[j] = old_node_belief2[j] * rcp(F(1e-10f) + old_edge_belief2[j]);
+
+                // entries past N_ROT stay zero, as for PaddedMatrix
+                F cur_edge_belief1[4*w1], cur_edge_belief2[4*w2];
+                for(int i=0; i<N_ROT1; ++i) {
+                    for(int k=0; k<w2; ++k) {
+                        F p[4];
+                        load_transposed4(prob.x + i*4*w2 + 4*k, N_ROT1*4*w2, edge_idx, p[0],p[1],p[2],p[3]);
+                        for(int j=4*k; j<min(4*k+4,N_ROT2); ++j) {
+                            cur_edge_belief1[i] = fmadd(p[j-4*k], v2[j], cur_edge_belief1[i]);
+                            cur_edge_belief2[j] = fmadd(p[j-4*k], v1[i], cur_edge_belief2[j]);
+                        }
+                    }
+                }
+
+                for(int k=0; k<w1; ++k) {
+                    F* c = cur_edge_belief1+4*k;
+                    store_transposed4(cur_belief.x + 4*k,      4*ws, edge_idx, c[0],c[1],c[2],c[3]);
+                }
+                for(int k=0; k<w2; ++k) {
+                    F* c = cur_edge_belief2+4*k;
+                    store_transposed4(cur_belief.x + 4*(w1+k), 4*ws, edge_idx, c[0],c[1],c[2],c[3]);
+                }
+            }
+
+        // Scalar reference for the message kernels from the old beliefs
+        template <int N_ROT1, int N_ROT2>
+            void compute_message_reference(int ne, float* msg1, float* msg2) const {
+                constexpr const int w2 = (N_ROT2+3)/4;
+                const float* old_edge_belief1 = old_belief.x + ne*old_belief.row_width;
+                const float* old_edge_belief2 = old_edge_belief1 + ru(N_ROT1);
+                const float* old_node_belief1 = nodes1.old_belief.x + edge_indices1[ne]*nodes1.old_belief.row_width;
+                const float* old_node_belief2 = nodes2.old_belief.x + edge_indices2[ne]*nodes2.old_belief.row_width;
+
+                double v1[N_ROT1], v2[N_ROT2];
+                for(int i=0; i<N_ROT1; ++i) v1[i] = old_node_belief1[i] / (1e-10 + old_edge_belief1[i]);
+                for(int j=0; j<N_ROT2; ++j) v2[j] = old_node_belief2[j] / (1e-10 + old_edge_belief2[j]);
+
+                for(int i=0; i<N_ROT1; ++i) {
+                    double m = 0.;
+                    for(int j=0; j<N_ROT2; ++j) m += prob.x[ne*N_ROT1*4*w2 + i*4*w2 + j] * v2[j];
+                    msg1[i] = m;
+                }
+                for(int j=0; j<N_ROT2; ++j) {
+                    double m = 0.;
+                    for(int i=0; i<N_ROT1; ++i) m += prob.x[ne*N_ROT1*4*w2 + i*4*w2 + j] * v1[i];
+                    msg2[j] = m;
+                }
+            }
+
+        // Largest difference of the messages of the multi-edge kernel from compute_message_reference,
+        // relative to the largest entry of each message.  The current messages are left unchanged.
+        template <int N_ROT1, int N_ROT2>
+            float message_kernel_error() {
+                constexpr const int ws = (N_ROT1+3)/4 + (N_ROT2+3)/4;
+                VecArrayStorage saved_belief(cur_belief);
+                for(int ne=0; ne<nodes_to_edge.n_edge; ne+=message_lanes) compute_message_batch<N_ROT1,N_ROT2>(ne);
+
+                float err = 0.f;
+                for(int ne=0; ne<nodes_to_edge.n_edge; ++ne) {
+                    float ref1[N_ROT1], ref2[N_ROT2];
+                    compute_message_reference<N_ROT1,N_ROT2>(ne, ref1, ref2);
+                    auto relative_error = [&](const float* ref, const float* msg, int n) {
+                        float scale = 1e-30f, diff = 0.f;
+                        for(int i=0; i<n; ++i) {
+                            scale = max(scale, fabsf(ref[i]));
+                            diff  = max(diff,  fabsf(ref[i]-msg[i]));
+                        }
+                        return diff/scale;};
+                    err = max(err, relative_error(ref1, cur_belief.x + ne*4*ws,              N_ROT1));
+                    err = max(err, relative_error(ref2, cur_belief.x + ne*4*ws + ru(N_ROT1), N_ROT2));
+                }
+                swap(cur_belief, saved_belief);
+                return err;
+            }
+
+        // Residual schedule (see RotamerSidechain::run_residual_belief_propagation): the message of
+        // edge ne to node 1 (side 0) or node 2 (side 1) from the current beliefs is stored, max
+        // normalized, in old_belief.  Returns the largest change relative to the current message.
+        template <int N_ROT1, int N_ROT2>
+            float propose_message(int ne, int side) {
+                constexpr const int w1 = (N_ROT1+3)/4;
+                constexpr const int w2 = (N_ROT2+3)/4;
+                constexpr const int ws = w1+w2;
+
+                float* cur  = cur_belief.x + ne*4*ws;
+                float* cand = old_belief.x + ne*4*ws;
+                auto eprob = PaddedMatrix<N_ROT1,N_ROT2>(prob.x + ne*N_ROT1*4*w2);
+
+                int n_rot;
+                if(side==0) {
+                    auto v2 = read4vec<w2>(nodes2.cur_belief.x + edge_indices2[ne]*4*w2) *
+                        vec_rcp(Float4(1e-10f) + read4vec<w2>(cur + 4*w1));
+                    store4vec<w1>(cand, eprob.apply_left(v2));
+                    n_rot = N_ROT1;
+                } else {
+                    auto v1 = read4vec<w1>(nodes1.cur_belief.x + edge_indices1[ne]*4*w1) *
+                        vec_rcp(Float4(1e-10f) + read4vec<w1>(cur));
+                    store4vec<w2>(cand + 4*w1, eprob.apply_right(v1));
+                    cur  += 4*w1;
+                    cand += 4*w1;
+                    n_rot = N_ROT2;
+                }
+
+                float max_cand = 1e-10f;
+                for(int no=0; no<n_rot; ++no) max_cand = max(max_cand, cand[no]);
+                float scale = rcp(max_cand);
+
+                float residual = 0.f;
+                for(int no=0; no<n_rot; ++no) {
+                    cand[no] *= scale;
+                    residual = max(residual, fabsf(cand[no]-cur[no]));
+                }
+                return residual;
+            }
+
+        // Replace the current message with the damped message from propose_message
+        template <int N_ROT1, int N_ROT2>
+            void accept_message(int ne, int side, float damping) {
+                constexpr const int ws = (N_ROT1+3)/4 + (N_ROT2+3)/4;
+                int offset = side==0 ? 0 : ru(N_ROT1);
+                int n_rot  = side==0 ? N_ROT1 : N_ROT2;
+                float* cur  = cur_belief.x + ne*4*ws + offset;
+                float* cand = old_belief.x + ne*4*ws + offset;
+
+                float max_cur = 1e-10f;
+                for(int no=0; no<n_rot; ++no) {
+                    cur[no] = (1.f-damping)*cand[no] + damping*cur[no];
+                    max_cur = max(max_cur, cur[no]);
+                }
+                float scale = rcp(max_cur);
+                for(int no=0; no<n_rot; ++no) cur[no] *= scale;
+            }
+
+        // Approximate l1 normalization of the messages of edge ne alone
+        template <int N_ROT1, int N_ROT2>
+            void normalize_message(int ne) {
+                constexpr const int w1 = (N_ROT1+3)/4;
+                constexpr const int w2 = (N_ROT2+3)/4;
+                constexpr const int ws = w1+w2;
+
+                auto cb1 = read4vec<w1>(cur_belief.x + ne*4*ws + 0);
+                auto cb2 = read4vec<w2>(cur_belief.x + ne*4*ws + 4*w1);
+                Float4 scales_for_unit_l1 = approx_rcp(horizontal_add(
+                            horizontal_add(sum(cb1), sum(cb2)), Float4(1.f)));
+
+                store4vec<w1>(cur_belief.x + ne*4*ws + 0,    cb1*scales_for_unit_l1.broadcast<0>());
+                store4vec<w2>(cur_belief.x + ne*4*ws + 4*w1, cb2*scales_for_unit_l1.broadcast<1>());
+            }
+
+        // Approximate l1 normalization of the messages of edges ne and ne+1, where ne is even
+        template <int N_ROT1, int N_ROT2>
+            void normalize_message_pair(int ne) {
+                constexpr const int w1 = (N_ROT1+3)/4;
+                constexpr const int w2 = (N_ROT2+3)/4;
+                constexpr const int ws = w1+w2;
+
+                auto cb11 = read4vec<w1>(cur_belief.x + ne*4*ws + 0);
+                auto cb12 = read4vec<w2>(cur_belief.x + ne*4*ws + 4*w1);
+                auto cb21 = read4vec<w1>(cur_belief.x + ne*4*ws + 4*ws);
+                auto cb22 = read4vec<w2>(cur_belief.x + ne*4*ws + 4*(ws+w1));
+
+                // let's approximately l1 normalize everything edges to avoid any numerical problems later
+                Float4 scales_for_unit_l1 = approx_rcp(horizontal_add(
+                            horizontal_add(sum(cb11), sum(cb12)),
+                            horizontal_add(sum(cb21), sum(cb22))));
+
+                store4vec<w1>(cur_belief.x + ne*4*ws + 0,         cb11*scales_for_unit_l1.broadcast<0>());
+                store4vec<w2>(cur_belief.x + ne*4*ws + 4*w1,      cb12*scales_for_unit_l1.broadcast<1>());
+                store4vec<w1>(cur_belief.x + ne*4*ws + 4*ws,      cb21*scales_for_unit_l1.broadcast<2>());
+                store4vec<w2>(cur_belief.x + ne*4*ws + 4*(ws+w1), cb22*scales_for_unit_l1.broadcast<3>());
+            }
 };
 
 
@@ -589,7 +934,11 @@ struct RotamerSidechain: public PotentialNode {
     NodeHolder  nodes1, nodes3, nodes6; // FIXME initialize these with sane max_n_edge
 
     EdgeHolder* edge_holders_matrix[UPPER_ROT][UPPER_ROT];
-    EdgeHolder edges11, edges13, edges16, edges33, edges36, edges66; // FIXME initialize these with sane max_n_edge
+    EdgeHolder edges11, edges13, edges16, edges33, edges36, edges66;
+
+    // Initial capacity of the EdgeHolder's, which grow as needed.  Each residue has only
+    // a few neighbors, so this is linear in the number of residues.
+    static int initial_n_edge(int n_elem1, int n_elem2) {return 4*(n_elem1+n_elem2)+16;}
 
     float energy_cap;
     float energy_cap_width;
@@ -601,7 +950,40 @@ struct RotamerSidechain: public PotentialNode {
 
     bool energy_fresh_relative_to_derivative;
 
+    // Warm start seeds belief propagation with the converged beliefs of the last derivative
+    // evaluation, falling back to the usual cold start when the seeded solve does not converge
+    bool warm_start;
+    bool have_warm_start;
+
+    // Residual schedule updates the single message with the largest change until all changes
+    // are below tol, instead of sweeping over all messages
+    bool residual_schedule;
+    int msg_start[4];  // numbering of the messages of edges33, edges36, and edges66
+    vector<float> msg_residual;
+    vector<int8_t> msg_bucket;
+
+    // Component schedule sweeps each connected component of the 3- and 6-rotamer graph until it
+    // converges on its own and then freezes it (see run_component_belief_propagation)
+    bool component_schedule;
+    int n_component;
+    vector<int32_t> component_node_start, component_node;  // nodes3, then nodes6
+    vector<int32_t> component_edge_start, component_edge;  // edges33, then edges36 and edges66
+    vector<int32_t> component_n_iter;
+    vector<float>   component_deviation;
+
     long n_bad_solve;
+    long n_warm_fallback;
+
+    // Telemetry of the solver for tuning damping, tol, and iteration_chunk_size.  The counters are
+    // cumulative, and the loggers report their change over each frame interval.
+    constexpr static int n_iter_bin = 32;  // bins of iteration_chunk_size, the last bin is open
+    vector<long> iter_histogram;
+    int   last_n_iter;
+    float last_max_deviation;
+    float max_deviation_since_log;
+    double phase_time[3];  // seconds in fill_holders, solve_for_marginals, and propagate_derivatives
+    vector<long> logged_iter_histogram;
+    double logged_phase_time[3];
 
     RotamerSidechain(hid_t grp, CoordNode &pos_node_, vector<CoordNode*> prob_nodes_):
         PotentialNode(),
@@ -614,12 +996,12 @@ struct RotamerSidechain: public PotentialNode {
         nodes3(3,n_elem_rot[3]),
         nodes6(6,n_elem_rot[6]),
 
-        edges11(nodes1,nodes1,n_elem_rot[1]*(n_elem_rot[1]+1)/2),
-        edges13(nodes1,nodes3,n_elem_rot[1]* n_elem_rot[3]),
-        edges16(nodes1,nodes6,n_elem_rot[1]* n_elem_rot[6]),
-        edges33(nodes3,nodes3,n_elem_rot[3]*(n_elem_rot[3]+1)/2),
-        edges36(nodes3,nodes6,n_elem_rot[3]* n_elem_rot[6]),
-        edges66(nodes6,nodes6,n_elem_rot[6]*(n_elem_rot[6]+1)/2),
+        edges11(nodes1,nodes1,initial_n_edge(n_elem_rot[1],n_elem_rot[1])),
+        edges13(nodes1,nodes3,initial_n_edge(n_elem_rot[1],n_elem_rot[3])),
+        edges16(nodes1,nodes6,initial_n_edge(n_elem_rot[1],n_elem_rot[6])),
+        edges33(nodes3,nodes3,initial_n_edge(n_elem_rot[3],n_elem_rot[3])),
+        edges36(nodes3,nodes6,initial_n_edge(n_elem_rot[3],n_elem_rot[6])),
+        edges66(nodes6,nodes6,initial_n_edge(n_elem_rot[6],n_elem_rot[6])),
 
         // energy_cap      (read_attribute<float>(grp,"pair_interaction","energy_cap")),
         // energy_cap_width(read_attribute<float>(grp,"pair_interaction","energy_cap_width")),
@@ -633,7 +1015,20 @@ struct RotamerSidechain: public PotentialNode {
         iteration_chunk_size(read_attribute<int>(grp, ".", "iteration_chunk_size")),
 
         energy_fresh_relative_to_derivative(false),
-        n_bad_solve(0)
+        warm_start(read_attribute<int>(grp, ".", "warm_start", 0)),
+        have_warm_start(false),
+        residual_schedule(read_attribute<int>(grp, ".", "residual_schedule", 0)),
+        component_schedule(read_attribute<int>(grp, ".", "component_schedule", 0)),
+        n_component(0),
+        n_bad_solve(0),
+        n_warm_fallback(0),
+        iter_histogram(n_iter_bin, 0),
+        last_n_iter(0),
+        last_max_deviation(0.f),
+        max_deviation_since_log(0.f),
+        phase_time{0.,0.,0.},
+        logged_iter_histogram(n_iter_bin, 0),
+        logged_phase_time{0.,0.,0.}
     {
         for(int i: range(UPPER_ROT)) node_holders_matrix[i] = nullptr;
         node_holders_matrix[1] = &nodes1;
@@ -657,6 +1052,30 @@ struct RotamerSidechain: public PotentialNode {
         if(logging(LOG_DETAILED))
             default_logger->add_logger<long>("rotamer_bad_solves_cumulative", {1},
                     [&](long* buffer) {buffer[0]=n_bad_solve;});
+        if(logging(LOG_DETAILED)) {
+            // histogram of the iterations of the solves in each frame interval
+            default_logger->add_logger<long>("rotamer_solve_iterations", {n_iter_bin},
+                    [this](long* buffer) {
+                        for(int i: range(n_iter_bin)) buffer[i] = iter_histogram[i] - logged_iter_histogram[i];
+                        logged_iter_histogram = iter_histogram;});
+            default_logger->add_logger<float>("rotamer_solve_max_deviation", {1},
+                    [this](float* buffer) {
+                        buffer[0] = max_deviation_since_log;
+                        max_deviation_since_log = 0.f;});
+            default_logger->add_logger<int>("rotamer_n_edge", {6},
+                    [this](int* buffer) {
+                        auto n_edge = n_edge_by_holder();
+                        copy(begin(n_edge), end(n_edge), buffer);});
+        }
+        if(logging(LOG_EXTENSIVE))
+            default_logger->add_logger<float>("rotamer_phase_time", {3},
+                    [this](float* buffer) {
+                        for(int i: range(3)) buffer[i] = phase_time[i] - logged_phase_time[i];
+                        copy_n(phase_time, 3, logged_phase_time);});
+
+        if(logging(LOG_DETAILED) && warm_start)
+            default_logger->add_logger<long>("rotamer_warm_start_fallbacks_cumulative", {1},
+                    [&](long* buffer) {buffer[0]=n_warm_fallback;});
 
         if(logging(LOG_DETAILED)) {
             default_logger->add_logger<float>("rotamer_free_energy", {nodes1.n_elem+nodes3.n_elem+nodes6.n_elem}, 
@@ -761,6 +1180,33 @@ struct RotamerSidechain: public PotentialNode {
             }
 
             return edge_value;
+        } else if(!strcmp(log_name, "component_n_iter")) {
+            // iterations of each connected component in the last component schedule solve
+            return vector<float>(begin(component_n_iter), end(component_n_iter));
+        } else if(!strcmp(log_name, "component_n_node")) {
+            vector<float> ret(n_component);
+            for(int nc: range(n_component))
+                ret[nc] = component_node_start[nc+1] - component_node_start[nc];
+            return ret;
+        } else if(!strcmp(log_name, "message_kernel_error")) {
+            // validation of the multi-edge message kernels for edges33, edges36, and edges66
+            vector<float> ret;
+            ret.push_back(edges33.message_kernel_error<3,3>());
+            ret.push_back(edges36.message_kernel_error<3,6>());
+            ret.push_back(edges66.message_kernel_error<6,6>());
+            return ret;
+        } else if(!strcmp(log_name, "solve_iterations_histogram")) {
+            // cumulative, in bins of iteration_chunk_size
+            return vector<float>(begin(iter_histogram), end(iter_histogram));
+        } else if(!strcmp(log_name, "last_solve")) {
+            return vector<float>{float(last_n_iter), last_max_deviation};
+        } else if(!strcmp(log_name, "n_edge_by_holder")) {
+            // edges11, edges13, edges16, edges33, edges36, edges66
+            auto n_edge = n_edge_by_holder();
+            return vector<float>(begin(n_edge), end(n_edge));
+        } else if(!strcmp(log_name, "phase_time")) {
+            // cumulative seconds in the fill, solve, and derivative phases
+            return vector<float>(begin(phase_time), end(phase_time));
         } else if(!strcmp(log_name, "read n_bad_solve")) {
             return vector<float>(1, float(n_bad_solve));
         } else if(!strcmp(log_name, "read n_bad_solve and reset")) {
@@ -772,25 +1218,96 @@ struct RotamerSidechain: public PotentialNode {
         }
     }
 
+    // The pairlist of the interaction graph and the warm start are checkpointed so that
+    // restarted simulations reproduce the same solves
+    virtual vector<char> get_checkpoint_state() const override {
+        vector<char> state;
+        write_checkpoint_vector(state, igraph.get_checkpoint_state());
+        if(!warm_start) return state;
+
+        write_checkpoint_vector(state, vector<int32_t>(1, have_warm_start));
+        for(const NodeHolder* nodes: {&nodes3, &nodes6})
+            write_checkpoint_vector(state, nodes->warm_belief);
+        for(const EdgeHolder* edges: {&edges33, &edges36, &edges66}) {
+            write_checkpoint_vector(state, edges->warm_indices1);
+            write_checkpoint_vector(state, edges->warm_indices2);
+            write_checkpoint_vector(state, edges->warm_belief);
+        }
+        return state;
+    }
+
+    virtual void set_checkpoint_state(const vector<char>& state) override {
+        size_t pos = 0;
+        vector<char> igraph_state;
+        read_checkpoint_vector(state, pos, igraph_state);
+        igraph.set_checkpoint_state(igraph_state);
+
+        have_warm_start = false;
+        if(pos == state.size()) return;  // checkpoint was written without warm start
+        if(!warm_start) throw string("checkpoint has a warm start state but warm_start is disabled");
+
+        vector<int32_t> have;
+        read_checkpoint_vector(state, pos, have);
+        for(NodeHolder* nodes: {&nodes3, &nodes6})
+            read_checkpoint_vector(state, pos, nodes->warm_belief);
+        for(EdgeHolder* edges: {&edges33, &edges36, &edges66}) {
+            read_checkpoint_vector(state, pos, edges->warm_indices1);
+            read_checkpoint_vector(state, pos, edges->warm_indices2);
+            read_checkpoint_vector(state, pos, edges->warm_belief);
+            if(edges->warm_indices1.size() != edges->warm_indices2.size() ||
+                    edges->warm_belief.size() != edges->warm_indices1.size()*edges->old_belief.row_width)
+                throw string("invalid checkpoint state for rotamer");
+            edges->index_warm_start();
+        }
+        if(pos != state.size() || have.size() != 1u) throw string("invalid checkpoint state for rotamer");
+        have_warm_start = have[0];
+    }
+
     void ensure_fresh_energy() {
-        if(!energy_fresh_relative_to_derivative) compute_value(PotentialAndDerivMode);
+        if(!energy_fresh_relative_to_derivative) compute_value(PotentialOnlyMode);
     }
 
     virtual void compute_value(ComputeMode mode) override {
-        energy_fresh_relative_to_derivative = mode==PotentialAndDerivMode;
+        energy_fresh_relative_to_derivative = mode!=DerivMode;
 
-        fill_holders();
-        auto solve_results = solve_for_marginals();
+        typedef chrono::steady_clock clock;
+        auto seconds = [](clock::duration d) {return chrono::duration<double>(d).count();};
+        auto t0 = clock::now();
+
+        fill_holders(mode);
+        auto t1 = clock::now();
+
+        // Energy-only evaluations (e.g. Monte Carlo trial moves) may be far from the trajectory,
+        // so only derivative evaluations update the warm start
+        auto solve_results = solve_for_marginals(mode!=PotentialOnlyMode);
         if(solve_results.first >= max_iter - iteration_chunk_size - 1)
             n_bad_solve++;
+        auto t2 = clock::now();
+
+        last_n_iter        = solve_results.first;
+        last_max_deviation = solve_results.second;
+        max_deviation_since_log = max(max_deviation_since_log, last_max_deviation);
+        iter_histogram[min(n_iter_bin-1, last_n_iter/iteration_chunk_size)]++;
+
+        if(mode!=PotentialOnlyMode) propagate_derivatives();
+        auto t3 = clock::now();
+        phase_time[0] += seconds(t1-t0);
+        phase_time[1] += seconds(t2-t1);
+        phase_time[2] += seconds(t3-t2);
 
-        propagate_derivatives();
-        if(mode==PotentialAndDerivMode) potential = calculate_energy_from_marginals();
+        if(mode!=DerivMode) potential = calculate_energy_from_marginals();
+    }
+
+    vector<int> n_edge_by_holder() const {
+        vector<int> n_edge;
+        for(const EdgeHolder* edges: {&edges11, &edges13, &edges16, &edges33, &edges36, &edges66})
+            n_edge.push_back(edges->nodes_to_edge.n_edge);
+        return n_edge;
     }
 
     virtual double test_value_deriv_agreement() {return -1.;}
 
-    void fill_holders()
+    void fill_holders(ComputeMode mode)
     {
         Timer timer(std::string("rotamer_fill"));
         edges11.reset();
@@ -826,7 +1343,7 @@ struct RotamerSidechain: public PotentialNode {
                 node_holders_matrix[n_rot]->convert_energy_to_prob(energy_cap, energy_cap_width);
 
         // Fill edge probabilities
-        igraph.compute_edges();
+        igraph.compute_edges(mode, n_threads);
 
         const unsigned selector = (1u<<n_bit_rotamer) - 1u;
         for(int ne=0; ne<igraph.n_edge; ++ne) {
@@ -963,7 +1480,7 @@ struct RotamerSidechain: public PotentialNode {
         for(auto edge_set: {&edges33,&edges36,&edges66})
             for(auto &el: edge_set->edge_loc)
                 igraph.edge_sensitivity[el.edge_num] = edge_set->marginal(el.dim, el.ne);
-        igraph.propagate_derivatives();
+        igraph.propagate_derivatives(n_threads);
 
         vector<VecArray> sens_1body;
         sens_1body.reserve(n_prob_nodes);
@@ -985,7 +1502,52 @@ struct RotamerSidechain: public PotentialNode {
     }
 
 
+    // Index the incoming messages of each node for the parallel belief update.  The edges are
+    // fixed during solve_for_marginals.
+    void build_inboxes() {
+        EdgeHolder* bp_edges[3] = {&edges33, &edges36, &edges66};
+        for(auto nh: {&nodes3,&nodes6}) nh->inbox_start.assign(nh->n_elem+1, 0);
+
+        msg_start[0] = 0;
+        for(int h: range(3)) msg_start[h+1] = msg_start[h] + 2*bp_edges[h]->nodes_to_edge.n_edge;
+
+        for(auto eh: bp_edges) {
+            for(int ne: range(eh->nodes_to_edge.n_edge)) {
+                eh->nodes1.inbox_start[eh->edge_indices1[ne]+1]++;
+                eh->nodes2.inbox_start[eh->edge_indices2[ne]+1]++;
+            }
+        }
+        vector<int32_t> fill_loc3, fill_loc6;
+        for(auto nh: {&nodes3,&nodes6}) {
+            partial_sum(begin(nh->inbox_start), end(nh->inbox_start), begin(nh->inbox_start));
+            nh->inbox.resize(nh->inbox_start.back());
+            nh->inbox_msg.resize(nh->inbox_start.back());
+            (nh==&nodes3 ? fill_loc3 : fill_loc6) = nh->inbox_start;
+        }
+
+        // messages are added in the order of the serial update
+        for(int h: range(3)) {
+            auto eh = bp_edges[h];
+            auto& fill_loc1 = &eh->nodes1==&nodes3 ? fill_loc3 : fill_loc6;
+            auto& fill_loc2 = &eh->nodes2==&nodes3 ? fill_loc3 : fill_loc6;
+            int w1 = ru(eh->n_rot1)/4;
+            int ws = w1 + ru(eh->n_rot2)/4;
+            for(int ne: range(eh->nodes_to_edge.n_edge)) {
+                int loc1 = fill_loc1[eh->edge_indices1[ne]]++;
+                eh->nodes1.inbox    [loc1] = NodeHolder::Message{&eh->cur_belief, ne*4*ws};
+                eh->nodes1.inbox_msg[loc1] = msg_start[h] + 2*ne + 0;
+                int loc2 = fill_loc2[eh->edge_indices2[ne]]++;
+                eh->nodes2.inbox    [loc2] = NodeHolder::Message{&eh->cur_belief, ne*4*ws + 4*w1};
+                eh->nodes2.inbox_msg[loc2] = msg_start[h] + 2*ne + 1;
+            }
+        }
+    }
+
     void calculate_new_beliefs(float damping_for_this_iteration, bool do_swap_for_initial=false) {
+        if(n_threads>1) {
+            calculate_new_beliefs_parallel(damping_for_this_iteration, do_swap_for_initial);
+            return;
+        }
         copy(nodes3.prob, nodes3.cur_belief);
         copy(nodes6.prob, nodes6.cur_belief);
         edges33.update_beliefs<3,3>();
@@ -1000,10 +1562,85 @@ struct RotamerSidechain: public PotentialNode {
         nodes3.standardize_belief_update<3>(damping_for_this_iteration);
         nodes6.standardize_belief_update<6>(damping_for_this_iteration);
     }
+
+    // Same as the serial calculate_new_beliefs, in three phases that are each parallel: the
+    // edges compute their messages, each node multiplies in its messages in the serial order,
+    // and the edges normalize their messages.  The result does not depend on the thread count.
+    void calculate_new_beliefs_parallel(float damping, bool do_swap_for_initial) {
+        #pragma omp parallel num_threads(n_threads)
+        {
+            #pragma omp for schedule(static) nowait
+            for(int ne=0; ne<edges33.nodes_to_edge.n_edge; ne+=message_lanes) edges33.compute_message_batch<3,3>(ne);
+            #pragma omp for schedule(static) nowait
+            for(int ne=0; ne<edges36.nodes_to_edge.n_edge; ne+=message_lanes) edges36.compute_message_batch<3,6>(ne);
+            #pragma omp for schedule(static)
+            for(int ne=0; ne<edges66.nodes_to_edge.n_edge; ne+=message_lanes) edges66.compute_message_batch<6,6>(ne);
+
+            #pragma omp for schedule(static) nowait
+            for(int nn=0; nn<nodes3.n_elem; ++nn) {
+                nodes3.accumulate_messages<3>(nn);
+                if(!do_swap_for_initial) nodes3.standardize_belief_update<3>(damping, nn);
+            }
+            #pragma omp for schedule(static)
+            for(int nn=0; nn<nodes6.n_elem; ++nn) {
+                nodes6.accumulate_messages<6>(nn);
+                if(!do_swap_for_initial) nodes6.standardize_belief_update<6>(damping, nn);
+            }
+
+            if(do_swap_for_initial) {
+                #pragma omp single
+                {
+                    // we want the "old" values here
+                    nodes3.swap_beliefs();
+                    nodes6.swap_beliefs();
+                }
+                #pragma omp for schedule(static) nowait
+                for(int nn=0; nn<nodes3.n_elem; ++nn) nodes3.standardize_belief_update<3>(damping, nn);
+                #pragma omp for schedule(static) nowait
+                for(int nn=0; nn<nodes6.n_elem; ++nn) nodes6.standardize_belief_update<6>(damping, nn);
+            }
+
+            #pragma omp for schedule(static) nowait
+            for(int ne=0; ne<edges33.nodes_to_edge.n_edge; ne+=2) edges33.normalize_message_pair<3,3>(ne);
+            #pragma omp for schedule(static) nowait
+            for(int ne=0; ne<edges36.nodes_to_edge.n_edge; ne+=2) edges36.normalize_message_pair<3,6>(ne);
+            #pragma omp for schedule(static) nowait
+            for(int ne=0; ne<edges66.nodes_to_edge.n_edge; ne+=2) edges66.normalize_message_pair<6,6>(ne);
+        }
+    }
     
 
-    pair<int,float> solve_for_marginals() {
+    pair<int,float> solve_for_marginals(bool update_warm_start) {
         Timer timer(std::string("rotamer_solve"));
+        bool warm = warm_start && have_warm_start;
+        auto result = run_belief_propagation(warm);
+        if(warm && !(result.second<=tol)) {
+            n_warm_fallback++;
+            result = run_belief_propagation(false);
+        }
+
+        if(warm_start && update_warm_start) {
+            have_warm_start = result.second<=tol;
+            if(have_warm_start) {
+                nodes3 .save_warm_start();
+                nodes6 .save_warm_start();
+                edges33.save_warm_start();
+                edges36.save_warm_start();
+                edges66.save_warm_start();
+            }
+        }
+
+        nodes1 .calculate_marginals<1>  ();
+        nodes3 .calculate_marginals<3>  ();
+        nodes6 .calculate_marginals<6>  ();
+        edges11.calculate_marginals<1,1>();
+        edges33.calculate_marginals<3,3>();
+        edges36.calculate_marginals<3,6>();
+        edges66.calculate_marginals<6,6>();
+        return result;
+    }
+
+    pair<int,float> run_belief_propagation(bool warm) {
         // first initialize old node beliefs to just be probability
         // this may affect the final answer since belief propagation is minimizing a non-convex function
         for(auto nh: node_holders_matrix)
@@ -1031,6 +1668,18 @@ struct RotamerSidechain: public PotentialNode {
             sb6b.store(edges66.old_belief.x+ne*16+12);
         }
 
+        if(warm) {
+            nodes3 .load_warm_start();
+            nodes6 .load_warm_start();
+            edges33.load_warm_start();
+            edges36.load_warm_start();
+            edges66.load_warm_start();
+        }
+
+        if(residual_schedule) return run_residual_belief_propagation();
+        if(component_schedule) return run_component_belief_propagation();
+
+        if(n_threads>1) build_inboxes();
         calculate_new_beliefs(0.f, true);
         float max_deviation = 1e10f;
         int iter = 0;
@@ -1050,33 +1699,320 @@ struct RotamerSidechain: public PotentialNode {
             max_deviation = max(nodes3.max_deviation(), nodes6.max_deviation());
         }
 
-        nodes1 .calculate_marginals<1>  ();
-        nodes3 .calculate_marginals<3>  ();
-        nodes6 .calculate_marginals<6>  ();
-        edges11.calculate_marginals<1,1>();
-        edges33.calculate_marginals<3,3>();
-        edges36.calculate_marginals<3,6>();
-        edges66.calculate_marginals<6,6>();
         return make_pair(iter, max_deviation);
     }
 
+    // Union-find over the nodes3 and nodes6 of the edges33, edges36, and edges66, followed by a
+    // counting sort of the nodes and edges by component.  Components are numbered in order of their
+    // first node.
+    void find_components() {
+        int n3 = nodes3.n_elem;
+        int n_node = n3 + nodes6.n_elem;
+        EdgeHolder* bp_edges[3] = {&edges33, &edges36, &edges66};
+        int node_offset1[3] = {0, 0,  n3};
+        int node_offset2[3] = {0, n3, n3};
+
+        vector<int32_t> parent(n_node);
+        iota(begin(parent), end(parent), 0);
+        auto root = [&](int i) -> int {
+            while(parent[i]!=i) i = parent[i] = parent[parent[i]];
+            return i;};
+
+        for(int h: range(3))
+            for(int ne: range(bp_edges[h]->nodes_to_edge.n_edge)) {
+                int r1 = root(node_offset1[h] + bp_edges[h]->edge_indices1[ne]);
+                int r2 = root(node_offset2[h] + bp_edges[h]->edge_indices2[ne]);
+                if(r1!=r2) parent[max(r1,r2)] = min(r1,r2);  // the root is the first node
+            }
+
+        vector<int32_t> node_component(n_node);
+        n_component = 0;
+        for(int i: range(n_node)) {
+            int r = root(i);
+            node_component[i] = r==i ? n_component++ : node_component[r];
+        }
+
+        component_node_start.assign(n_component+1, 0);
+        for(int i: range(n_node)) component_node_start[node_component[i]+1]++;
+        partial_sum(begin(component_node_start), end(component_node_start), begin(component_node_start));
+        component_node.resize(n_node);
+        auto fill_loc = component_node_start;
+        for(int i: range(n_node)) component_node[fill_loc[node_component[i]]++] = i;
+
+        component_edge_start.assign(n_component+1, 0);
+        for(int h: range(3))
+            for(int ne: range(bp_edges[h]->nodes_to_edge.n_edge))
+                component_edge_start[node_component[node_offset1[h]+bp_edges[h]->edge_indices1[ne]]+1]++;
+        partial_sum(begin(component_edge_start), end(component_edge_start), begin(component_edge_start));
+        component_edge.resize(component_edge_start.back());
+        fill_loc = component_edge_start;
+        int edge_offset = 0;
+        for(int h: range(3)) {
+            for(int ne: range(bp_edges[h]->nodes_to_edge.n_edge))
+                component_edge[fill_loc[node_component[node_offset1[h]+bp_edges[h]->edge_indices1[ne]]]++] =
+                    edge_offset + ne;
+            edge_offset += bp_edges[h]->nodes_to_edge.n_edge;
+        }
+    }
+
+    // Synchronous sweeps as in run_belief_propagation, but convergence is checked for each connected
+    // component after every chunk.  A converged component is frozen by copying its current beliefs
+    // to the old beliefs, so that the swaps of the whole arrays leave it unchanged and it no longer
+    // needs to be swept.  Components are swept in parallel.  The result is the largest iteration
+    // count and deviation of the components.
+    pair<int,float> run_component_belief_propagation() {
+        find_components();
+        build_inboxes();
+        calculate_new_beliefs(0.f, true);
+
+        component_n_iter.assign(n_component, 0);
+        component_deviation.assign(n_component, 1e10f);
+        vector<int32_t> active(n_component);
+        iota(begin(active), end(active), 0);
+
+        for(int iter=0; !active.empty() && iter<max_iter; iter+=iteration_chunk_size) {
+            int n_active = active.size();
+            #pragma omp parallel num_threads(n_threads)
+            {
+                for(int j=0; j<iteration_chunk_size; ++j) {
+                    #pragma omp single
+                    {
+                        nodes3 .swap_beliefs();
+                        nodes6 .swap_beliefs();
+                        edges33.swap_beliefs();
+                        edges36.swap_beliefs();
+                        edges66.swap_beliefs();
+                    }
+                    #pragma omp for schedule(dynamic,1)
+                    for(int i=0; i<n_active; ++i) sweep_component(active[i]);
+                }
+
+                #pragma omp for schedule(dynamic,1)
+                for(int i=0; i<n_active; ++i) {
+                    int nc = active[i];
+                    component_n_iter[nc] = iter + iteration_chunk_size;
+                    component_deviation[nc] = component_max_deviation(nc);
+                    if(component_deviation[nc] <= tol) freeze_component(nc);
+                }
+            }
+            active.erase(remove_if(begin(active), end(active),
+                        [&](int nc) {return component_deviation[nc] <= tol;}), end(active));
+        }
+
+        int max_n_iter = 0;
+        float max_deviation = 0.f;
+        for(int nc: range(n_component)) {
+            max_n_iter    = max(max_n_iter,    component_n_iter[nc]);
+            max_deviation = max(max_deviation, component_deviation[nc]);
+        }
+        return make_pair(max_n_iter, max_deviation);
+    }
+
+    void sweep_component(int nc) {
+        int n3 = nodes3.n_elem;
+        int n33 = edges33.nodes_to_edge.n_edge;
+        int n36 = edges36.nodes_to_edge.n_edge;
+        int e_start = component_edge_start[nc], e_end = component_edge_start[nc+1];
+
+        for(int i=e_start; i<e_end; ++i) {
+            int ne = component_edge[i];
+            if     (ne<n33)     edges33.compute_message<3,3>(ne);
+            else if(ne<n33+n36) edges36.compute_message<3,6>(ne-n33);
+            else                edges66.compute_message<6,6>(ne-n33-n36);
+        }
+        for(int i=component_node_start[nc]; i<component_node_start[nc+1]; ++i) {
+            int nn = component_node[i];
+            if(nn<n3) {
+                nodes3.accumulate_messages<3>(nn);
+                nodes3.standardize_belief_update<3>(damping, nn);
+            } else {
+                nodes6.accumulate_messages<6>(nn-n3);
+                nodes6.standardize_belief_update<6>(damping, nn-n3);
+            }
+        }
+        for(int i=e_start; i<e_end; ++i) {
+            int ne = component_edge[i];
+            if     (ne<n33)     edges33.normalize_message<3,3>(ne);
+            else if(ne<n33+n36) edges36.normalize_message<3,6>(ne-n33);
+            else                edges66.normalize_message<6,6>(ne-n33-n36);
+        }
+    }
+
+    float component_max_deviation(int nc) {
+        float dev = 0.f;
+        for(int i=component_node_start[nc]; i<component_node_start[nc+1]; ++i) {
+            int nn = component_node[i];
+            NodeHolder& nodes = nn<nodes3.n_elem ? nodes3 : nodes6;
+            if(&nodes==&nodes6) nn -= nodes3.n_elem;
+            for(int d: range(nodes.n_rot)) dev = max(nodes.cur_belief(d,nn)-nodes.old_belief(d,nn), dev);
+        }
+        return dev;
+    }
+
+    void freeze_component(int nc) {
+        for(int i=component_node_start[nc]; i<component_node_start[nc+1]; ++i) {
+            int nn = component_node[i];
+            NodeHolder& nodes = nn<nodes3.n_elem ? nodes3 : nodes6;
+            if(&nodes==&nodes6) nn -= nodes3.n_elem;
+            int w = nodes.cur_belief.row_width;
+            copy_n(nodes.cur_belief.x+nn*w, w, nodes.old_belief.x+nn*w);
+        }
+        int n33 = edges33.nodes_to_edge.n_edge;
+        int n36 = edges36.nodes_to_edge.n_edge;
+        for(int i=component_edge_start[nc]; i<component_edge_start[nc+1]; ++i) {
+            int ne = component_edge[i];
+            EdgeHolder& edges = ne<n33 ? edges33 : (ne<n33+n36 ? edges36 : edges66);
+            if(&edges!=&edges33) ne -= n33;
+            if(&edges==&edges66) ne -= n36;
+            int w = edges.cur_belief.row_width;
+            copy_n(edges.cur_belief.x+ne*w, w, edges.old_belief.x+ne*w);
+        }
+    }
+
+    // Residual belief propagation (Elidan et al., 2006), starting from the edge messages in
+    // old_belief.  Messages are kept in buckets of their estimated residual (powers of 2 above tol),
+    // and the message in the highest bucket is proposed and accepted if its residual still belongs
+    // there.  Instead of proposing every message that leaves a node after its belief changes, the
+    // estimates of those messages are raised by the change of the belief.  The exact residuals of all
+    // messages are checked before stopping.  The iteration count is the number of accepted messages
+    // divided by the number of messages, so that max_iter bounds the work as for the synchronous
+    // sweeps.  Messages are accepted without damping, which is only needed against the oscillations
+    // of the synchronous sweeps.  This schedule is serial.
+    pair<int,float> run_residual_belief_propagation() {
+        build_inboxes();
+        int n_msg = msg_start[3];
+
+        copy(edges33.old_belief, edges33.cur_belief);
+        copy(edges36.old_belief, edges36.cur_belief);
+        copy(edges66.old_belief, edges66.cur_belief);
+        for(int msg: range(n_msg)) accept_message(msg, 0.f);  // normalize the starting messages
+        for(int nn: range(nodes3.n_elem)) refresh_node<3>(nodes3, nn);
+        for(int nn: range(nodes6.n_elem)) refresh_node<6>(nodes6, nn);
+        if(!n_msg) return make_pair(0, 0.f);
+
+        constexpr int n_bucket = 32;
+        vector<int32_t> buckets[n_bucket];
+        int top = -1;  // no bucket above top is occupied
+        msg_residual.assign(n_msg, 0.f);
+        msg_bucket  .assign(n_msg, -1);  // bucket of the current queue entry of each message
+
+        auto schedule = [&](int msg) {
+            float r = msg_residual[msg];
+            int b = r>tol ? min(n_bucket-1, int(log2f(r*rcp(tol)))) : -1;
+            if(b>=0 && b!=msg_bucket[msg]) {  // entries in other buckets become stale
+                buckets[b].push_back(msg);
+                top = max(top, b);
+            }
+            msg_bucket[msg] = b;};
+
+        auto check_all = [&]() {
+            for(int msg: range(n_msg)) {
+                msg_residual[msg] = propose_message(msg);
+                schedule(msg);
+            }};
+
+        check_all();
+        long n_update = 0;
+        long max_update = long(max_iter)*n_msg;
+        while(n_update<max_update) {
+            while(top>=0 && buckets[top].empty()) --top;
+            if(top<0) {
+                check_all();
+                if(top<0) break;
+                continue;
+            }
+
+            int bucket = top;
+            int msg = buckets[bucket].back(); buckets[bucket].pop_back();
+            if(msg_bucket[msg]!=bucket) continue;
+            msg_bucket[msg] = -1;
+
+            msg_residual[msg] = propose_message(msg);
+            schedule(msg);
+            if(msg_bucket[msg]<bucket) continue;  // the estimate was too large
+
+            auto target = accept_message(msg, 0.f);
+            ++n_update;
+            msg_residual[msg] = 0.f;
+            schedule(msg);
+
+            float change = refresh_node(target);
+            NodeHolder& nodes = *target.first;
+            for(int i=nodes.inbox_start[target.second]; i<nodes.inbox_start[target.second+1]; ++i) {
+                int leaving = nodes.inbox_msg[i]^1;  // messages of an edge differ in the last bit
+                msg_residual[leaving] += change;
+                schedule(leaving);
+            }
+        }
+
+        float max_residual = *max_element(begin(msg_residual), end(msg_residual));
+        return make_pair(int((n_update+n_msg-1)/n_msg), max_residual);
+    }
+
+    template <int N_ROT>
+    void refresh_node(NodeHolder& nodes, int nn) {
+        nodes.accumulate_messages<N_ROT>(nn);
+        nodes.standardize_belief_update<N_ROT>(0.f, nn);
+    }
+
+    // Returns the largest change of the node belief
+    float refresh_node(const pair<NodeHolder*,int>& node) {
+        NodeHolder& nodes = *node.first;
+        int nn = node.second;
+        float prev[6];
+        for(int no: range(nodes.n_rot)) prev[no] = nodes.cur_belief(no,nn);
+        if(&nodes==&nodes3) refresh_node<3>(nodes3, nn);
+        else                refresh_node<6>(nodes6, nn);
+
+        float change = 0.f;
+        for(int no: range(nodes.n_rot)) change = max(change, fabsf(nodes.cur_belief(no,nn)-prev[no]));
+        return change;
+    }
+
+    float propose_message(int msg) {
+        if(msg<msg_start[1]) {msg-=msg_start[0]; return edges33.propose_message<3,3>(msg>>1, msg&1);}
+        if(msg<msg_start[2]) {msg-=msg_start[1]; return edges36.propose_message<3,6>(msg>>1, msg&1);}
+        msg-=msg_start[2]; return edges66.propose_message<6,6>(msg>>1, msg&1);
+    }
+
+    // Accept the proposed message, returning the node that receives it
+    pair<NodeHolder*,int> accept_message(int msg, float damping_for_message) {
+        EdgeHolder* edges;
+        if     (msg<msg_start[1]) {msg-=msg_start[0]; edges = &edges33; edges33.accept_message<3,3>(msg>>1, msg&1, damping_for_message);}
+        else if(msg<msg_start[2]) {msg-=msg_start[1]; edges = &edges36; edges36.accept_message<3,6>(msg>>1, msg&1, damping_for_message);}
+        else                      {msg-=msg_start[2]; edges = &edges66; edges66.accept_message<6,6>(msg>>1, msg&1, damping_for_message);}
+
+        NodeHolder* nodes = msg&1 ? &edges->nodes2 : &edges->nodes1;
+        int nn = msg&1 ? edges->edge_indices2[msg>>1] : edges->edge_indices1[msg>>1];
+        return make_pair(nodes, nn);
+    }
+
     virtual std::vector<float> get_param() const override {return igraph.get_param();}
 #ifdef PARAM_DERIV
     virtual std::vector<float> get_param_deriv() override {return igraph.get_param_deriv();}
 #endif
     virtual void set_param(const std::vector<float>& new_param) override {igraph.set_param(new_param);}
+    virtual void connect_shared(SharedResources& shared) override {igraph.connect_shared(shared);}
+};
+
+template <typename BK>
+struct CreateRotamerSidechain {
+    static DerivComputation* create(hid_t grp, CoordNode& pos_node, const ArgList& prob_nodes) {
+        return new RotamerSidechain<PosQuadSplineInteraction<BK>>(grp, pos_node, prob_nodes);
+    }
 };
 
-template <typename BT>
 struct RegisterRotamerSidechain {
     RegisterRotamerSidechain(string name_prefix) {
         NodeCreationFunction f = [name_prefix](hid_t grp, const ArgList& args) {
             if(args.size()<1u) throw string("node " + name_prefix + " needs at least 1 arg");
             ArgList args_rest;
             for(int i: range(1,args.size())) args_rest.push_back(args[i]);
-            return new RotamerSidechain<BT>(grp, *args[0], args_rest);};
+            // the pair_interaction group determines the knots of the bead splines
+            return create_for_bead_knots<CreateRotamerSidechain>(
+                    open_group(grp,"pair_interaction").get(), true, grp, *args[0], args_rest);};
         add_node_creation_function(name_prefix, f);
     }
 };
 
-static RegisterRotamerSidechain<preferred_bead_type> rotamer_node ("rotamer");
+static RegisterRotamerSidechain rotamer_node ("rotamer");
@@ -91,16 +91,29 @@ struct SidechainRadialPairs : public PotentialNode
     virtual void compute_value(ComputeMode mode) {
         Timer timer(string("radial_pairs"));
 
-        igraph.compute_edges();
-        for(int ne=0; ne<igraph.n_edge; ++ne) igraph.edge_sensitivity[ne] = 1.f;
-        igraph.propagate_derivatives();
+        igraph.compute_edges(mode, n_threads);
+        if(mode!=PotentialOnlyMode) {
+            for(int ne=0; ne<igraph.n_edge; ++ne) igraph.edge_sensitivity[ne] = 1.f;
+            igraph.propagate_derivatives(n_threads);
+        }
 
-        if(mode==PotentialAndDerivMode) {
+        if(mode!=DerivMode) {
             potential = 0.f;
             for(int ne=0; ne<igraph.n_edge; ++ne) 
                 potential += igraph.edge_value[ne];
         }
     }
+
+    virtual bool compute_value_incremental() override {
+        float delta_potential;
+        if(!igraph.update_changed_edges(delta_potential)) return false;
+        potential += delta_potential;
+        return true;
+    }
+
+    virtual void connect_shared(SharedResources& shared) override {igraph.connect_shared(shared);}
+    virtual std::vector<char> get_checkpoint_state() const override {return igraph.get_checkpoint_state();}
+    virtual void set_checkpoint_state(const std::vector<char>& state) override {igraph.set_checkpoint_state(state);}
 };
 
 
@@ -117,22 +130,34 @@ struct HBondSidechainRadialPairs : public PotentialNode
     virtual void compute_value(ComputeMode mode) {
         Timer timer(string("hbond_sc_radial_pairs"));
 
-        igraph.compute_edges();
-        for(int ne=0; ne<igraph.n_edge; ++ne) igraph.edge_sensitivity[ne] = 1.f;
-        igraph.propagate_derivatives();
+        igraph.compute_edges(mode, n_threads);
+        if(mode!=PotentialOnlyMode) {
+            for(int ne=0; ne<igraph.n_edge; ++ne) igraph.edge_sensitivity[ne] = 1.f;
+            igraph.propagate_derivatives(n_threads);
+        }
 
-        if(mode==PotentialAndDerivMode) {
+        if(mode!=DerivMode) {
             potential = 0.f;
             for(int ne=0; ne<igraph.n_edge; ++ne) 
                 potential += igraph.edge_value[ne];
         }
     }
 
+    virtual bool compute_value_incremental() override {
+        float delta_potential;
+        if(!igraph.update_changed_edges(delta_potential)) return false;
+        potential += delta_potential;
+        return true;
+    }
+
     virtual std::vector<float> get_param() const override {return igraph.get_param();}
 #ifdef PARAM_DERIV
     virtual std::vector<float> get_param_deriv() override {return igraph.get_param_deriv();}
 #endif
     virtual void set_param(const std::vector<float>& new_param) override {igraph.set_param(new_param);}
+    virtual void connect_shared(SharedResources& shared) override {igraph.connect_shared(shared);}
+    virtual std::vector<char> get_checkpoint_state() const override {return igraph.get_checkpoint_state();}
+    virtual void set_checkpoint_state(const std::vector<char>& state) override {igraph.set_checkpoint_state(state);}
 };
 
 
@@ -309,6 +309,45 @@ inline Vec<2,Float4> clamped_deBoor_value_and_deriv(const float* bspline_coeff[4
     return value;
 }
 
+//! \brief Tabulate a function for cubic_table_value_and_deriv
+//!
+//! f(u) must return the value and derivative of the function at u, and the function is
+//! tabulated over [0,n_bin].  Each bin holds the 4 coefficients of the cubic Hermite
+//! interpolant on that bin, so table must hold 4*n_bin floats and be 16-byte aligned.
+template <typename F>
+inline void tabulate_cubic(float* table, int n_bin, F&& f) {
+    auto left = f(0.f);
+    for(int nb=0; nb<n_bin; ++nb) {
+        auto right = f(float(nb+1));
+        float* c = table + 4*nb;
+        c[0] = left.x();
+        c[1] = left.y();
+        c[2] = 3.f*(right.x()-left.x()) - 2.f*left.y() - right.y();
+        c[3] = 2.f*(left.x()-right.x()) +     left.y() + right.y();
+        left = right;
+    }
+}
+
+//! \brief Float4 evaluation of a table from tabulate_cubic
+//!
+//! Returns the value and derivative with respect to u.  The u values are clamped to
+//! [0,n_bin], so the table should be flat at both ends.
+inline Vec<2,Float4> cubic_table_value_and_deriv(const float* table[4], Float4 u, int n_bin) {
+    u = min(max(u, Float4()), Float4(float(n_bin)));
+    Float4 u_start = min(u, Float4(float(n_bin-1))).round<_MM_FROUND_TO_ZERO>(); // u==n_bin is in the last bin
+    Int4 u_bin = u_start.truncate_to_int();
+    Float4 t = u - u_start;
+
+    Float4 c0(table[0] + 4*u_bin.x());
+    Float4 c1(table[1] + 4*u_bin.y());
+    Float4 c2(table[2] + 4*u_bin.z());
+    Float4 c3(table[3] + 4*u_bin.w());
+    transpose4(c0,c1,c2,c3);
+
+    return make_vec2(c0 + t*(c1 + t*(c2 + t*c3)),
+                     c1 + t*(Float4(2.f)*c2 + Float4(3.f)*t*c3));
+}
+
 //! \brief Coefficient derivative for splines in the B-spline representation
 //!
 //! The derivative of a spline has 4 non-zero coefficients in the B-spline basis,
@@ -3,16 +3,36 @@
 #include "timing.h"
 #include "random.h"
 #include <string>
+#include <algorithm>
 
 using namespace std;
 
+void OrnsteinUhlenbeckThermostat::noise(float3* result, int first_atom, int n) const {
+    // the counters of max_simd_width atoms are hashed together
+    const int W = max_simd_width;
+    for(int i=0; i<n; i+=W) {
+        if(n-i >= W) {
+            normal3_lanes<W>(result+i, random_seed, THERMOSTAT_RANDOM_STREAM, first_atom+i, n_invocations);
+        } else {
+            float3 partial[W];
+            normal3_lanes<W>(partial, random_seed, THERMOSTAT_RANDOM_STREAM, first_atom+i, n_invocations);
+            for(int j=0; j<n-i; ++j) result[i+j] = partial[j];
+        }
+    }
+}
+
 void OrnsteinUhlenbeckThermostat::apply(VecArray mom, int n_atom) {
     Timer timer(string("thermostat"));
 
-    for(int na=0; na<n_atom; ++na) {
-        RandomGenerator random(random_seed, THERMOSTAT_RANDOM_STREAM, na, n_invocations);
-        auto p = load_vec<3>(mom, na);
-        store_vec(mom, na, mom_scale*p + noise_scale*random.normal3());
+    const int W = max_simd_width;
+    for(int na0=0; na0<n_atom; na0+=W) {
+        int n = min(W, n_atom-na0);
+        float3 r[W];
+        noise(r, na0, n);
+        for(int i=0; i<n; ++i) {
+            auto p = load_vec<3>(mom, na0+i);
+            store_vec(mom, na0+i, mom_scale*p + noise_scale*r[i]);
+        }
     }
     n_invocations++;
 }
@@ -35,5 +35,15 @@ struct OrnsteinUhlenbeckThermostat
         OrnsteinUhlenbeckThermostat& set_delta_t  (float delta_t_)   {
             delta_t   = delta_t_;   update_parameters(); return *this;}
 
+        uint64_t get_n_invocations() const {return n_invocations;}
+        void set_n_invocations(uint64_t n) {n_invocations = n;}
+
+        // Normals for atoms first_atom..first_atom+n-1 at the current invocation, the same
+        // as RandomGenerator(random_seed, THERMOSTAT_RANDOM_STREAM, na, n_invocations).normal3()
+        void noise(float3* result, int first_atom, int n) const;
+
+        // Count an invocation whose noise was applied by integration_stage instead of apply
+        void finish_invocation() {n_invocations++;}
+
         void apply(VecArray mom, int n_atom); 
 };
@@ -4,12 +4,15 @@
 #include <cmath>
 #include <type_traits>
 #include <memory>
+#include <new>
 #include <cstdio>
+#include <cstdlib>
 #include <cassert>
 #include <algorithm>
 #include "Float4.h"
 
 static constexpr int default_alignment=4; // suitable for SSE
+static constexpr int cache_line_bytes=64;
 
 // the function below is used to allow a version of max to be called in a constexpr context
 constexpr inline int maxint(int i, int j) {
@@ -25,14 +28,41 @@ constexpr inline int ru(int i) {
 }
 
 
+// Deleter for arrays from new_aligned.  A non-owning deleter is used for arrays
+// that point into memory owned elsewhere (see DerivEngine::allocate_arena).
+struct AlignedDeleter {
+    bool owned;
+    AlignedDeleter(bool owned_=true): owned(owned_) {}
+    void operator()(void* ptr) const {if(owned) free(ptr);}
+};
+
 template <typename T>
-static std::unique_ptr<T[]> new_aligned(int n_elem, int alignment_elems=default_alignment) {
+using aligned_ptr = std::unique_ptr<T[],AlignedDeleter>;
+
+template <typename T>
+static aligned_ptr<T> new_aligned(int n_elem, int alignment_elems=default_alignment) {
+    static_assert(std::is_trivially_destructible<T>::value, "new_aligned does not call destructors");
     // round up allocation to ensure that you can also read to the end without
     //   overstepping the array, if needed
-    T* ptr = new T[round_up(n_elem, alignment_elems)];
-    // printf("aligning %i elements at %p\n", round_up(n_elem, alignment_elems), (void*)ptr);
-    // if((unsigned long)(ptr)%(unsigned long)(alignment_elems*sizeof(T))) throw "bad alignment on string";
-    return std::unique_ptr<T[]>(ptr);
+    int n_alloc = maxint(round_up(n_elem, alignment_elems), 1);
+
+    // align to at least a cache line, and to a power of 2 at least the requested alignment
+    size_t alignment = cache_line_bytes;
+    while(alignment < alignment_elems*sizeof(T)) alignment *= 2;
+
+    void* ptr = nullptr;
+    if(posix_memalign(&ptr, alignment, n_alloc*sizeof(T))) throw std::bad_alloc();
+    T* array = static_cast<T*>(ptr);
+    for(int i=0; i<n_alloc; ++i) new(array+i) T();
+    return aligned_ptr<T>(array);
+}
+
+//! \brief Reallocate ptr to hold n_elem elements, keeping the first n_keep (the rest are zero)
+template <typename T>
+static void grow_aligned(aligned_ptr<T>& ptr, int n_keep, int n_elem, int alignment_elems=default_alignment) {
+    auto new_ptr = new_aligned<T>(n_elem, alignment_elems);
+    std::copy_n(ptr.get(), n_keep, new_ptr.get());
+    ptr = std::move(new_ptr);
 }
 
 struct VecArray {
@@ -57,7 +87,7 @@ struct VecArray {
 struct VecArrayStorage {
     int n_elem;
     int row_width;
-    std::unique_ptr<float[]> x;
+    aligned_ptr<float> x;
 
     VecArrayStorage(int elem_width_, int n_elem_):
         n_elem(n_elem_), row_width(ru(elem_width_)),
@@ -87,7 +117,7 @@ struct VecArrayStorage {
     void reset(int elem_width_, int n_elem_) {
         row_width = ru(elem_width_);
         n_elem = n_elem_;
-        x.reset(new float[n_elem*row_width]);
+        x = new_aligned<float>(n_elem*row_width);
     }
 };
 
@@ -773,6 +803,25 @@ inline Vec<D,Float4> aligned_gather_vec(const float* data, const Int4& offsets)
 }
 
 
+// Generalization of aligned_gather_vec to any lane type, which reads the rows from
+// base+stride*index[j] for each lane j
+template<int D, typename F>
+inline Vec<D,F> load_transposed_vec(const float* base, int stride, const int32_t* index) {
+    Vec<D,F> ret;
+    F extra[3]; // scratch space for the transpose
+
+    #pragma unroll
+    for(int d=0; d<D; d+=4) {
+        load_transposed4(base+d, stride, index,
+                ret[d],
+                (d+1<D ? ret[d+1] : extra[0]),
+                (d+2<D ? ret[d+2] : extra[1]),
+                (d+3<D ? ret[d+3] : extra[2]));
+    }
+    return ret;
+}
+
+
 template<int D>
 inline void aligned_scatter_store_vec_destructive(float* data, const Int4& offsets, Vec<D,Float4>& v) {
     // note that this function changes the vector v